@@ -0,0 +1,464 @@
+#include "aot.h"
+#include "jit.h"
+#include "x86_64.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+#define AOT_START_LEAVE_SIZE 640
+
+static char const aot_message_modified[] = "Error: store into the code region\n";
+static char const aot_message_unsupported[] = "Error: instruction needs the interpreter\n";
+
+/* ELF header and two program headers take 0xb0 bytes, the messages go right after them. */
+typedef char aot_messages_check[(0xb0 + sizeof(aot_message_modified) + sizeof(aot_message_unsupported) <= AOT_TEXT_OFFSET) ? 1 : -1];
+typedef char aot_context_check[(sizeof(jit_context) <= AOT_DATA_MEMORY) ? 1 : -1];
+
+
+static int32_t aot_error(char const *msg)
+{
+    printf("%s", msg);
+    return 1;
+}
+
+static uint8_t *aot_u16(uint8_t *out, uint16_t value)
+{
+    *out++ = value & 0xff;
+    *out++ = (value >> 8) & 0xff;
+    return out;
+}
+
+static uint8_t *aot_u32(uint8_t *out, uint32_t value)
+{
+    out = aot_u16(out, value & 0xffff);
+    return aot_u16(out, value >> 16);
+}
+
+static uint8_t *aot_u64(uint8_t *out, uint64_t value)
+{
+    out = aot_u32(out, value & 0xffffffff);
+    return aot_u32(out, value >> 32);
+}
+
+static uint8_t *aot_program_header(uint8_t *out, uint32_t flags, uint64_t offset, uint64_t file_size, uint64_t memory_size)
+{
+    out = aot_u32(out, 1);                              /* p_type = PT_LOAD */
+    out = aot_u32(out, flags);                          /* p_flags */
+    out = aot_u64(out, offset);                         /* p_offset */
+    out = aot_u64(out, AOT_BASE_ADDRESS + offset);      /* p_vaddr */
+    out = aot_u64(out, AOT_BASE_ADDRESS + offset);      /* p_paddr */
+    out = aot_u64(out, file_size);                      /* p_filesz */
+    out = aot_u64(out, memory_size);                    /* p_memsz */
+    return aot_u64(out, 0x1000);                        /* p_align */
+}
+
+static uint8_t *aot_elf_header(uint8_t *out, uint64_t entry)
+{
+    static uint8_t const ident[16] =
+    {
+        0x7f, 'E', 'L', 'F',
+        2,  /* ELFCLASS64 */
+        1,  /* ELFDATA2LSB */
+        1,  /* EV_CURRENT */
+        0,  /* System V ABI */
+    };
+    memcpy(out, ident, sizeof(ident));
+    out += sizeof(ident);
+    out = aot_u16(out, 2);      /* e_type = ET_EXEC */
+    out = aot_u16(out, 0x3e);   /* e_machine = x86-64 */
+    out = aot_u32(out, 1);      /* e_version */
+    out = aot_u64(out, entry);  /* e_entry */
+    out = aot_u64(out, 0x40);   /* e_phoff, program headers follow the ELF header */
+    out = aot_u64(out, 0);      /* e_shoff, no sections */
+    out = aot_u32(out, 0);      /* e_flags */
+    out = aot_u16(out, 0x40);   /* e_ehsize */
+    out = aot_u16(out, 0x38);   /* e_phentsize */
+    out = aot_u16(out, 2);      /* e_phnum */
+    out = aot_u16(out, 0);      /* e_shentsize */
+    out = aot_u16(out, 0);      /* e_shnum */
+    return aot_u16(out, 0);     /* e_shstrndx */
+}
+
+/*
+    The address in r1 and the size in r2 of a write or read syscall, as interpreter_syscall_write checks them:
+        cmp rbx, memory_size
+        ja failed
+        mov edx, memory_size
+        sub rdx, rbx
+        cmp rcx, rdx
+        ja failed
+    Fills outside[0] and outside[1] with the ends of the rel32 to link to failed.
+*/
+static uint8_t *aot_check_range(uint8_t *out, uint64_t memory_size, uint8_t **outside)
+{
+    out = x86_64_imm32(x86_64_rr(out, X86_64_W, 0x81, 7, X86_64_RBX), (int32_t) memory_size);
+    outside[0] = out = x86_64_jcc(out, X86_64_CC_A);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0xc7, 0, X86_64_RDX), (int32_t) memory_size);
+    out = x86_64_rr(out, X86_64_W, 0x29, X86_64_RBX, X86_64_RDX);
+    out = x86_64_rr(out, X86_64_W, 0x39, X86_64_RDX, X86_64_RCX);
+    outside[1] = out = x86_64_jcc(out, X86_64_CC_A);
+    return out;
+}
+
+static int32_t aot_write_all(int fd, uint8_t const *data, uint64_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0)
+        {
+            return 1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int32_t aot_write_elf(interpreter *interp, uint64_t initialized_size, char const *filename)
+{
+    uint64_t count = interp->decoded_size / 4;
+    uint64_t ip = interp->registers[BYTECODE_RIP];
+    uint64_t text_size = AOT_TEXT_OFFSET + AOT_START_LEAVE_SIZE + (count + 1) * (2 * JIT_SLOT_SIZE + 8) + 8;
+    uint64_t data_offset;
+    uint64_t data_address;
+    uint64_t flags = interpreter_flags(interp);
+    uint64_t slot;
+    uint8_t *modified, *unsupported;
+    static uint8_t const kept[5] =
+    {
+        X86_64_RCX, X86_64_RDX, X86_64_RSI, X86_64_RDI, X86_64_R11,
+    };
+    uint8_t *start, *halt, *report, *report_modified, *entries;
+    uint8_t *jump_modified, *jump_report;
+    uint8_t *jump_halt_outside, *jump_halt_invalid, *jump_halt_stop, *jump_halt_unknown;
+    uint8_t *jump_stops[2], *jump_write, *jump_read, *jump_clock, *jump_write_fd;
+    uint8_t *jump_failed[6], *jump_done, *jump_succeeded, *jump_next;
+    uint8_t padding[AOT_DATA_MEMORY] = { 0 };
+    jit_context context;
+    jit j;
+    uint8_t *out;
+    int32_t ec = 0;
+    int fd;
+    int32_t i;
+
+    if ((ip >= interp->decoded_size) || (ip & 0x3))
+    {
+        return aot_error("Error: entry point is outside of the code region\n");
+    }
+    if (interp->memory_size > 0x7fffffff)
+    {
+        return aot_error("Error: guest memory is too large for the executable\n");
+    }
+    if (initialized_size > interp->memory_size)
+    {
+        return aot_error("Error: initialised memory is larger than the guest memory\n");
+    }
+    if (interp->sandbox == INTERPRETER_SANDBOX_MASK)
+    {
+        return aot_error("Error: the executable does not mask addresses\n");
+    }
+
+    memset(&j, 0, sizeof(j));
+    j.buffer_size = text_size - 8 * (count + 1) - 8; /* The code leaves the room of the table of entries at the end */
+    j.buffer = calloc(text_size, 1);
+    j.entries = calloc(count + 1, sizeof(uint8_t *));
+    j.code_size = interp->decoded_size;
+    j.code_version = interp->code_version;
+    if ((j.buffer == 0) || (j.entries == 0))
+    {
+        free(j.buffer);
+        free(j.entries);
+        return aot_error("Error: could not allocate memory for the native code\n");
+    }
+
+    modified = j.buffer + 0xb0;
+    memcpy(modified, aot_message_modified, sizeof(aot_message_modified) - 1);
+    unsupported = modified + sizeof(aot_message_modified);
+    memcpy(unsupported, aot_message_unsupported, sizeof(aot_message_unsupported) - 1);
+
+    /* The data segment starts at the next page, so the text and data never share one. */
+    data_offset = (text_size + 0xfff) & ~(uint64_t) 0xfff;
+    data_address = AOT_BASE_ADDRESS + data_offset;
+
+    /*
+        _start:
+            mov rbp, context
+            mov r15, [rbp + memory]
+            load r0-r12
+            jmp [rbp + entry]
+    */
+    start = out = j.buffer + AOT_TEXT_OFFSET;
+    out = x86_64_mov_imm64(out, X86_64_RBP, data_address);
+    out = x86_64_rm(out, X86_64_W, 0x8b, X86_64_R15, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_MEMORY);
+    for (i = 0; i < BYTECODE_REGISTER_COUNT; i++)
+    {
+        if (bytecode_x86_64_registers[i] != X86_64_NONE)
+            out = x86_64_rm(out, X86_64_W, 0x8b, bytecode_x86_64_registers[i], X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * i);
+    }
+    out = x86_64_rm(out, 0, 0xff, 4, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_ENTRY);
+
+    /*
+        Leave, the interpreter would stop at exit_ip when the instruction there is
+        invalid or the exit SYSCALL, or exit_ip is outside of the memory. The write,
+        read and clock syscalls go to the host right here and the native code goes
+        on at the next slot, the guest registers the host syscall clobbers (and
+        the ones it takes the arguments in) are kept on the host stack:
+            cmp qword [rbp + exit_reason], JIT_EXIT_CODE_MODIFIED
+            je modified
+            push rcx, rdx, rsi, rdi, r11
+            mov rdi, [rbp + exit_ip]
+            cmp qword [rbp + exit_reason], JIT_EXIT_INTERPRET
+            jne stops
+            cmp rdi, [rbp + code_size]
+            jae stops
+            mov edx, [r15 + rdi]
+            cmp edx, BYTECODE_SYSCALL | (BYTECODE_SYSCALL_WRITE << 8)
+            je write
+            cmp edx, BYTECODE_SYSCALL | (BYTECODE_SYSCALL_READ << 8)
+            je read
+            cmp edx, BYTECODE_SYSCALL | (BYTECODE_SYSCALL_CLOCK << 8)
+            je clock
+        stops:
+            cmp rdi, memory_size
+            jae halt
+            movzx ecx, byte [r15 + rdi]
+            test ecx, ecx
+            je halt
+            cmp dword [r15 + rdi], BYTECODE_SYSCALL | (BYTECODE_SYSCALL_EXIT << 8)
+            je halt
+            cmp ecx, BYTECODE_OPCODE_COUNT
+            jae halt
+        unsupported:
+            mov rsi, unsupported
+            mov edx, length
+            jmp report
+        modified:
+            mov rsi, modified
+            mov edx, length
+        report:
+            mov eax, 1 (write)
+            mov edi, 2 (stderr)
+            syscall
+            mov eax, 1
+        halt:
+            mov rdi, rax
+            mov eax, 60 (exit)
+            syscall
+        clock:
+            sub rsp, 16
+            mov edi, 1 (CLOCK_MONOTONIC)
+            mov rsi, rsp
+            mov eax, 228 (clock_gettime)
+            syscall
+            imul rax, [rsp], 1000000000
+            add rax, [rsp + 8]
+            add rsp, 16
+            jmp next
+        write:
+            cmp rax, 1
+            je write_fd
+            cmp rax, 2
+            jne failed
+        write_fd:
+            check r1 and r2, jump to failed when outside of the memory
+            mov rdi, rax
+            lea rsi, [r15 + rbx]
+            mov rdx, rcx
+            mov eax, 1 (write)
+            syscall
+            jmp done
+        read:
+            test rax, rax
+            jne failed
+            check r1 and r2, jump to failed when outside of the memory
+            cmp rbx, [rbp + code_size]
+            jb modified
+            xor edi, edi
+            lea rsi, [r15 + rbx]
+            mov rdx, rcx
+            xor eax, eax (read)
+            syscall
+        done:
+            test rax, rax
+            jns next
+        failed:
+            mov rax, -1
+        next:
+            mov rdi, [rbp + exit_ip]
+            add rdi, rdi
+            add rdi, [rbp + entries]
+            mov rdi, [rdi + 8]
+            mov [rbp + entry], rdi
+            pop r11, rdi, rsi, rdx, rcx
+            jmp [rbp + entry]
+    */
+    j.leave = out;
+    out = x86_64_rm(out, X86_64_W, 0x81, 7, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_EXIT_REASON);
+    out = x86_64_imm32(out, JIT_EXIT_CODE_MODIFIED);
+    jump_modified = out = x86_64_jcc(out, X86_64_CC_E);
+    for (i = 0; i < 5; i++)
+        out = x86_64_push(out, kept[i]);
+    out = x86_64_rm(out, X86_64_W, 0x8b, X86_64_RDI, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_EXIT_IP);
+    out = x86_64_rm(out, X86_64_W, 0x81, 7, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_EXIT_REASON);
+    out = x86_64_imm32(out, JIT_EXIT_INTERPRET);
+    jump_stops[0] = out = x86_64_jcc(out, X86_64_CC_NE);
+    out = x86_64_rm(out, X86_64_W, 0x3b, X86_64_RDI, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_CODE_SIZE);
+    jump_stops[1] = out = x86_64_jcc(out, X86_64_CC_AE);
+    out = x86_64_rm(out, 0, 0x8b, X86_64_RDX, X86_64_R15, X86_64_RDI, 0, 0);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0x81, 7, X86_64_RDX), BYTECODE_SYSCALL | (BYTECODE_SYSCALL_WRITE << 8));
+    jump_write = out = x86_64_jcc(out, X86_64_CC_E);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0x81, 7, X86_64_RDX), BYTECODE_SYSCALL | (BYTECODE_SYSCALL_READ << 8));
+    jump_read = out = x86_64_jcc(out, X86_64_CC_E);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0x81, 7, X86_64_RDX), BYTECODE_SYSCALL | (BYTECODE_SYSCALL_CLOCK << 8));
+    jump_clock = out = x86_64_jcc(out, X86_64_CC_E);
+    x86_64_patch_rel32(jump_stops[0], out);
+    x86_64_patch_rel32(jump_stops[1], out);
+    out = x86_64_rr(out, X86_64_W, 0x81, 7, X86_64_RDI);
+    out = x86_64_imm32(out, (int32_t) interp->memory_size);
+    jump_halt_outside = out = x86_64_jcc(out, X86_64_CC_AE);
+    out = x86_64_rm(out, 0, 0x0fb6, X86_64_RCX, X86_64_R15, X86_64_RDI, 0, 0);
+    out = x86_64_rr(out, 0, 0x85, X86_64_RCX, X86_64_RCX);
+    jump_halt_invalid = out = x86_64_jcc(out, X86_64_CC_E);
+    out = x86_64_rm(out, 0, 0x81, 7, X86_64_R15, X86_64_RDI, 0, 0);
+    out = x86_64_imm32(out, BYTECODE_SYSCALL | (BYTECODE_SYSCALL_EXIT << 8));
+    jump_halt_stop = out = x86_64_jcc(out, X86_64_CC_E);
+    out = x86_64_rr(out, 0, 0x81, 7, X86_64_RCX);
+    out = x86_64_imm32(out, BYTECODE_OPCODE_COUNT);
+    jump_halt_unknown = out = x86_64_jcc(out, X86_64_CC_AE);
+    out = x86_64_mov_imm64(out, X86_64_RSI, AOT_BASE_ADDRESS + (unsupported - j.buffer));
+    out = x86_64_imm32(x86_64_rr(out, 0, 0xc7, 0, X86_64_RDX), sizeof(aot_message_unsupported) - 1);
+    jump_report = out = x86_64_jmp(out);
+    report_modified = out;
+    x86_64_patch_rel32(jump_modified, out);
+    out = x86_64_mov_imm64(out, X86_64_RSI, AOT_BASE_ADDRESS + (modified - j.buffer));
+    out = x86_64_imm32(x86_64_rr(out, 0, 0xc7, 0, X86_64_RDX), sizeof(aot_message_modified) - 1);
+    report = out;
+    x86_64_patch_rel32(jump_report, report);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0xc7, 0, X86_64_RAX), 1);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0xc7, 0, X86_64_RDI), 2);
+    out = x86_64_syscall(out);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0xc7, 0, X86_64_RAX), 1);
+    halt = out;
+    x86_64_patch_rel32(jump_halt_outside, halt);
+    x86_64_patch_rel32(jump_halt_invalid, halt);
+    x86_64_patch_rel32(jump_halt_stop, halt);
+    x86_64_patch_rel32(jump_halt_unknown, halt);
+    out = x86_64_rr(out, X86_64_W, 0x89, X86_64_RAX, X86_64_RDI);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0xc7, 0, X86_64_RAX), 60);
+    out = x86_64_syscall(out);
+
+    x86_64_patch_rel32(jump_clock, out);
+    out = x86_64_imm32(x86_64_rr(out, X86_64_W, 0x81, 5, X86_64_RSP), 16);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0xc7, 0, X86_64_RDI), 1);
+    out = x86_64_rr(out, X86_64_W, 0x89, X86_64_RSP, X86_64_RSI);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0xc7, 0, X86_64_RAX), 228);
+    out = x86_64_syscall(out);
+    out = x86_64_imm32(x86_64_rm(out, X86_64_W, 0x69, X86_64_RAX, X86_64_RSP, X86_64_NONE, 0, 0), 1000000000);
+    out = x86_64_rm(out, X86_64_W, 0x03, X86_64_RAX, X86_64_RSP, X86_64_NONE, 0, 8);
+    out = x86_64_imm32(x86_64_rr(out, X86_64_W, 0x81, 0, X86_64_RSP), 16);
+    jump_next = out = x86_64_jmp(out);
+
+    x86_64_patch_rel32(jump_write, out);
+    out = x86_64_imm32(x86_64_rr(out, X86_64_W, 0x81, 7, X86_64_RAX), 1);
+    jump_write_fd = out = x86_64_jcc(out, X86_64_CC_E);
+    out = x86_64_imm32(x86_64_rr(out, X86_64_W, 0x81, 7, X86_64_RAX), 2);
+    jump_failed[0] = out = x86_64_jcc(out, X86_64_CC_NE);
+    x86_64_patch_rel32(jump_write_fd, out);
+    out = aot_check_range(out, interp->memory_size, jump_failed + 1);
+    out = x86_64_rr(out, X86_64_W, 0x89, X86_64_RAX, X86_64_RDI);
+    out = x86_64_rm(out, X86_64_W, 0x8d, X86_64_RSI, X86_64_R15, X86_64_RBX, 0, 0);
+    out = x86_64_rr(out, X86_64_W, 0x89, X86_64_RCX, X86_64_RDX);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0xc7, 0, X86_64_RAX), 1);
+    out = x86_64_syscall(out);
+    jump_done = out = x86_64_jmp(out);
+
+    x86_64_patch_rel32(jump_read, out);
+    out = x86_64_rr(out, X86_64_W, 0x85, X86_64_RAX, X86_64_RAX);
+    jump_failed[3] = out = x86_64_jcc(out, X86_64_CC_NE);
+    out = aot_check_range(out, interp->memory_size, jump_failed + 4);
+    out = x86_64_rm(out, X86_64_W, 0x3b, X86_64_RBX, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_CODE_SIZE);
+    out = x86_64_jcc(out, X86_64_CC_B);
+    x86_64_patch_rel32(out, report_modified);
+    out = x86_64_rr(out, 0, 0x31, X86_64_RDI, X86_64_RDI);
+    out = x86_64_rm(out, X86_64_W, 0x8d, X86_64_RSI, X86_64_R15, X86_64_RBX, 0, 0);
+    out = x86_64_rr(out, X86_64_W, 0x89, X86_64_RCX, X86_64_RDX);
+    out = x86_64_rr(out, 0, 0x31, X86_64_RAX, X86_64_RAX);
+    out = x86_64_syscall(out);
+
+    x86_64_patch_rel32(jump_done, out);
+    out = x86_64_rr(out, X86_64_W, 0x85, X86_64_RAX, X86_64_RAX);
+    jump_succeeded = out = x86_64_jcc(out, X86_64_CC_NS);
+    for (i = 0; i < 6; i++)
+        x86_64_patch_rel32(jump_failed[i], out);
+    out = x86_64_imm32(x86_64_rr(out, X86_64_W, 0xc7, 0, X86_64_RAX), -1);
+
+    x86_64_patch_rel32(jump_next, out);
+    x86_64_patch_rel32(jump_succeeded, out);
+    out = x86_64_rm(out, X86_64_W, 0x8b, X86_64_RDI, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_EXIT_IP);
+    out = x86_64_rr(out, X86_64_W, 0x01, X86_64_RDI, X86_64_RDI);
+    out = x86_64_rm(out, X86_64_W, 0x03, X86_64_RDI, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_ENTRIES);
+    out = x86_64_rm(out, X86_64_W, 0x8b, X86_64_RDI, X86_64_RDI, X86_64_NONE, 0, 8);
+    out = x86_64_rm(out, X86_64_W, 0x89, X86_64_RDI, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_ENTRY);
+    for (i = 4; i >= 0; i--)
+        out = x86_64_pop(out, kept[i]);
+    out = x86_64_rm(out, 0, 0xff, 4, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_ENTRY);
+
+    j.cursor = out;
+    ec = jit_compile_region(&j, interp);
+    if (ec == 0)
+    {
+        /* RET finds the native code it returns to in a table of the addresses in the executable. */
+        entries = j.buffer + ((j.cursor - j.buffer + 7) & ~(uint64_t) 7);
+        for (slot = 0; slot <= count; slot++)
+            aot_u64(entries + 8 * slot, AOT_BASE_ADDRESS + (j.entries[slot] - j.buffer));
+        j.cursor = entries + 8 * (count + 1);
+
+        text_size = j.cursor - j.buffer;
+        aot_elf_header(j.buffer, AOT_BASE_ADDRESS + (start - j.buffer));
+        aot_program_header(j.buffer + 0x40, 0x5 /* PF_R | PF_X */, 0, text_size, text_size);
+        aot_program_header(j.buffer + 0x78, 0x6 /* PF_R | PF_W */, data_offset,
+                           AOT_DATA_MEMORY + initialized_size, AOT_DATA_MEMORY + interp->memory_size);
+
+        /* The executable starts in the state the interpreter is in now. */
+        memset(&context, 0, sizeof(context));
+        memcpy(context.registers, interp->registers, sizeof(context.registers));
+        context.flags[0] = (flags & INTERPRETER_FLAG_LESS) > 0;
+        context.flags[1] = (flags & INTERPRETER_FLAG_EQUAL) > 0;
+        context.flags[2] = (flags & INTERPRETER_FLAG_MORE) > 0;
+        context.code_size = j.code_size;
+        context.memory = (uint8_t *) (uintptr_t) (data_address + AOT_DATA_MEMORY);
+        context.entry = (void *) (uintptr_t) (AOT_BASE_ADDRESS + (j.entries[ip / 4] - j.buffer));
+        context.memory_size = interp->memory_size;
+        context.entries = (uint8_t **) (uintptr_t) (AOT_BASE_ADDRESS + (entries - j.buffer));
+        memcpy(padding, &context, sizeof(context));
+
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+        if (fd < 0)
+        {
+            ec = aot_error("Error: could not open the output file\n");
+        }
+        else
+        {
+            if (aot_write_all(fd, j.buffer, text_size) ||
+                (lseek(fd, data_offset, SEEK_SET) != (off_t) data_offset) ||
+                aot_write_all(fd, padding, sizeof(padding)) ||
+                aot_write_all(fd, interp->memory, initialized_size))
+            {
+                ec = aot_error("Error: could not write the output file\n");
+            }
+            close(fd);
+        }
+    }
+
+    free(j.buffer);
+    free(j.entries);
+    free(j.links);
+    free(j.blocks);
+    return ec;
+}
+
+#undef AOT_START_LEAVE_SIZE
@@ -0,0 +1,48 @@
+#ifndef PINAPL_AOT_H_
+#define PINAPL_AOT_H_
+
+/*
+                                    AOT
+
+    Writes the pre-decoded code region as a static ELF64 executable for x86-64 Linux,
+    no assembler or linker involved (see code/ttb/ttb.txt for the header layout).
+
+    The native code is the same the JIT makes with jit_compile_region. The file has
+    two segments:
+        text (r-x): ELF header, program headers, messages, _start and the native code
+        data (rw-): jit_context with the initial registers, then the guest memory
+
+    Only the first initialized_size bytes of the guest memory go into the file,
+    the rest is zero and the loader makes it out of zero pages.
+
+    The program runs until the interpreter would stop: an invalid instruction,
+    the exit SYSCALL, or falling off the end of the code. Then it exits with r0
+    as the exit status.
+
+    The write, read and clock syscalls are host syscalls made right in the
+    executable, with the checks of the interpreter, but writes are not buffered.
+    A read into the code region counts as a store into it.
+
+    Things only the interpreter can do (r15 operands, jumps out of the code
+    region, stores into the code region) end the program with a message on
+    stderr and exit status 1 instead.
+
+    The guest memory of the executable is not sandboxed: a guarded interpreter
+    makes an unguarded executable, and a masked one is refused.
+*/
+
+#include <stdint.h>
+#include "interpreter.h"
+
+
+enum
+{
+    AOT_BASE_ADDRESS = 0x400000,
+    AOT_TEXT_OFFSET  = 0x100,    /* Native code starts here, after the headers and messages */
+    AOT_DATA_MEMORY  = 0x200,    /* Guest memory starts here in the data segment, after the context */
+};
+
+int32_t aot_write_elf(interpreter *interp, uint64_t initialized_size, char const *filename);
+
+
+#endif /* PINAPL_AOT_H_ */
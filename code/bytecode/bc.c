@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE /* clock_gettime, sigaction, MAP_ANONYMOUS */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -37,16 +38,23 @@ int main()
     bytecode i = { .opcode = BYTECODE_MOV_RI, .r0 = BYTECODE_R8, .imm = 0x22 };
     bytecode_encode_x86_64(interpreter.memory + byte_offset, interpreter.memory_size, i);
 
-    int32_t ec = 0;
+    int32_t ec = interpreter_predecode(&interpreter, byte_offset);
+    if (ec != 0)
+    {
+        return 1;
+    }
+
     do
     {
-        ec = interpreter_step(&interpreter);
+        ec = interpreter_run(&interpreter, UINT64_MAX);
     }
-    while (ec == 0);
+    while (ec == INTERPRETER_BUDGET_EXHAUSTED);
     interpreter_print_state(&interpreter);
+    interpreter_print_profile(&interpreter);
 
     return 0;
 }
 
 #include "bytecode.c"
+#include "x86_64.c"
 #include "interpreter.c"
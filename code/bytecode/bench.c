@@ -0,0 +1,1068 @@
+/*
+    Benchmarks of the bytecode machine, run the ones named in the arguments:
+
+        registers   the same loop with r0-r15 and with r0-r31, see bench_registers
+        fib         recursive Fibonacci, a CALL and a RET for every number, see bench_fib
+        write       many small writes to stdout, see bench_write
+        sandbox     loads and stores with each INTERPRETER_SANDBOX_*, see bench_sandbox
+        memory      scattered accesses over a big heap, 4K and 2M pages, see bench_memory
+        pool        thousands of small programs on 1 to all cores, see bench_pool
+        fork        instances started from a warmed up snapshot, see bench_fork
+
+    Build it with optimisations, the numbers are meaningless otherwise:
+        gcc -O2 -pthread -Icode/ -o bin/bench code/bytecode/bench.c
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "interpreter.h"
+#include "jit.h"
+#include "pool.h"
+
+#define ARRAY_COUNT(A) (sizeof(A) / sizeof(A[0]))
+
+
+typedef struct
+{
+    interpreter interp;
+    uint64_t cursor;
+    uint64_t loop_address;
+
+    /* Counted over the loop body only */
+    uint64_t instruction_count;
+    uint64_t load_count;
+    uint64_t store_count;
+} bench_program;
+
+/* Set around bench_init by the benchmarks that compare page sizes */
+static int32_t bench_huge_pages;
+
+static double bench_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int32_t bench_init(bench_program *p, uint64_t memory_size, uint32_t sandbox)
+{
+    memset(p, 0, sizeof(*p));
+    p->interp.sandbox = sandbox;
+    p->interp.huge_pages = bench_huge_pages;
+    return interpreter_create_memory(&p->interp, memory_size);
+}
+
+static void bench_release(bench_program *p)
+{
+    interpreter_release_memory(&p->interp);
+    free(p->interp.decoded);
+    memset(p, 0, sizeof(*p));
+}
+
+static void bench_emit(bench_program *p, bytecode bc)
+{
+    p->cursor += bytecode_encode(p->interp.memory + p->cursor, p->interp.memory_size - p->cursor, bc);
+    p->instruction_count += 1;
+    if ((bc.opcode >= BYTECODE_LDR8_RI) && (bc.opcode <= BYTECODE_LDR64_RA))
+        p->load_count += 1;
+    if ((bc.opcode >= BYTECODE_STR8_RI) && (bc.opcode <= BYTECODE_STR64_RA))
+        p->store_count += 1;
+}
+
+/* Closes the loop started at p->loop_address, the counter in COUNTER goes down to 0 */
+static void bench_emit_loop_end(bench_program *p, uint8_t counter)
+{
+    bytecode bc;
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_SUB_RRI; bc.r0 = counter; bc.r1 = counter; bc.imm = 1;
+    bench_emit(p, bc);
+    bc.opcode = BYTECODE_CMP_RI; bc.r0 = counter; bc.imm = 0;
+    bench_emit(p, bc);
+    bc.opcode = BYTECODE_JNE_I; bc.imm = (int32_t) (p->loop_address - (p->cursor + 4));
+    bench_emit(p, bc);
+}
+
+/* Runs until the program stops, returns the seconds it took */
+static double bench_run(bench_program *p, int32_t use_jit)
+{
+    double start = bench_seconds();
+    if (use_jit)
+    {
+        jit j;
+        memset(&j, 0, sizeof(j));
+        jit_run(&j, &p->interp);
+        jit_release(&j);
+    }
+    else
+    {
+        while (interpreter_run(&p->interp, UINT64_MAX) == INTERPRETER_BUDGET_EXHAUSTED);
+    }
+    return bench_seconds() - start;
+}
+
+
+/*
+    Registers
+
+    A loop keeps BENCH_VALUE_COUNT values live and adds every one of them to the next:
+        v[k] = v[k] + v[k + 1]
+
+    With 16 registers only r0-r12 are free, r12 is the counter and two are
+    needed to bring values in, so most of the values live in memory and every
+    use of them is a load, every change a store. With the WIDE prefix they all
+    fit in r0-r9 and r16-r29, and the loop is only the additions.
+*/
+enum
+{
+    BENCH_VALUE_COUNT = 24,
+    BENCH_VALUE_SPILL = 0x800,  /* Memory of the values without a register */
+    BENCH_ITERATIONS = 2000000,
+    BENCH_COUNTER = BYTECODE_R12,
+    BENCH_SCRATCH = BYTECODE_R10, /* And the one after it */
+    BENCH_SPILLED = 0xff,
+};
+
+/* Register of the value, BENCH_SPILLED when it lives in memory */
+static uint8_t bench_value_register(uint32_t wide, uint32_t value)
+{
+    if (value < 10)
+        return value;
+    if (wide)
+        return 16 + (value - 10);
+    return BENCH_SPILLED;
+}
+
+static int32_t bench_registers_build(bench_program *p, uint32_t wide)
+{
+    uint32_t k;
+    if (bench_init(p, 0x1000, INTERPRETER_SANDBOX_NONE))
+    {
+        return 1;
+    }
+
+    p->loop_address = p->cursor;
+    for (k = 0; k < BENCH_VALUE_COUNT; k++)
+    {
+        uint32_t next = (k + 1) % BENCH_VALUE_COUNT;
+        uint8_t d = bench_value_register(wide, k);
+        uint8_t a = bench_value_register(wide, next);
+        bytecode bc;
+        memset(&bc, 0, sizeof(bc));
+        if (d == BENCH_SPILLED)
+        {
+            d = BENCH_SCRATCH;
+            bc.opcode = BYTECODE_LDR64_RI; bc.r0 = d; bc.imm = BENCH_VALUE_SPILL + 8 * k;
+            bench_emit(p, bc);
+        }
+        if (a == BENCH_SPILLED)
+        {
+            a = BENCH_SCRATCH + 1;
+            bc.opcode = BYTECODE_LDR64_RI; bc.r0 = a; bc.imm = BENCH_VALUE_SPILL + 8 * next;
+            bench_emit(p, bc);
+        }
+        bc.opcode = BYTECODE_ADD_RRR; bc.r0 = d; bc.r1 = d; bc.r2 = a;
+        bench_emit(p, bc);
+        if (d == BENCH_SCRATCH)
+        {
+            bc.opcode = BYTECODE_STR64_RI; bc.r0 = d; bc.imm = BENCH_VALUE_SPILL + 8 * k;
+            bench_emit(p, bc);
+        }
+    }
+    bench_emit_loop_end(p, BENCH_COUNTER);
+
+    for (k = 0; k < BENCH_VALUE_COUNT; k++)
+    {
+        uint8_t r = bench_value_register(wide, k);
+        if (r == BENCH_SPILLED)
+            *(uint64_t *) (p->interp.memory + BENCH_VALUE_SPILL + 8 * k) = k + 1;
+        else
+            p->interp.registers[r] = k + 1;
+    }
+    p->interp.registers[BENCH_COUNTER] = BENCH_ITERATIONS;
+    return interpreter_predecode(&p->interp, p->cursor);
+}
+
+static uint64_t bench_registers_checksum(bench_program *p, uint32_t wide)
+{
+    uint64_t sum = 0;
+    uint32_t k;
+    for (k = 0; k < BENCH_VALUE_COUNT; k++)
+    {
+        uint8_t r = bench_value_register(wide, k);
+        uint64_t v = (r == BENCH_SPILLED) ? *(uint64_t *) (p->interp.memory + BENCH_VALUE_SPILL + 8 * k) : p->interp.registers[r];
+        sum = sum * 31 + v;
+    }
+    return sum;
+}
+
+static int32_t bench_registers(void)
+{
+    static char const *names[2] = { "r0-r15", "r0-r31" };
+    uint64_t checksums[2][2];
+    uint32_t wide;
+    int32_t use_jit;
+
+    printf("registers: %d live values, %d iterations\n", BENCH_VALUE_COUNT, BENCH_ITERATIONS);
+    printf("            instructions  loads  stores  code bytes  interpreter ns/iter  jit ns/iter\n");
+    for (wide = 0; wide < 2; wide++)
+    {
+        double seconds[2];
+        bench_program p;
+        for (use_jit = 0; use_jit < 2; use_jit++)
+        {
+            if (bench_registers_build(&p, wide))
+            {
+                return 1;
+            }
+            seconds[use_jit] = bench_run(&p, use_jit);
+            checksums[wide][use_jit] = bench_registers_checksum(&p, wide);
+            if (use_jit == 0)
+            {
+                printf("  %s  %12llu  %5llu  %6llu  %10llu", names[wide],
+                    (unsigned long long) p.instruction_count, (unsigned long long) p.load_count,
+                    (unsigned long long) p.store_count, (unsigned long long) p.cursor);
+            }
+            bench_release(&p);
+        }
+        printf("  %19.2f  %11.2f\n", seconds[0] * 1e9 / BENCH_ITERATIONS, seconds[1] * 1e9 / BENCH_ITERATIONS);
+    }
+
+    if ((checksums[0][0] != checksums[0][1]) || (checksums[0][0] != checksums[1][0]) || (checksums[0][0] != checksums[1][1]))
+    {
+        printf("Error: the variants computed different values\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+    Fib
+
+    The recursive Fibonacci, so the time goes into CALL and RET:
+        main:   mov r0, BENCH_FIB_N
+                call fib
+                (0, stops)
+        fib:    cmp r0, 2
+                jl done
+                sub r13, r13, 16
+                str64 r0, [r13]
+                sub r0, r0, 1
+                call fib
+                str64 r0, [r13 + 8]
+                ldr64 r0, [r13]
+                sub r0, r0, 2
+                call fib
+                ldr64 r1, [r13 + 8]
+                add r0, r0, r1
+                add r13, r13, 16
+        done:   ret
+
+    The depth stays below INTERPRETER_RETURN_STACK_SIZE, so every return should be predicted.
+*/
+enum
+{
+    BENCH_FIB_N = 30,
+    BENCH_FIB_RESULT = 832040,
+    BENCH_FIB_CALLS = 2692537,  /* 2 * fib(N + 1) - 1 */
+    BENCH_FIB_ADDRESS = 12,
+    BENCH_FIB_MEMORY = 0x10000,
+};
+
+static void bench_fib_emit(bench_program *p, uint8_t opcode, uint8_t r0, uint8_t r1, int32_t imm)
+{
+    bytecode bc;
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = opcode; bc.r0 = r0; bc.r1 = r1; bc.imm = imm;
+    bench_emit(p, bc);
+}
+
+/* [r13 + offset] */
+static void bench_fib_emit_stack(bench_program *p, uint8_t opcode, uint8_t r0, uint8_t offset)
+{
+    bytecode bc;
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = opcode; bc.r0 = r0; bc.r2 = BYTECODE_RSP; bc.cr = 1; bc.a = offset;
+    bench_emit(p, bc);
+}
+
+static int32_t bench_fib_build(bench_program *p)
+{
+    uint64_t done = BENCH_FIB_ADDRESS + 13 * 4;
+    bytecode bc;
+    if (bench_init(p, BENCH_FIB_MEMORY, INTERPRETER_SANDBOX_NONE))
+    {
+        return 1;
+    }
+
+    bench_fib_emit(p, BYTECODE_MOV_RI, BYTECODE_R0, 0, BENCH_FIB_N);
+    bench_fib_emit(p, BYTECODE_CALL_I, 0, 0, BENCH_FIB_ADDRESS - (p->cursor + 4));
+    p->cursor = BENCH_FIB_ADDRESS;
+
+    bench_fib_emit(p, BYTECODE_CMP_RI, BYTECODE_R0, 0, 2);
+    bench_fib_emit(p, BYTECODE_JL_I, 0, 0, done - (p->cursor + 4));
+    bench_fib_emit(p, BYTECODE_SUB_RRI, BYTECODE_RSP, BYTECODE_RSP, 16);
+    bench_fib_emit_stack(p, BYTECODE_STR64_RA, BYTECODE_R0, 0);
+    bench_fib_emit(p, BYTECODE_SUB_RRI, BYTECODE_R0, BYTECODE_R0, 1);
+    bench_fib_emit(p, BYTECODE_CALL_I, 0, 0, BENCH_FIB_ADDRESS - (p->cursor + 4));
+    bench_fib_emit_stack(p, BYTECODE_STR64_RA, BYTECODE_R0, 8);
+    bench_fib_emit_stack(p, BYTECODE_LDR64_RA, BYTECODE_R0, 0);
+    bench_fib_emit(p, BYTECODE_SUB_RRI, BYTECODE_R0, BYTECODE_R0, 2);
+    bench_fib_emit(p, BYTECODE_CALL_I, 0, 0, BENCH_FIB_ADDRESS - (p->cursor + 4));
+    bench_fib_emit_stack(p, BYTECODE_LDR64_RA, BYTECODE_R1, 8);
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_ADD_RRR; bc.r0 = BYTECODE_R0; bc.r1 = BYTECODE_R0; bc.r2 = BYTECODE_R1;
+    bench_emit(p, bc);
+    bench_fib_emit(p, BYTECODE_ADD_RRI, BYTECODE_RSP, BYTECODE_RSP, 16);
+    bench_fib_emit(p, BYTECODE_RET, 0, 0, 0);
+
+    p->interp.registers[BYTECODE_RSP] = p->interp.memory_size;
+    return interpreter_predecode(&p->interp, p->cursor);
+}
+
+static int32_t bench_fib(void)
+{
+    static char const *names[2] = { "interpreter", "jit" };
+    int32_t use_jit;
+
+    printf("fib: fib(%d), %d calls\n", BENCH_FIB_N, BENCH_FIB_CALLS);
+    printf("                 ns/call  mispredicted returns\n");
+    for (use_jit = 0; use_jit < 2; use_jit++)
+    {
+        bench_program p;
+        double seconds;
+        if (bench_fib_build(&p))
+        {
+            return 1;
+        }
+        seconds = bench_run(&p, use_jit);
+        printf("  %-11s  %10.2f  %20llu\n", names[use_jit], seconds * 1e9 / BENCH_FIB_CALLS,
+            (unsigned long long) p.interp.return_mispredicts);
+        if ((p.interp.registers[BYTECODE_R0] != BENCH_FIB_RESULT) || (p.interp.registers[BYTECODE_RSP] != p.interp.memory_size))
+        {
+            printf("Error: fib(%d) returned %llu\n", BENCH_FIB_N, (unsigned long long) p.interp.registers[BYTECODE_R0]);
+            bench_release(&p);
+            return 1;
+        }
+        bench_release(&p);
+    }
+    return 0;
+}
+
+
+/*
+    Write
+
+    A loop writes the same BENCH_WRITE_SIZE bytes to stdout BENCH_WRITE_COUNT times:
+        loop:   mov r0, 1
+                mov r1, BENCH_WRITE_DATA
+                mov r2, BENCH_WRITE_SIZE
+                syscall WRITE
+                (the loop end)
+
+    The interpreter collects the writes and makes a few big host writes, compared
+    with the host making one write(2) per line itself. Stdout goes to /dev/null meanwhile.
+*/
+enum
+{
+    BENCH_WRITE_COUNT = 1000000,
+    BENCH_WRITE_SIZE = 16,
+    BENCH_WRITE_DATA = 0x800,
+    BENCH_WRITE_COUNTER = BYTECODE_R12,
+};
+
+static int32_t bench_write_build(bench_program *p)
+{
+    bytecode bc;
+    if (bench_init(p, 0x1000, INTERPRETER_SANDBOX_NONE))
+    {
+        return 1;
+    }
+    memcpy(p->interp.memory + BENCH_WRITE_DATA, "0123456789abcde\n", BENCH_WRITE_SIZE);
+
+    p->loop_address = p->cursor;
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_MOV_RI; bc.r0 = BYTECODE_R0; bc.imm = 1;
+    bench_emit(p, bc);
+    bc.opcode = BYTECODE_MOV_RI; bc.r0 = BYTECODE_R1; bc.imm = BENCH_WRITE_DATA;
+    bench_emit(p, bc);
+    bc.opcode = BYTECODE_MOV_RI; bc.r0 = BYTECODE_R2; bc.imm = BENCH_WRITE_SIZE;
+    bench_emit(p, bc);
+    bc.opcode = BYTECODE_SYSCALL; bc.imm = BYTECODE_SYSCALL_WRITE;
+    bench_emit(p, bc);
+    bench_emit_loop_end(p, BENCH_WRITE_COUNTER);
+
+    p->interp.registers[BENCH_WRITE_COUNTER] = BENCH_WRITE_COUNT;
+    return interpreter_predecode(&p->interp, p->cursor);
+}
+
+static int32_t bench_write(void)
+{
+    static char const line[BENCH_WRITE_SIZE + 1] = "0123456789abcde\n";
+    double seconds[2];
+    uint64_t host_writes;
+    int32_t complete;
+    bench_program p;
+    int32_t i;
+    int saved_stdout;
+    int null_fd;
+
+    if (bench_write_build(&p))
+    {
+        return 1;
+    }
+
+    fflush(stdout);
+    saved_stdout = dup(1);
+    null_fd = open("/dev/null", O_WRONLY);
+    if ((saved_stdout < 0) || (null_fd < 0) || (dup2(null_fd, 1) < 0))
+    {
+        printf("Error: could not redirect stdout to /dev/null\n");
+        bench_release(&p);
+        return 1;
+    }
+    close(null_fd);
+
+    seconds[0] = bench_seconds();
+    for (i = 0; i < BENCH_WRITE_COUNT; i++)
+    {
+        if (write(1, line, BENCH_WRITE_SIZE) != BENCH_WRITE_SIZE)
+            break;
+    }
+    seconds[0] = bench_seconds() - seconds[0];
+
+    seconds[1] = bench_run(&p, 0);
+    interpreter_flush(&p.interp);
+    host_writes = p.interp.host_writes;
+    complete = (p.interp.write_syscalls == BENCH_WRITE_COUNT);
+    bench_release(&p);
+
+    dup2(saved_stdout, 1);
+    close(saved_stdout);
+
+    printf("write: %d writes of %d bytes to /dev/null\n", BENCH_WRITE_COUNT, BENCH_WRITE_SIZE);
+    printf("                         host writes  ns/write\n");
+    printf("  write(2) every time   %12d  %8.2f\n", BENCH_WRITE_COUNT, seconds[0] * 1e9 / BENCH_WRITE_COUNT);
+    printf("  guest, buffered       %12llu  %8.2f\n", (unsigned long long) host_writes, seconds[1] * 1e9 / BENCH_WRITE_COUNT);
+    if (!complete)
+    {
+        printf("Error: the guest did not make all of the writes\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+    Sandbox
+
+    A loop adds the counter into an array and into a sum kept in memory,
+    so four of its ten instructions are loads and stores:
+        loop:   and r1, r12, BENCH_SANDBOX_INDEX_MASK
+                ldr64 r2, [8*r1 + r4]
+                add r2, r2, r12
+                str64 r2, [8*r1 + r4]
+                ldr64 r3, [BENCH_SANDBOX_SUM]
+                add r3, r3, r2
+                str64 r3, [BENCH_SANDBOX_SUM]
+                (the loop end)
+
+    r4 holds BENCH_SANDBOX_ARRAY. The same program runs in the interpreter
+    with every sandbox, none of them should cost more than noise.
+*/
+enum
+{
+    BENCH_SANDBOX_ITERATIONS = 5000000,
+    BENCH_SANDBOX_MEMORY = 0x4000,      /* A power of two for INTERPRETER_SANDBOX_MASK */
+    BENCH_SANDBOX_SUM = 0x800,
+    BENCH_SANDBOX_ARRAY = 0x1000,
+    BENCH_SANDBOX_INDEX_MASK = 0x3ff,
+    BENCH_SANDBOX_COUNTER = BYTECODE_R12,
+};
+
+static void bench_sandbox_emit_indexed(bench_program *p, uint8_t opcode, uint8_t r0)
+{
+    bytecode bc;
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = opcode; bc.r0 = r0; bc.r1 = BYTECODE_R1; bc.r2 = BYTECODE_R4; bc.cc = 1; bc.c = 3; bc.cr = 1;
+    bench_emit(p, bc);
+}
+
+static int32_t bench_sandbox_build(bench_program *p, uint32_t sandbox)
+{
+    bytecode bc;
+    if (bench_init(p, BENCH_SANDBOX_MEMORY, sandbox))
+    {
+        return 1;
+    }
+
+    p->loop_address = p->cursor;
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_AND_RRI; bc.r0 = BYTECODE_R1; bc.r1 = BENCH_SANDBOX_COUNTER; bc.imm = BENCH_SANDBOX_INDEX_MASK;
+    bench_emit(p, bc);
+    bench_sandbox_emit_indexed(p, BYTECODE_LDR64_RA, BYTECODE_R2);
+    bc.opcode = BYTECODE_ADD_RRR; bc.r0 = BYTECODE_R2; bc.r1 = BYTECODE_R2; bc.r2 = BENCH_SANDBOX_COUNTER;
+    bench_emit(p, bc);
+    bench_sandbox_emit_indexed(p, BYTECODE_STR64_RA, BYTECODE_R2);
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_LDR64_RI; bc.r0 = BYTECODE_R3; bc.imm = BENCH_SANDBOX_SUM;
+    bench_emit(p, bc);
+    bc.opcode = BYTECODE_ADD_RRR; bc.r0 = BYTECODE_R3; bc.r1 = BYTECODE_R3; bc.r2 = BYTECODE_R2;
+    bench_emit(p, bc);
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_STR64_RI; bc.r0 = BYTECODE_R3; bc.imm = BENCH_SANDBOX_SUM;
+    bench_emit(p, bc);
+    bench_emit_loop_end(p, BENCH_SANDBOX_COUNTER);
+
+    p->interp.registers[BYTECODE_R4] = BENCH_SANDBOX_ARRAY;
+    p->interp.registers[BENCH_SANDBOX_COUNTER] = BENCH_SANDBOX_ITERATIONS;
+    return interpreter_predecode(&p->interp, p->cursor);
+}
+
+static int32_t bench_sandbox(void)
+{
+    static char const *names[3] = { "unchecked", "guard", "mask" };
+    uint64_t sums[3];
+    uint32_t sandbox;
+
+    printf("sandbox: %d iterations\n", BENCH_SANDBOX_ITERATIONS);
+    printf("               instructions  loads  stores  interpreter ns/iter\n");
+    for (sandbox = INTERPRETER_SANDBOX_NONE; sandbox <= INTERPRETER_SANDBOX_MASK; sandbox++)
+    {
+        bench_program p;
+        double seconds;
+        if (bench_sandbox_build(&p, sandbox))
+        {
+            return 1;
+        }
+        seconds = bench_run(&p, 0);
+        sums[sandbox] = *(uint64_t *) (p.interp.memory + BENCH_SANDBOX_SUM);
+        printf("  %-10s  %12llu  %5llu  %6llu  %19.2f\n", names[sandbox],
+            (unsigned long long) p.instruction_count, (unsigned long long) p.load_count,
+            (unsigned long long) p.store_count, seconds * 1e9 / BENCH_SANDBOX_ITERATIONS);
+        bench_release(&p);
+    }
+
+    if ((sums[0] != sums[1]) || (sums[0] != sums[2]))
+    {
+        printf("Error: the sandboxes computed different sums\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+    Memory
+
+    A loop walks a heap of BENCH_MEMORY_HEAP bytes in the order of a linear
+    congruential generator, so nearly every access lands on another page:
+        loop:   mul r1, r1, BENCH_MEMORY_MULTIPLIER
+                add r1, r1, BENCH_MEMORY_INCREMENT
+                and r2, r1, r5
+                ldr64 r3, [8*r2 + r6]
+                add r4, r4, r3
+                str64 r4, [8*r2 + r6]
+                (the loop end)
+
+    r5 holds the number of qwords in the heap minus one, r6 the heap address.
+    Nothing sizes the heap up front, the guest memory is BENCH_MEMORY_SIZE of address
+    space and the pages get committed by the accesses, which is part of the time.
+*/
+enum
+{
+    BENCH_MEMORY_ITERATIONS = 10000000,
+    BENCH_MEMORY_SIZE = 0x40000000,
+    BENCH_MEMORY_HEAP = 0x10000000,
+    BENCH_MEMORY_HEAP_ADDRESS = 0x200000,
+    BENCH_MEMORY_MULTIPLIER = 20077,    /* 1 mod 4 and an odd increment, the low bits go through every value */
+    BENCH_MEMORY_INCREMENT = 12345,
+    BENCH_MEMORY_COUNTER = BYTECODE_R12,
+};
+
+static int32_t bench_memory_build(bench_program *p, int32_t huge_pages)
+{
+    bytecode bc;
+    int32_t ec;
+    bench_huge_pages = huge_pages;
+    ec = bench_init(p, BENCH_MEMORY_SIZE, INTERPRETER_SANDBOX_NONE);
+    bench_huge_pages = 0;
+    if (ec)
+    {
+        return 1;
+    }
+
+    p->loop_address = p->cursor;
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_MUL_RRI; bc.r0 = BYTECODE_R1; bc.r1 = BYTECODE_R1; bc.imm = BENCH_MEMORY_MULTIPLIER;
+    bench_emit(p, bc);
+    bc.opcode = BYTECODE_ADD_RRI; bc.r0 = BYTECODE_R1; bc.r1 = BYTECODE_R1; bc.imm = BENCH_MEMORY_INCREMENT;
+    bench_emit(p, bc);
+    bc.opcode = BYTECODE_AND_RRR; bc.r0 = BYTECODE_R2; bc.r1 = BYTECODE_R1; bc.r2 = BYTECODE_R5;
+    bench_emit(p, bc);
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_LDR64_RA; bc.r0 = BYTECODE_R3; bc.r1 = BYTECODE_R2; bc.r2 = BYTECODE_R6; bc.cc = 1; bc.c = 3; bc.cr = 1;
+    bench_emit(p, bc);
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_ADD_RRR; bc.r0 = BYTECODE_R4; bc.r1 = BYTECODE_R4; bc.r2 = BYTECODE_R3;
+    bench_emit(p, bc);
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_STR64_RA; bc.r0 = BYTECODE_R4; bc.r1 = BYTECODE_R2; bc.r2 = BYTECODE_R6; bc.cc = 1; bc.c = 3; bc.cr = 1;
+    bench_emit(p, bc);
+    bench_emit_loop_end(p, BENCH_MEMORY_COUNTER);
+
+    p->interp.registers[BYTECODE_R4] = 1;
+    p->interp.registers[BYTECODE_R5] = BENCH_MEMORY_HEAP / 8 - 1;
+    p->interp.registers[BYTECODE_R6] = BENCH_MEMORY_HEAP_ADDRESS;
+    p->interp.registers[BENCH_MEMORY_COUNTER] = BENCH_MEMORY_ITERATIONS;
+    return interpreter_predecode(&p->interp, p->cursor);
+}
+
+static int32_t bench_memory(void)
+{
+    static char const *names[2] = { "4K pages", "2M pages" };
+    uint64_t sums[2];
+    int32_t huge_pages;
+
+    printf("memory: %d accesses over %d MiB of a %d MiB guest memory\n", BENCH_MEMORY_ITERATIONS,
+        BENCH_MEMORY_HEAP >> 20, BENCH_MEMORY_SIZE >> 20);
+    printf("              interpreter ns/iter  jit ns/iter  committed MiB\n");
+    for (huge_pages = 0; huge_pages < 2; huge_pages++)
+    {
+        double seconds[2];
+        uint64_t committed = 0;
+        int32_t use_jit;
+        for (use_jit = 0; use_jit < 2; use_jit++)
+        {
+            bench_program p;
+            if (bench_memory_build(&p, huge_pages))
+            {
+                return 1;
+            }
+            seconds[use_jit] = bench_run(&p, use_jit);
+            sums[huge_pages] = p.interp.registers[BYTECODE_R4];
+            committed = interpreter_committed_size(&p.interp);
+            bench_release(&p);
+        }
+        printf("  %-10s  %19.2f  %11.2f  %13llu\n", names[huge_pages], seconds[0] * 1e9 / BENCH_MEMORY_ITERATIONS,
+            seconds[1] * 1e9 / BENCH_MEMORY_ITERATIONS, (unsigned long long) (committed >> 20));
+    }
+
+    if (sums[0] != sums[1])
+    {
+        printf("Error: the page sizes computed different sums\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+    Pool
+
+    BENCH_POOL_JOBS instances of the same program, each one its own job:
+        loop:   add r0, r0, r12
+                (the loop end)
+                syscall EXIT
+
+    Every BENCH_POOL_LONG_EVERY-th job counts down from BENCH_POOL_LONG_ITERATIONS,
+    the others from BENCH_POOL_SHORT_ITERATIONS, so the long ones get preempted
+    many times and the short ones run in between. The jobs go through pools of
+    1, 2, 4, ... workers up to one per core, the time is from the first submit
+    until the last job finished.
+*/
+enum
+{
+    BENCH_POOL_JOBS = 4096,
+    BENCH_POOL_LONG_EVERY = 64,
+    BENCH_POOL_SHORT_ITERATIONS = 1000,
+    BENCH_POOL_LONG_ITERATIONS = 200000,
+    BENCH_POOL_BUDGET = 10000,
+    BENCH_POOL_MEMORY = 0x1000,
+    BENCH_POOL_COUNTER = BYTECODE_R12,
+};
+
+static int32_t bench_pool_build(bench_program *p)
+{
+    bytecode bc;
+    if (bench_init(p, BENCH_POOL_MEMORY, INTERPRETER_SANDBOX_NONE))
+    {
+        return 1;
+    }
+    p->loop_address = p->cursor;
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_ADD_RRR; bc.r0 = BYTECODE_R0; bc.r1 = BYTECODE_R0; bc.r2 = BENCH_POOL_COUNTER;
+    bench_emit(p, bc);
+    bench_emit_loop_end(p, BENCH_POOL_COUNTER);
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_SYSCALL; bc.imm = BYTECODE_SYSCALL_EXIT;
+    bench_emit(p, bc);
+    return 0;
+}
+
+static uint64_t bench_pool_iterations(uint32_t job)
+{
+    return (job % BENCH_POOL_LONG_EVERY == 0) ? BENCH_POOL_LONG_ITERATIONS : BENCH_POOL_SHORT_ITERATIONS;
+}
+
+/* Fresh instances for every job, the program copied from the template */
+static int32_t bench_pool_prepare(interpreter *instances, pool_job *jobs, bench_program *program)
+{
+    uint32_t i;
+    for (i = 0; i < BENCH_POOL_JOBS; i++)
+    {
+        interpreter *interp = instances + i;
+        if (interpreter_create_memory(interp, BENCH_POOL_MEMORY))
+        {
+            return 1;
+        }
+        memcpy(interp->memory, program->interp.memory, program->cursor);
+        interp->registers[BENCH_POOL_COUNTER] = bench_pool_iterations(i);
+        if (interpreter_predecode(interp, program->cursor))
+        {
+            return 1;
+        }
+        jobs[i].interp = interp;
+    }
+    return 0;
+}
+
+static int32_t bench_pool_check(interpreter *instances, pool_job *jobs)
+{
+    int32_t ec = 0;
+    uint32_t i;
+    for (i = 0; i < BENCH_POOL_JOBS; i++)
+    {
+        uint64_t n = bench_pool_iterations(i);
+        if ((jobs[i].status != INTERPRETER_EXITED) || (instances[i].registers[BYTECODE_R0] != n * (n + 1) / 2))
+            ec = 1;
+        interpreter_release_memory(instances + i);
+        free(instances[i].decoded);
+        memset(instances + i, 0, sizeof(interpreter));
+    }
+    return ec;
+}
+
+static int32_t bench_pool(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t worker_count = 1;
+    double jobs_per_second_1 = 0;
+    bench_program program;
+    interpreter *instances;
+    pool_job *jobs;
+    int32_t ec = 0;
+
+    if (cores < 1)
+        cores = 1;
+    if (cores > POOL_MAX_WORKERS)
+        cores = POOL_MAX_WORKERS;
+    if (bench_pool_build(&program))
+    {
+        return 1;
+    }
+    /* Mostly the output buffers, which are never touched */
+    instances = calloc(BENCH_POOL_JOBS, sizeof(interpreter));
+    jobs = calloc(BENCH_POOL_JOBS, sizeof(pool_job));
+    if ((instances == 0) || (jobs == 0))
+    {
+        printf("Error: could not allocate memory for the instances\n");
+        free(instances);
+        free(jobs);
+        bench_release(&program);
+        return 1;
+    }
+
+    printf("pool: %d jobs, every %d-th one %d iterations, the others %d, budget %d instructions, %ld core(s)\n",
+        BENCH_POOL_JOBS, BENCH_POOL_LONG_EVERY, BENCH_POOL_LONG_ITERATIONS, BENCH_POOL_SHORT_ITERATIONS, BENCH_POOL_BUDGET, cores);
+    printf("  workers      jobs/s  speedup  preemptions  steals\n");
+    while ((ec == 0) && (worker_count <= (uint32_t) cores))
+    {
+        double seconds, jobs_per_second;
+        pool workers;
+        uint32_t i;
+
+        if (bench_pool_prepare(instances, jobs, &program) || pool_create(&workers, worker_count, BENCH_POOL_BUDGET))
+        {
+            bench_pool_check(instances, jobs);
+            ec = 1;
+            break;
+        }
+        seconds = bench_seconds();
+        for (i = 0; i < BENCH_POOL_JOBS; i++)
+            pool_submit(&workers, jobs + i);
+        pool_wait(&workers);
+        seconds = bench_seconds() - seconds;
+
+        jobs_per_second = BENCH_POOL_JOBS / seconds;
+        if (worker_count == 1)
+            jobs_per_second_1 = jobs_per_second;
+        printf("  %7u  %10.0f  %7.2f  %11llu  %6llu\n", worker_count, jobs_per_second, jobs_per_second / jobs_per_second_1,
+            (unsigned long long) workers.preemptions, (unsigned long long) workers.steals);
+        pool_destroy(&workers);
+        if (bench_pool_check(instances, jobs))
+        {
+            printf("Error: a job did not compute its sum\n");
+            ec = 1;
+        }
+
+        /* Powers of two, and all of the cores at the end */
+        if ((worker_count < (uint32_t) cores) && (2 * worker_count > (uint32_t) cores))
+            worker_count = (uint32_t) cores;
+        else
+            worker_count = 2 * worker_count;
+    }
+
+    free(instances);
+    free(jobs);
+    bench_release(&program);
+    return ec;
+}
+
+
+/*
+    Fork
+
+    A program fills a table of BENCH_FORK_TABLE bytes before it gets to the work,
+    the table is the warmed up state every instance starts from:
+        init:   str64 r12, [8*r12 + r6]
+                (the loop end)
+                syscall EXIT
+        job:    ldr64 r3, [8*r1 + r6]
+                add r3, r3, 1
+                str64 r3, [8*r1 + r6]
+                syscall EXIT
+
+    The template runs the init part once. Then BENCH_FORK_INSTANCES instances
+    start at job, each with r1 on another page of the table, either as a copy of
+    the template (memory copied, code decoded again) or as a fork of its snapshot.
+    The time is only the start, the memory is what the process got privately
+    from starting and running all of them, all of them alive at the end.
+*/
+enum
+{
+    BENCH_FORK_INSTANCES = 32,
+    BENCH_FORK_MEMORY = 0x4000000,
+    BENCH_FORK_TABLE = 0x1000000,
+    BENCH_FORK_TABLE_ADDRESS = 0x100000,
+    BENCH_FORK_COUNTER = BYTECODE_R12,
+};
+
+static int32_t bench_fork_build(bench_program *p)
+{
+    bytecode bc;
+    int32_t ec;
+    if (bench_init(p, BENCH_FORK_MEMORY, INTERPRETER_SANDBOX_NONE))
+    {
+        return 1;
+    }
+
+    p->loop_address = p->cursor;
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_STR64_RA; bc.r0 = BENCH_FORK_COUNTER; bc.r1 = BENCH_FORK_COUNTER; bc.r2 = BYTECODE_R6; bc.cc = 1; bc.c = 3; bc.cr = 1;
+    bench_emit(p, bc);
+    bench_emit_loop_end(p, BENCH_FORK_COUNTER);
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_SYSCALL; bc.imm = BYTECODE_SYSCALL_EXIT;
+    bench_emit(p, bc);
+
+    p->loop_address = p->cursor;
+    bc.opcode = BYTECODE_LDR64_RA; bc.r0 = BYTECODE_R3; bc.r1 = BYTECODE_R1; bc.r2 = BYTECODE_R6; bc.cc = 1; bc.c = 3; bc.cr = 1;
+    bench_emit(p, bc);
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_ADD_RRI; bc.r0 = BYTECODE_R3; bc.r1 = BYTECODE_R3; bc.imm = 1;
+    bench_emit(p, bc);
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_STR64_RA; bc.r0 = BYTECODE_R3; bc.r1 = BYTECODE_R1; bc.r2 = BYTECODE_R6; bc.cc = 1; bc.c = 3; bc.cr = 1;
+    bench_emit(p, bc);
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = BYTECODE_SYSCALL; bc.imm = BYTECODE_SYSCALL_EXIT;
+    bench_emit(p, bc);
+
+    p->interp.registers[BYTECODE_R6] = BENCH_FORK_TABLE_ADDRESS;
+    p->interp.registers[BENCH_FORK_COUNTER] = BENCH_FORK_TABLE / 8 - 1;
+    if (interpreter_predecode(&p->interp, p->cursor))
+    {
+        return 1;
+    }
+    do
+    {
+        ec = interpreter_run(&p->interp, UINT64_MAX);
+    }
+    while (ec == INTERPRETER_BUDGET_EXHAUSTED);
+    if (ec != INTERPRETER_EXITED)
+    {
+        printf("Error: the table was not filled\n");
+        return 1;
+    }
+    p->interp.registers[BYTECODE_RIP] = p->loop_address;
+    return 0;
+}
+
+/* Private_Dirty of the whole process, in KiB */
+static uint64_t bench_private_memory(void)
+{
+    char line[256];
+    uint64_t kib = 0;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == 0)
+    {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned long long value;
+        if (sscanf(line, "Private_Dirty: %llu kB", &value) == 1)
+            kib = value;
+    }
+    fclose(f);
+    return kib;
+}
+
+static int32_t bench_fork_copy(interpreter *interp, bench_program *template)
+{
+    interp->sandbox = template->interp.sandbox;
+    if (interpreter_create_memory(interp, template->interp.memory_size))
+    {
+        return 1;
+    }
+    memcpy(interp->memory, template->interp.memory, template->cursor);
+    memcpy(interp->memory + BENCH_FORK_TABLE_ADDRESS, template->interp.memory + BENCH_FORK_TABLE_ADDRESS, BENCH_FORK_TABLE);
+    memcpy(interp->registers, template->interp.registers, sizeof(interp->registers));
+    return interpreter_predecode(interp, template->cursor);
+}
+
+static int32_t bench_fork(void)
+{
+    static char const *names[2] = { "copy", "fork" };
+    bench_program template;
+    interpreter_snapshot snapshot;
+    interpreter *instances;
+    int32_t use_fork;
+    int32_t ec = 0;
+
+    if (bench_fork_build(&template) || interpreter_take_snapshot(&template.interp, &snapshot))
+    {
+        bench_release(&template);
+        return 1;
+    }
+    instances = calloc(BENCH_FORK_INSTANCES, sizeof(interpreter));
+    if (instances == 0)
+    {
+        printf("Error: could not allocate memory for the instances\n");
+        interpreter_release_snapshot(&snapshot);
+        bench_release(&template);
+        return 1;
+    }
+
+    printf("fork: %d instances of a program with a %d MiB table, %llu KiB in the snapshot\n",
+        BENCH_FORK_INSTANCES, BENCH_FORK_TABLE >> 20, (unsigned long long) (snapshot.file_size >> 10));
+    printf("        us/instance  private KiB/instance\n");
+    for (use_fork = 0; (use_fork < 2) && (ec == 0); use_fork++)
+    {
+        uint64_t private_memory = bench_private_memory();
+        double seconds = 0;
+        uint32_t i;
+        for (i = 0; (i < BENCH_FORK_INSTANCES) && (ec == 0); i++)
+        {
+            interpreter *interp = instances + i;
+            uint64_t index = 1 + i * 512;
+            double start = bench_seconds();
+            ec = use_fork ? interpreter_fork(interp, &snapshot) : bench_fork_copy(interp, &template);
+            seconds += bench_seconds() - start;
+            if (ec)
+            {
+                break;
+            }
+            interp->registers[BYTECODE_R1] = index;
+            do
+            {
+                ec = interpreter_run(interp, UINT64_MAX);
+            }
+            while (ec == INTERPRETER_BUDGET_EXHAUSTED);
+            if ((ec != INTERPRETER_EXITED) || (interp->registers[BYTECODE_R3] != index + 1))
+            {
+                printf("Error: an instance did not find its table entry\n");
+                ec = 1;
+                break;
+            }
+            ec = 0;
+        }
+        private_memory = bench_private_memory() - private_memory;
+        if (ec == 0)
+        {
+            printf("  %-4s  %11.2f  %20llu\n", names[use_fork], seconds * 1e6 / BENCH_FORK_INSTANCES,
+                (unsigned long long) (private_memory / BENCH_FORK_INSTANCES));
+        }
+        for (i = 0; i < BENCH_FORK_INSTANCES; i++)
+        {
+            interpreter_release_memory(instances + i);
+            free(instances[i].decoded);
+            memset(instances + i, 0, sizeof(interpreter));
+        }
+    }
+
+    free(instances);
+    interpreter_release_snapshot(&snapshot);
+    bench_release(&template);
+    return ec;
+}
+
+
+int main(int argc, char **argv)
+{
+    static struct
+    {
+        char const *name;
+        int32_t (*run)(void);
+    } const benchmarks[] =
+    {
+        { "registers", bench_registers },
+        { "fib", bench_fib },
+        { "write", bench_write },
+        { "sandbox", bench_sandbox },
+        { "memory", bench_memory },
+        { "pool", bench_pool },
+        { "fork", bench_fork },
+    };
+    int32_t ec = 0;
+    int arg_index = 1;
+    uint32_t i;
+
+    if (argc < 2)
+    {
+        printf("Usage: %s BENCHMARK...\nBenchmarks:", argv[0]);
+        for (i = 0; i < ARRAY_COUNT(benchmarks); i++)
+            printf(" %s", benchmarks[i].name);
+        printf("\n");
+        return 1;
+    }
+
+    for (; arg_index < argc; arg_index++)
+    {
+        for (i = 0; i < ARRAY_COUNT(benchmarks); i++)
+        {
+            if (strcmp(argv[arg_index], benchmarks[i].name) == 0)
+                break;
+        }
+        if (i == ARRAY_COUNT(benchmarks))
+        {
+            printf("Error: unknown benchmark \"%s\"\n", argv[arg_index]);
+            return 1;
+        }
+        ec = ec | benchmarks[i].run();
+    }
+    return ec;
+}
+
+#include "bytecode.c"
+#include "x86_64.c"
+#include "interpreter.c"
+#include "jit.c"
+#include "pool.c"
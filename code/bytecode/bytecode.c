@@ -1,4 +1,5 @@
 #include "bytecode.h"
+#include "x86_64.h"
 
 
 #define BytecodeEncoding_RegisterMask 0xf
@@ -7,16 +8,95 @@
 #define BytecodeEncoding_Register2_Offset 20
 
 
+/* Bit per register field the instruction has: r0, r1, r2 */
+static uint32_t bytecode_register_fields(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case BYTECODE_SETE_R:
+        case BYTECODE_SETNE_R:
+        case BYTECODE_MOV_RI:
+        case BYTECODE_LDR8_RI:
+        case BYTECODE_LDR16_RI:
+        case BYTECODE_LDR32_RI:
+        case BYTECODE_LDR64_RI:
+        case BYTECODE_STR8_RI:
+        case BYTECODE_STR16_RI:
+        case BYTECODE_STR32_RI:
+        case BYTECODE_STR64_RI:
+        case BYTECODE_CMP_RI:
+        case BYTECODE_LDC_RI:
+            return 0x1;
+
+        case BYTECODE_MOV_RR:
+        case BYTECODE_NOT_RR:
+        case BYTECODE_CMP_RR:
+        case BYTECODE_ADD_RRI:
+        case BYTECODE_SUB_RRI:
+        case BYTECODE_MUL_RRI:
+        case BYTECODE_AND_RRI:
+        case BYTECODE_OR_RRI:
+        case BYTECODE_XOR_RRI:
+        case BYTECODE_SHR_RRI:
+        case BYTECODE_SHL_RRI:
+            return 0x3;
+
+        case BYTECODE_LDR8_RA:
+        case BYTECODE_LDR16_RA:
+        case BYTECODE_LDR32_RA:
+        case BYTECODE_LDR64_RA:
+        case BYTECODE_STR8_RA:
+        case BYTECODE_STR16_RA:
+        case BYTECODE_STR32_RA:
+        case BYTECODE_STR64_RA:
+        case BYTECODE_ADD_RRR:
+        case BYTECODE_SUB_RRR:
+        case BYTECODE_MUL_RRR:
+        case BYTECODE_AND_RRR:
+        case BYTECODE_OR_RRR:
+        case BYTECODE_XOR_RRR:
+        case BYTECODE_SHR_RRR:
+        case BYTECODE_SHL_RRR:
+            return 0x7;
+    }
+    return 0;
+}
+
+/* Second byte of the WIDE prefix the instruction needs, 0 when all its registers are below r16 */
+static uint32_t bytecode_wide_bits(bytecode bc)
+{
+    uint32_t fields = bytecode_register_fields(bc.opcode);
+    uint32_t bits = 0;
+    if ((fields & 0x1) && (bc.r0 & 0x10))
+        bits = bits | 0x1;
+    if ((fields & 0x2) && (bc.r1 & 0x10))
+        bits = bits | 0x2;
+    if ((fields & 0x4) && (bc.r2 & 0x10))
+        bits = bits | 0x4;
+    return bits;
+}
+
+uint64_t bytecode_size(bytecode bc)
+{
+    return bytecode_wide_bits(bc) ? 8 : 4;
+}
+
 uint64_t bytecode_encode(void *data, uint64_t size, bytecode bc)
 {
-    if (size < 4) return 0;
+    uint32_t wide = bytecode_wide_bits(bc);
+    if (size < (wide ? 8 : 4)) return 0;
 
     uint32_t encoded = bc.opcode;
     switch (bc.opcode)
     {
         /* No arguments */
         case BYTECODE_RET:
+        break;
+
         case BYTECODE_SYSCALL:
+        {
+            encoded = encoded | ((bc.imm & 0xffffff) << 8);
+        }
         break;
 
         /* Register */
@@ -67,6 +147,7 @@ uint64_t bytecode_encode(void *data, uint64_t size, bytecode bc)
         case BYTECODE_STR32_RI:
         case BYTECODE_STR64_RI:
         case BYTECODE_CMP_RI:
+        case BYTECODE_LDC_RI:
         {
             encoded = encoded | ((bc.r0 & BytecodeEncoding_RegisterMask) << BytecodeEncoding_Register0_Offset);
             encoded = encoded | ((bc.imm & 0xffff) << 16);
@@ -121,6 +202,12 @@ uint64_t bytecode_encode(void *data, uint64_t size, bytecode bc)
             return 0;
     }
 
+    if (wide)
+    {
+        *(uint32_t *) data = BYTECODE_WIDE | (wide << 8);
+        *((uint32_t *) data + 1) = encoded;
+        return 8;
+    }
     *(uint32_t *) data = encoded;
     return 4;
 }
@@ -131,11 +218,38 @@ uint64_t bytecode_decode(void *data, uint64_t size, bytecode *bc)
 
     uint32_t encoded = *(uint32_t *) data;
     bc->opcode = encoded & 0xff;
+    if (bc->opcode == BYTECODE_WIDE)
+    {
+        uint32_t wide = (encoded >> 8) & 0x7;
+        uint32_t fields;
+        if (size < 8)
+        {
+            bc->imm = wide;
+            return 4;
+        }
+        if ((bytecode_decode((uint8_t *) data + 4, 4, bc) == 0) || (bc->opcode == BYTECODE_WIDE))
+        {
+            return 0;
+        }
+        fields = bytecode_register_fields(bc->opcode);
+        if (fields & wide & 0x1)
+            bc->r0 = bc->r0 | 0x10;
+        if (fields & wide & 0x2)
+            bc->r1 = bc->r1 | 0x10;
+        if (fields & wide & 0x4)
+            bc->r2 = bc->r2 | 0x10;
+        return 8;
+    }
     switch (bc->opcode)
     {
         /* No arguments */
         case BYTECODE_RET:
+        break;
+
         case BYTECODE_SYSCALL:
+        {
+            bc->imm = (encoded >> 8) & 0xffffff;
+        }
         break;
 
         /* Register */
@@ -186,6 +300,7 @@ uint64_t bytecode_decode(void *data, uint64_t size, bytecode *bc)
         case BYTECODE_STR32_RI:
         case BYTECODE_STR64_RI:
         case BYTECODE_CMP_RI:
+        case BYTECODE_LDC_RI:
         {
             bc->r0 = (encoded >> BytecodeEncoding_Register0_Offset) & BytecodeEncoding_RegisterMask;
             bc->imm = (encoded >> 16) & 0xffff;
@@ -255,294 +370,539 @@ uint64_t bytecode_decode(void *data, uint64_t size, bytecode *bc)
     return 4;
 }
 
-uint64_t bytecode_encode_x86_64(void *data, uint64_t size, bytecode bc)
+/* Guest register r of the operand field; fields an opcode does not use are ignored by the caller. */
+#define BytecodeX86_64_Register(BC, FIELD) ((FIELD) == 0 ? (BC).r0 : (FIELD) == 1 ? (BC).r1 : (BC).r2)
+
+/*
+    Registers:
+        r0  -> rax  0.000
+        r1  -> rbx  0.011
+        r2  -> rcx  0.001
+        r3  -> rdx  0.010
+        r4  -> rdi  0.111
+        r5  -> rsi  0.110
+        r6  -> r8   1.000
+        r7  -> r9   1.001
+        r8  -> r10  1.010
+        r9  -> r11  1.011
+        r10 -> r12  1.100
+        r11 -> r13  1.101
+        r12 -> r14  1.110
+        r13 -> context, loaded into a free host register around the instruction
+        r14 -> context, loaded into a free host register around the instruction
+        r15 -> not an operand, instructions using it are left to the interpreter
+        r16-r31 -> context, like r13 and r14
+
+    Host r15 holds the memory base, rbp the context, rcx is taken by variable shifts.
+    A compiled block can give r13, r14 and r16-r31 the host registers of the ones
+    it does not use, see bytecode_encode_x86_64_block.
+*/
+uint8_t const bytecode_x86_64_registers[BYTECODE_REGISTER_COUNT] =
 {
-    /*
-        Registers:
-            r0  -> rax  0.000
-            r1  -> rbx  0.011
-            r2  -> rcx  0.001
-            r3  -> rdx  0.010
-            r4  -> rdi  0.111
-            r5  -> rsi  0.110
-            r6  -> r8   1.000
-            r7  -> r9   1.001
-            r8  -> r10  1.010
-            r9  -> r11  1.011
-            r10 -> r12  1.100
-            r11 -> r13  1.101
-            r12 -> r14  1.110
-            r13 -> rsp  0.100
-            r14 -> rbp  0.101
-            r15 -> rip  0.101
-    */
-    uint8_t reg_codes[16] =
-    {
-        0x0, 0x3, 0x1, 0x2, 0x7, 0x6, 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x4, 0x5, 0x5,
-    };
-    uint8_t *output = (uint8_t *) data;
+    X86_64_RAX, X86_64_RBX, X86_64_RCX, X86_64_RDX, X86_64_RDI, X86_64_RSI, X86_64_R8, X86_64_R9,
+    X86_64_R10, X86_64_R11, X86_64_R12, X86_64_R13, X86_64_R14, X86_64_NONE, X86_64_NONE, X86_64_NONE,
+    X86_64_NONE, X86_64_NONE, X86_64_NONE, X86_64_NONE, X86_64_NONE, X86_64_NONE, X86_64_NONE, X86_64_NONE,
+    X86_64_NONE, X86_64_NONE, X86_64_NONE, X86_64_NONE, X86_64_NONE, X86_64_NONE, X86_64_NONE, X86_64_NONE,
+};
+
+/* Operand fields the template takes, a bit per field: r0, r1, r2; -1 for the instructions without a template */
+static int32_t bytecode_x86_64_fields(bytecode bc, uint32_t *writes_r0)
+{
+    *writes_r0 = 0;
     switch (bc.opcode)
     {
         case BYTECODE_MOV_RI:
-        {
-            uint8_t rex_byte = 0x48;
-            if (bc.r0 >= BYTECODE_R6 && bc.r0 <= BYTECODE_R12)
-                rex_byte = rex_byte | 0x1;
-            uint8_t opcode = 0xc7;
-            uint8_t mod_rm = 0xc0 | reg_codes[bc.r0];
+        case BYTECODE_LDR8_RI:
+        case BYTECODE_LDR16_RI:
+        case BYTECODE_LDR32_RI:
+        case BYTECODE_LDR64_RI:
+        case BYTECODE_SETE_R:
+        case BYTECODE_SETNE_R:
+            *writes_r0 = 1;
+            return 0x1;
 
-            *output++ = rex_byte;
-            *output++ = opcode;
-            *output++ = mod_rm;
-            *(int32_t *) output = bc.imm;
-        }
-        break;
+        case BYTECODE_STR8_RI:
+        case BYTECODE_STR16_RI:
+        case BYTECODE_STR32_RI:
+        case BYTECODE_STR64_RI:
+        case BYTECODE_CMP_RI:
+            return 0x1;
 
         case BYTECODE_MOV_RR:
-        {
-        }
-        break;
+        case BYTECODE_NOT_RR:
+        case BYTECODE_ADD_RRI:
+        case BYTECODE_SUB_RRI:
+        case BYTECODE_MUL_RRI:
+        case BYTECODE_AND_RRI:
+        case BYTECODE_OR_RRI:
+        case BYTECODE_XOR_RRI:
+        case BYTECODE_SHR_RRI:
+        case BYTECODE_SHL_RRI:
+            *writes_r0 = 1;
+            return 0x3;
 
-        case BYTECODE_LDR8_RI:
-        {
-        }
-        break;
+        case BYTECODE_CMP_RR:
+            return 0x3;
+
+        case BYTECODE_ADD_RRR:
+        case BYTECODE_SUB_RRR:
+        case BYTECODE_MUL_RRR:
+        case BYTECODE_AND_RRR:
+        case BYTECODE_OR_RRR:
+        case BYTECODE_XOR_RRR:
+        case BYTECODE_SHR_RRR:
+        case BYTECODE_SHL_RRR:
+            *writes_r0 = 1;
+            return 0x7;
 
         case BYTECODE_LDR8_RA:
-        {
-        }
-        break;
+        case BYTECODE_LDR16_RA:
+        case BYTECODE_LDR32_RA:
+        case BYTECODE_LDR64_RA:
+            *writes_r0 = 1;
+            return 0x1 | (bc.cc ? 0x2 : 0) | (bc.cr ? 0x4 : 0);
 
-        case BYTECODE_LDR16_RI:
-        {
-        }
-        break;
+        case BYTECODE_STR8_RA:
+        case BYTECODE_STR16_RA:
+        case BYTECODE_STR32_RA:
+        case BYTECODE_STR64_RA:
+            return 0x1 | (bc.cc ? 0x2 : 0) | (bc.cr ? 0x4 : 0);
 
-        case BYTECODE_LDR16_RA:
-        {
-        }
-        break;
+        case BYTECODE_JMP_I:
+        case BYTECODE_JE_I:
+        case BYTECODE_JNE_I:
+        case BYTECODE_JL_I:
+        case BYTECODE_JLE_I:
+        case BYTECODE_JG_I:
+        case BYTECODE_JGE_I:
+        case BYTECODE_WIDE:
+            return 0;
 
-        case BYTECODE_LDR32_RI:
-        {
-        }
-        break;
+        case BYTECODE_CALL_I:
+        case BYTECODE_RET:
+        case BYTECODE_SYSCALL:
+        case BYTECODE_INVALID:
+        default:
+            return -1;
+    }
+}
 
-        case BYTECODE_LDR32_RA:
-        {
-        }
-        break;
+uint32_t bytecode_x86_64_operands(bytecode bc)
+{
+    uint32_t writes_r0;
+    int32_t fields = bytecode_x86_64_fields(bc, &writes_r0);
+    uint32_t operands = 0;
+    int32_t i;
 
-        case BYTECODE_LDR64_RI:
-        {
-        }
-        break;
+    for (i = 0; i < 3; i++)
+    {
+        if ((fields > 0) && (fields & (1 << i)))
+            operands = operands | (1u << BytecodeX86_64_Register(bc, i));
+    }
+    return operands;
+}
 
-        case BYTECODE_LDR64_RA:
-        {
-        }
-        break;
+uint64_t bytecode_encode_x86_64(void *data, uint64_t size, bytecode bc)
+{
+    return bytecode_encode_x86_64_block(data, size, bc, bytecode_x86_64_registers, 0);
+}
 
-        case BYTECODE_STR8_RI:
+uint64_t bytecode_encode_x86_64_block(void *data, uint64_t size, bytecode bc, uint8_t const *registers, uint32_t scratch)
+{
+    uint8_t reg_codes[BYTECODE_REGISTER_COUNT];
+    uint8_t *output = (uint8_t *) data;
+    uint8_t spilled[3];
+    uint8_t pushed[3];
+    uint8_t spilled_count = 0;
+    uint32_t busy = (1 << X86_64_RSP) | (1 << X86_64_RBP) | (1 << X86_64_R15) | (1 << X86_64_RCX);
+    int32_t fields;         /* Bit per operand field: r0, r1, r2 */
+    uint32_t writes_r0;
+    uint32_t check_store = 0;
+    uint8_t d, a, b, t;
+    int32_t i;
+
+    if (size < BYTECODE_X86_64_MAX_SIZE)
+        return 0;
+
+    for (i = 0; i < BYTECODE_REGISTER_COUNT; i++)
+        reg_codes[i] = registers[i];
+
+    fields = bytecode_x86_64_fields(bc, &writes_r0);
+    if (fields < 0)
+        return 0;
+
+    for (i = 0; i < 3; i++)
+    {
+        if (fields & (1 << i))
         {
+            uint8_t r = BytecodeX86_64_Register(bc, i);
+            if (r == BYTECODE_RIP)
+                return 0;
+            if (reg_codes[r] != X86_64_NONE)
+                busy = busy | (1 << reg_codes[r]);
         }
-        break;
+    }
 
-        case BYTECODE_STR8_RA:
+    /*
+        Bring r13/r14 and r16-r31 into free host registers for the duration of the instruction,
+        the scratch ones hold nothing to keep, the others are saved on the host stack.
+    */
+    for (i = 0; i < 3; i++)
+    {
+        uint8_t r = BytecodeX86_64_Register(bc, i);
+        if ((fields & (1 << i)) && (reg_codes[r] == X86_64_NONE))
         {
+            uint32_t spare = scratch & ~busy;
+            if (spare)
+            {
+                for (t = 0; !(spare & (1 << t)); t++);
+                pushed[spilled_count] = 0;
+            }
+            else
+            {
+                for (t = 0; busy & (1 << t); t++);
+                pushed[spilled_count] = 1;
+                output = x86_64_push(output, t);
+            }
+            busy = busy | (1 << t);
+            reg_codes[r] = t;
+            spilled[spilled_count++] = r;
+            output = x86_64_rm(output, X86_64_W, 0x8b, t, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * r);
         }
-        break;
+    }
 
-        case BYTECODE_STR16_RI:
+    d = reg_codes[bc.r0];
+    a = reg_codes[bc.r1];
+    b = reg_codes[bc.r2];
+    switch (bc.opcode)
+    {
+        case BYTECODE_MOV_RI:
         {
+            output = x86_64_rr(output, X86_64_W, 0xc7, 0, d);
+            output = x86_64_imm32(output, bc.imm);
         }
         break;
 
-        case BYTECODE_STR16_RA:
+        case BYTECODE_MOV_RR:
         {
+            /* A move onto itself is still a nop, a size of 0 would mean the instruction has no template. */
+            if (d != a)
+                output = x86_64_rr(output, X86_64_W, 0x89, a, d);
+            else
+                *output++ = 0x90;
         }
         break;
 
-        case BYTECODE_STR32_RI:
+        case BYTECODE_LDR8_RI:
         {
+            output = x86_64_rm(output, 0, 0x0fb6, d, X86_64_R15, X86_64_NONE, 0, bc.imm);
         }
         break;
 
-        case BYTECODE_STR32_RA:
+        case BYTECODE_LDR16_RI:
         {
+            output = x86_64_rm(output, 0, 0x0fb7, d, X86_64_R15, X86_64_NONE, 0, bc.imm);
         }
         break;
 
-        case BYTECODE_STR64_RI:
+        case BYTECODE_LDR32_RI:
         {
+            output = x86_64_rm(output, 0, 0x8b, d, X86_64_R15, X86_64_NONE, 0, bc.imm);
         }
         break;
 
-        case BYTECODE_STR64_RA:
+        case BYTECODE_LDR64_RI:
         {
+            output = x86_64_rm(output, X86_64_W, 0x8b, d, X86_64_R15, X86_64_NONE, 0, bc.imm);
         }
         break;
 
-
-        case BYTECODE_ADD_RRI:
+        case BYTECODE_LDR8_RA:
+        case BYTECODE_LDR16_RA:
+        case BYTECODE_LDR32_RA:
+        case BYTECODE_LDR64_RA:
         {
-        }
-        break;
+            /* The address is computed right into the destination, the 32-bit lea truncates it like the interpreter does. */
+            if (bc.cc || bc.cr)
+                output = x86_64_rm(output, 0, 0x8d, d, bc.cr ? b : X86_64_NONE, bc.cc ? a : X86_64_NONE, bc.c, bc.a);
+            else
+                output = x86_64_imm32(x86_64_rr(output, 0, 0xc7, 0, d), bc.a);
 
-        case BYTECODE_ADD_RRR:
-        {
+            if (bc.opcode == BYTECODE_LDR8_RA)
+                output = x86_64_rm(output, 0, 0x0fb6, d, X86_64_R15, d, 0, 0);
+            if (bc.opcode == BYTECODE_LDR16_RA)
+                output = x86_64_rm(output, 0, 0x0fb7, d, X86_64_R15, d, 0, 0);
+            if (bc.opcode == BYTECODE_LDR32_RA)
+                output = x86_64_rm(output, 0, 0x8b, d, X86_64_R15, d, 0, 0);
+            if (bc.opcode == BYTECODE_LDR64_RA)
+                output = x86_64_rm(output, X86_64_W, 0x8b, d, X86_64_R15, d, 0, 0);
         }
         break;
 
-        case BYTECODE_SUB_RRI:
+        case BYTECODE_STR8_RI:
         {
+            output = x86_64_rm(output, X86_64_BYTE, 0x88, d, X86_64_R15, X86_64_NONE, 0, bc.imm);
         }
         break;
 
-        case BYTECODE_SUB_RRR:
+        case BYTECODE_STR16_RI:
         {
+            output = x86_64_rm(output, X86_64_16, 0x89, d, X86_64_R15, X86_64_NONE, 0, bc.imm);
         }
         break;
 
-        case BYTECODE_MUL_RRI:
+        case BYTECODE_STR32_RI:
         {
+            output = x86_64_rm(output, 0, 0x89, d, X86_64_R15, X86_64_NONE, 0, bc.imm);
         }
         break;
 
-        case BYTECODE_MUL_RRR:
+        case BYTECODE_STR64_RI:
         {
+            output = x86_64_rm(output, X86_64_W, 0x89, d, X86_64_R15, X86_64_NONE, 0, bc.imm);
         }
         break;
 
-        case BYTECODE_AND_RRI:
+        case BYTECODE_STR8_RA:
+        case BYTECODE_STR16_RA:
+        case BYTECODE_STR32_RA:
+        case BYTECODE_STR64_RA:
         {
-        }
-        break;
+            uint32_t spare = scratch & ~busy;
+            if (spare)
+            {
+                for (t = 0; !(spare & (1 << t)); t++);
+            }
+            else
+            {
+                for (t = 0; busy & (1 << t); t++);
+                output = x86_64_push(output, t);
+            }
+            if (bc.cc || bc.cr)
+                output = x86_64_rm(output, 0, 0x8d, t, bc.cr ? b : X86_64_NONE, bc.cc ? a : X86_64_NONE, bc.c, bc.a);
+            else
+                output = x86_64_imm32(x86_64_rr(output, 0, 0xc7, 0, t), bc.a);
 
-        case BYTECODE_AND_RRR:
-        {
+            if (bc.opcode == BYTECODE_STR8_RA)
+                output = x86_64_rm(output, X86_64_BYTE, 0x88, d, X86_64_R15, t, 0, 0);
+            if (bc.opcode == BYTECODE_STR16_RA)
+                output = x86_64_rm(output, X86_64_16, 0x89, d, X86_64_R15, t, 0, 0);
+            if (bc.opcode == BYTECODE_STR32_RA)
+                output = x86_64_rm(output, 0, 0x89, d, X86_64_R15, t, 0, 0);
+            if (bc.opcode == BYTECODE_STR64_RA)
+                output = x86_64_rm(output, X86_64_W, 0x89, d, X86_64_R15, t, 0, 0);
+
+            /* cmp t, [rbp + code_size], the pops below keep the flags for the final jb */
+            output = x86_64_rm(output, X86_64_W, 0x3b, t, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_CODE_SIZE);
+            if (!spare)
+                output = x86_64_pop(output, t);
+            check_store = 1;
         }
         break;
 
+        case BYTECODE_ADD_RRI:
+        case BYTECODE_SUB_RRI:
+        case BYTECODE_AND_RRI:
         case BYTECODE_OR_RRI:
+        case BYTECODE_XOR_RRI:
         {
+            uint8_t extension = (bc.opcode == BYTECODE_ADD_RRI) ? 0 :
+                                (bc.opcode == BYTECODE_OR_RRI)  ? 1 :
+                                (bc.opcode == BYTECODE_AND_RRI) ? 4 :
+                                (bc.opcode == BYTECODE_SUB_RRI) ? 5 : 6;
+            if (d != a)
+                output = x86_64_rr(output, X86_64_W, 0x89, a, d);
+            output = x86_64_rr(output, X86_64_W, 0x81, extension, d);
+            output = x86_64_imm32(output, bc.imm);
         }
         break;
 
+        case BYTECODE_ADD_RRR:
+        case BYTECODE_AND_RRR:
         case BYTECODE_OR_RRR:
+        case BYTECODE_XOR_RRR:
         {
+            /* Commutative, so either source could already be the destination. */
+            uint8_t opcode = (bc.opcode == BYTECODE_ADD_RRR) ? 0x01 :
+                             (bc.opcode == BYTECODE_AND_RRR) ? 0x21 :
+                             (bc.opcode == BYTECODE_OR_RRR)  ? 0x09 : 0x31;
+            if (d == a)
+            {
+                output = x86_64_rr(output, X86_64_W, opcode, b, d);
+            }
+            else if (d == b)
+            {
+                output = x86_64_rr(output, X86_64_W, opcode, a, d);
+            }
+            else
+            {
+                output = x86_64_rr(output, X86_64_W, 0x89, a, d);
+                output = x86_64_rr(output, X86_64_W, opcode, b, d);
+            }
         }
         break;
 
-        case BYTECODE_XOR_RRI:
-        {
-        }
-        break;
-
-        case BYTECODE_XOR_RRR:
+        case BYTECODE_SUB_RRR:
         {
+            if ((d == b) && (d == a))
+            {
+                output = x86_64_rr(output, X86_64_W, 0x29, d, d);
+            }
+            else if (d == b)
+            {
+                /* d = a - d = -d + a */
+                output = x86_64_rr(output, X86_64_W, 0xf7, 3, d);
+                output = x86_64_rr(output, X86_64_W, 0x01, a, d);
+            }
+            else
+            {
+                if (d != a)
+                    output = x86_64_rr(output, X86_64_W, 0x89, a, d);
+                output = x86_64_rr(output, X86_64_W, 0x29, b, d);
+            }
         }
         break;
 
-        case BYTECODE_NOT_RR:
+        case BYTECODE_MUL_RRI:
         {
+            output = x86_64_rr(output, X86_64_W, 0x69, d, a);
+            output = x86_64_imm32(output, bc.imm);
         }
         break;
 
-        case BYTECODE_SHR_RRI:
+        case BYTECODE_MUL_RRR:
         {
+            if (d == b)
+            {
+                output = x86_64_rr(output, X86_64_W, 0x0faf, d, a);
+            }
+            else
+            {
+                if (d != a)
+                    output = x86_64_rr(output, X86_64_W, 0x89, a, d);
+                output = x86_64_rr(output, X86_64_W, 0x0faf, d, b);
+            }
         }
         break;
 
-        case BYTECODE_SHR_RRR:
+        case BYTECODE_NOT_RR:
         {
+            if (d != a)
+                output = x86_64_rr(output, X86_64_W, 0x89, a, d);
+            output = x86_64_rr(output, X86_64_W, 0xf7, 2, d);
         }
         break;
 
+        case BYTECODE_SHR_RRI:
         case BYTECODE_SHL_RRI:
         {
+            if ((bc.opcode == BYTECODE_SHL_RRI) && (bc.imm >= 64))
+            {
+                /* The interpreter reports this one. */
+                return 0;
+            }
+            if (d != a)
+                output = x86_64_rr(output, X86_64_W, 0x89, a, d);
+            output = x86_64_rr(output, X86_64_W, 0xc1, (bc.opcode == BYTECODE_SHL_RRI) ? 4 : 5, d);
+            output = x86_64_imm8(output, bc.imm);
         }
         break;
 
+        case BYTECODE_SHR_RRR:
         case BYTECODE_SHL_RRR:
         {
+            /*
+                The count has to be in cl, so shift a copy of a on the stack:
+                    push a; push rcx; mov rcx, b; shl qword [rsp + 8], cl; pop rcx; pop d
+                which is right whichever of d, a, b is rcx.
+            */
+            output = x86_64_push(output, a);
+            output = x86_64_push(output, X86_64_RCX);
+            if (b != X86_64_RCX)
+                output = x86_64_rr(output, X86_64_W, 0x89, b, X86_64_RCX);
+            output = x86_64_rm(output, X86_64_W, 0xd3, (bc.opcode == BYTECODE_SHL_RRR) ? 4 : 5, X86_64_RSP, X86_64_NONE, 0, 8);
+            output = x86_64_pop(output, X86_64_RCX);
+            output = x86_64_pop(output, d);
         }
         break;
 
         case BYTECODE_CMP_RI:
-        {
-        }
-        break;
-
         case BYTECODE_CMP_RR:
         {
+            if (bc.opcode == BYTECODE_CMP_RI)
+                output = x86_64_imm32(x86_64_rr(output, X86_64_W, 0x81, 7, d), bc.imm);
+            else
+                output = x86_64_rr(output, X86_64_W, 0x39, a, d);
+
+            /* setb/sete/seta keep the flags, the caller could still branch on them. */
+            output = x86_64_rm(output, 0, 0x0f92, 0, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_FLAGS + 0);
+            output = x86_64_rm(output, 0, 0x0f94, 0, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_FLAGS + 1);
+            output = x86_64_rm(output, 0, 0x0f97, 0, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_FLAGS + 2);
         }
         break;
 
         case BYTECODE_JMP_I:
         {
+            output = x86_64_jmp(output);
         }
         break;
 
         case BYTECODE_JE_I:
-        {
-        }
-        break;
-
         case BYTECODE_JNE_I:
-        {
-        }
-        break;
-
         case BYTECODE_JL_I:
-        {
-        }
-        break;
-
-        case BYTECODE_JLE_I:
-        {
-        }
-        break;
-
         case BYTECODE_JG_I:
         {
+            /* cmp byte [rbp + flag], 0 */
+            int32_t flag = (bc.opcode == BYTECODE_JL_I) ? 0 : (bc.opcode == BYTECODE_JG_I) ? 2 : 1;
+            output = x86_64_rm(output, 0, 0x80, 7, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_FLAGS + flag);
+            output = x86_64_imm8(output, 0);
+            output = x86_64_jcc(output, (bc.opcode == BYTECODE_JNE_I) ? X86_64_CC_E : X86_64_CC_NE);
         }
         break;
 
+        case BYTECODE_JLE_I:
         case BYTECODE_JGE_I:
         {
+            /* test word [rbp + flag], 0x0101 looks at less and equal, or at equal and more */
+            int32_t flag = (bc.opcode == BYTECODE_JLE_I) ? 0 : 1;
+            output = x86_64_rm(output, X86_64_16, 0xf7, 0, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_FLAGS + flag);
+            output = x86_64_imm16(output, 0x0101);
+            output = x86_64_jcc(output, X86_64_CC_NE);
         }
         break;
 
         case BYTECODE_SETE_R:
-        {
-        }
-        break;
-
         case BYTECODE_SETNE_R:
         {
+            output = x86_64_rm(output, 0, 0x0fb6, d, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_FLAGS + 1);
+            if (bc.opcode == BYTECODE_SETNE_R)
+                output = x86_64_imm8(x86_64_rr(output, 0, 0x83, 6, d), 1);
         }
         break;
 
-        case BYTECODE_CALL_I:
-        {
-        }
-        break;
-
-        case BYTECODE_RET:
+        case BYTECODE_WIDE:
         {
+            /* The prefix is already applied to the next instruction, so a nop keeps it a place to jump to. */
+            *output++ = 0x90;
         }
         break;
+    }
 
-        case BYTECODE_SYSCALL:
-        {
-        }
-        break;
+    for (i = spilled_count - 1; i >= 0; i--)
+    {
+        uint8_t r = spilled[i];
+        if (writes_r0 && (r == bc.r0))
+            output = x86_64_rm(output, X86_64_W, 0x89, reg_codes[r], X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * r);
+        if (pushed[i])
+            output = x86_64_pop(output, reg_codes[r]);
+    }
 
-        case BYTECODE_INVALID:
-        default:
-            return 0;
+    if (check_store)
+    {
+        output = x86_64_jcc(output, X86_64_CC_B);
     }
 
-    return 4;
+    return output - (uint8_t *) data;
 }
+
+#undef BytecodeX86_64_Register
@@ -10,7 +10,8 @@
     First byte is opcode.
 
     The second byte is reserved for two registers 4 bits each.
-    Therefore there could be only 16 registers. All registers are 64-bit.
+    Therefore there could be only 16 registers, unless the instruction has
+    the WIDE prefix, see below. All registers are 64-bit.
 
     Depending on the instruction form, the next two bytes could be an immediate value,
     or effective address calculation.
@@ -120,12 +121,39 @@
         | RET               |  0x30  |                                   |
         +-------------------+--------+-----------------------------------+
         | SYSCALL           |  0x31  |             call code             |
-        +-------------------+--------+-----------------------------------+
+        +-------------------+--------+-----+-----+-----------------------+
+        | LDC r64,rel16     |  0x32  | r64 |     |         rel16         |
+        +-------------------+--------+-----+-----+-----------------------+
+        | WIDE              |  0x33  | xxx |              0              |
+        +-------------------+--------+-----+-----------------------------+
+
+    LDC loads the 64-bit constant at the address of the next instruction + 4*rel16.
+    Constants that do not fit into imm16 are kept in a pool after the code, so
+    loading one of them is a single instruction instead of MOV/SHL/OR.
+
+    WIDE is a prefix that gives the instruction after it 32 registers.
+    Its second byte holds the fifth bit of every register field of that
+    instruction: bit 0 for r0, bit 1 for r1, bit 2 for r2. So r16-r31 cost
+    4 more bytes and only in the instructions that use them, programs that
+    stay within r0-r15 are encoded exactly as before. bytecode_encode adds
+    the prefix by itself when a register needs it. Jumps should land on
+    the prefix, not on the instruction it extends.
 
     The r15 register would be reserved for IP (instruction pointer).
     The r14 register would be reserved for BP (base pointer).
     The r13 register would be reserved for SP (stack pointer).
 
+    The stack grows down. CALL subtracts 8 from SP, stores the address of the
+    next instruction at [SP] and jumps to the next instruction + rel24.
+    RET loads IP from [SP] and adds 8 to SP.
+
+    SYSCALL asks the host for something, the call code says what. The arguments
+    are in r0-r2, the result goes to r0, and (uint64_t) -1 means it failed:
+        EXIT   status r0, the program stops
+        WRITE  r0 = bytes written of r2 bytes at r1 to fd r0, stdout (1) or stderr (2)
+        READ   r0 = bytes read into r2 bytes at r1 from fd r0, stdin (0) only
+        CLOCK  r0 = monotonic time in nanoseconds
+
     Effective address calculation works like that: [cc*c*r1 + cr*r2 + a],
     the first two bits are coefficients for c and r2, made so you could skip them.
     If you need to skip a, set it to 0.
@@ -199,6 +227,19 @@ enum
     BYTECODE_CALL_I   = 0x2f,
     BYTECODE_RET      = 0x30,
     BYTECODE_SYSCALL  = 0x31,
+    BYTECODE_LDC_RI   = 0x32,
+    BYTECODE_WIDE     = 0x33,
+
+    BYTECODE_OPCODE_COUNT,
+};
+
+/* Call codes of SYSCALL */
+enum
+{
+    BYTECODE_SYSCALL_EXIT  = 0,
+    BYTECODE_SYSCALL_WRITE = 1,
+    BYTECODE_SYSCALL_READ  = 2,
+    BYTECODE_SYSCALL_CLOCK = 3,
 };
 
 enum
@@ -219,6 +260,8 @@ enum
     BYTECODE_RSP = 0xd,
     BYTECODE_RBP = 0xe,
     BYTECODE_RIP = 0xf,
+
+    BYTECODE_REGISTER_COUNT = 32, /* r16-r31 need the WIDE prefix */
 };
 
 
@@ -231,10 +274,49 @@ typedef struct
 } bytecode;
 
 
+/*
+    Native code made by bytecode_encode_x86_64 runs with:
+        - r15 pointing to the beginning of the interpreter memory;
+        - rbp pointing to the context, laid out as below;
+        - rsp being the host stack, which is used for temporaries.
+
+    Registers r0-r12 live in host registers, r13 (SP), r14 (BP) and r16-r31 live in the context.
+    Compares set three bytes in the context (less, equal, more), which conditional jumps test.
+
+    Jumps, and stores through an address register, end with a rel32 the caller has to patch:
+    jumps to the destination, stores to the exit taken when the store landed below
+    the code size in the context, i.e. the code has been modified.
+*/
+enum
+{
+    BYTECODE_X86_64_CONTEXT_REGISTERS = 0x000, /* uint64_t[BYTECODE_REGISTER_COUNT] */
+    BYTECODE_X86_64_CONTEXT_FLAGS     = 0x100, /* uint8_t less, equal, more */
+    BYTECODE_X86_64_CONTEXT_CODE_SIZE = 0x108, /* uint64_t */
+
+    BYTECODE_X86_64_MAX_SIZE = 128, /* Room one instruction could take */
+};
+
+/*
+    Both return the size of the instruction, 8 with the WIDE prefix, and 0 when it
+    does not fit or is invalid. Decoding only the 4 bytes of a prefix gives the
+    prefix itself as BYTECODE_WIDE with the register bits in imm.
+*/
 uint64_t bytecode_encode(void *data, uint64_t size, bytecode bc);
 uint64_t bytecode_decode(void *data, uint64_t size, bytecode *bc);
+uint64_t bytecode_size(bytecode bc);
+
+/* Host register of every bytecode register, X86_64_NONE for the ones kept in the context */
+extern uint8_t const bytecode_x86_64_registers[BYTECODE_REGISTER_COUNT];
 
 uint64_t bytecode_encode_x86_64(void *data, uint64_t size, bytecode bc);
+/*
+    The same with the host registers of a compiled block: registers maps every bytecode register
+    like bytecode_x86_64_registers does, and the host registers in the scratch mask (a bit per
+    host register) are free to clobber when bringing in the ones it maps to X86_64_NONE.
+*/
+uint64_t bytecode_encode_x86_64_block(void *data, uint64_t size, bytecode bc, uint8_t const *registers, uint32_t scratch);
+/* Bytecode registers the template takes as operands, a bit per register, 0 for the instructions without a template */
+uint32_t bytecode_x86_64_operands(bytecode bc);
 
 
 #endif /* PINAPL_BYTECODE_H_ */
@@ -0,0 +1,276 @@
+#include "counters.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+
+static struct
+{
+    uint32_t type;
+    uint64_t config;
+    char const *name;
+} counters_events[COUNTERS_COUNT] =
+{
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,    "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,  "instructions" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses" },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "L1i-misses" },
+};
+
+static int32_t counters_error(char const *msg)
+{
+    printf("%s", msg);
+    return 1;
+}
+
+static uint64_t counters_page_size(void)
+{
+    return (uint64_t) sysconf(_SC_PAGESIZE);
+}
+
+static void counters_close_one(counters *c, uint32_t i)
+{
+    if (c->rings[i])
+        munmap(c->rings[i], (1 + COUNTERS_RING_PAGES) * counters_page_size());
+    if (c->fds[i] >= 0)
+        close(c->fds[i]);
+    c->rings[i] = 0;
+    c->fds[i] = -1;
+}
+
+int32_t counters_open(counters *c, uint64_t sample_period)
+{
+    uint32_t opened = 0;
+    uint32_t i;
+
+    memset(c, 0, sizeof(*c));
+    for (i = 0; i < COUNTERS_COUNT; i++)
+        c->fds[i] = -1;
+    c->sample_period = sample_period;
+
+    for (i = 0; i < COUNTERS_COUNT; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters_events[i].type;
+        attr.config = counters_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        if (sample_period)
+        {
+            attr.sample_period = sample_period;
+            attr.wakeup_events = 1;
+        }
+        c->fds[i] = (int32_t) syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (c->fds[i] < 0)
+        {
+            continue;
+        }
+        /* Overflows come as SIGIO to this process, once the sample is in the ring buffer */
+        if (sample_period)
+        {
+            c->rings[i] = mmap(0, (1 + COUNTERS_RING_PAGES) * counters_page_size(), PROT_READ | PROT_WRITE, MAP_SHARED, c->fds[i], 0);
+            if (c->rings[i] == MAP_FAILED)
+                c->rings[i] = 0;
+            if ((c->rings[i] == 0) ||
+                (fcntl(c->fds[i], F_SETFL, O_ASYNC) != 0) || (fcntl(c->fds[i], F_SETOWN, getpid()) != 0))
+            {
+                counters_close_one(c, i);
+                continue;
+            }
+        }
+        opened += 1;
+    }
+    if (opened == 0)
+    {
+        return counters_error("Error: the host has none of the performance counters, or perf_event_paranoid does not allow them\n");
+    }
+    return 0;
+}
+
+void counters_close(counters *c)
+{
+    uint32_t i;
+    for (i = 0; i < COUNTERS_COUNT; i++)
+        counters_close_one(c, i);
+}
+
+static counters *counters_sampling;
+
+/*
+    Counters past their next sample charge the periods they went over to the class being dispatched.
+    The samples themselves are not needed, the ring buffers are emptied by moving their tails up to the heads.
+*/
+static void counters_overflow(int signal_number)
+{
+    counters *c = counters_sampling;
+    int saved_errno = errno;
+    uint32_t op_class;
+    uint32_t i;
+
+    (void) signal_number;
+    if (c == 0)
+    {
+        return;
+    }
+    op_class = interpreter_op_class(c->interp->profile_op);
+    for (i = 0; i < COUNTERS_COUNT; i++)
+    {
+        struct perf_event_mmap_page *ring = c->rings[i];
+        uint64_t value[3];
+        uint64_t head;
+        if ((c->fds[i] < 0) || (read(c->fds[i], value, sizeof(value)) != sizeof(value)))
+            continue;
+        for (; value[0] >= c->next_sample[i]; c->next_sample[i] += c->sample_period)
+        {
+            c->class_events[i][op_class] += c->sample_period;
+            c->samples[i] += 1;
+        }
+        head = ring->data_head;
+        __sync_synchronize();
+        ring->data_tail = head;
+    }
+    errno = saved_errno;
+}
+
+int32_t counters_run(counters *c, interpreter *interp)
+{
+    uint64_t step_count = interp->step_count;
+    int32_t ec;
+    uint32_t i;
+    struct sigaction previous_action;
+    if (c->sample_period && (interp->variant != INTERPRETER_VARIANT_PROFILE))
+    {
+        return counters_error("Error: sampling the counters needs the profile variant of the interpreter\n");
+    }
+    if (c->sample_period)
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = counters_overflow;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGIO, &action, &previous_action) != 0)
+        {
+            return counters_error("Error: could not install the SIGIO handler\n");
+        }
+        for (i = 0; i < COUNTERS_COUNT; i++)
+            c->next_sample[i] = c->sample_period;
+    }
+    c->interp = interp;
+    counters_sampling = c->sample_period ? c : 0;
+
+    for (i = 0; i < COUNTERS_COUNT; i++)
+    {
+        if (c->fds[i] < 0)
+            continue;
+        ioctl(c->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(c->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    do
+    {
+        ec = interpreter_run(interp, UINT64_MAX);
+    }
+    while (ec == INTERPRETER_BUDGET_EXHAUSTED);
+    for (i = 0; i < COUNTERS_COUNT; i++)
+    {
+        if (c->fds[i] >= 0)
+            ioctl(c->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    if (c->sample_period)
+    {
+        counters_sampling = 0;
+        sigaction(SIGIO, &previous_action, 0);
+    }
+
+    /* value, time enabled, time running */
+    for (i = 0; i < COUNTERS_COUNT; i++)
+    {
+        uint64_t value[3];
+        if ((c->fds[i] < 0) || (read(c->fds[i], value, sizeof(value)) != sizeof(value)))
+            continue;
+        if ((value[2] > 0) && (value[2] < value[1]))
+            value[0] = (uint64_t) ((double) value[0] * value[1] / value[2]);
+        c->values[i] = value[0];
+    }
+    c->step_count = interp->step_count - step_count;
+    return ec;
+}
+
+int32_t counters_check_samples(counters *c)
+{
+    int32_t ec = 0;
+    uint32_t i;
+    if (c->sample_period == 0)
+    {
+        return 0;
+    }
+    for (i = 0; i < COUNTERS_COUNT; i++)
+    {
+        if ((c->fds[i] >= 0) && (c->values[i] >= 2 * c->sample_period) && (c->samples[i] == 0))
+        {
+            printf("Error: the %s counter went past its sample period %llu time(s), and no sample arrived\n",
+                counters_events[i].name, (unsigned long long) (c->values[i] / c->sample_period));
+            ec = 1;
+        }
+    }
+    return ec;
+}
+
+void counters_print(counters *c)
+{
+    double millions = c->step_count / 1000000.0;
+    uint32_t i;
+
+    printf("Counters: %llu guest instruction(s)\n", (unsigned long long) c->step_count);
+    printf("  %-14s  %14s  %16s\n", "counter", "total", "per million");
+    for (i = 0; i < COUNTERS_COUNT; i++)
+    {
+        if (c->fds[i] < 0)
+            printf("  %-14s  %14s  %16s\n", counters_events[i].name, "n/a", "n/a");
+        else if (c->step_count == 0)
+            printf("  %-14s  %14llu  %16s\n", counters_events[i].name, (unsigned long long) c->values[i], "-");
+        else
+            printf("  %-14s  %14llu  %16.1f\n", counters_events[i].name, (unsigned long long) c->values[i], c->values[i] / millions);
+    }
+
+    if (c->sample_period && c->interp)
+    {
+        uint64_t class_counts[INTERPRETER_CLASS_COUNT];
+        uint32_t op_class;
+        memset(class_counts, 0, sizeof(class_counts));
+        for (i = 0; i < INTERPRETER_OP_COUNT; i++)
+            class_counts[interpreter_op_class(i)] += c->interp->profile_counts[i];
+
+        printf("  %-10s", "class");
+        for (i = 0; i < COUNTERS_COUNT; i++)
+        {
+            if (c->fds[i] >= 0)
+                printf("  %14s", counters_events[i].name);
+        }
+        printf("  (per operation, one sample every %llu events)\n", (unsigned long long) c->sample_period);
+        for (op_class = 0; op_class < INTERPRETER_CLASS_COUNT; op_class++)
+        {
+            if (class_counts[op_class] == 0)
+                continue;
+            printf("  %-10s", interpreter_class_name(op_class));
+            for (i = 0; i < COUNTERS_COUNT; i++)
+            {
+                if (c->fds[i] >= 0)
+                    printf("  %14.2f", (double) c->class_events[i][op_class] / class_counts[op_class]);
+            }
+            printf("\n");
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef PINAPL_COUNTERS_H_
+#define PINAPL_COUNTERS_H_
+
+/*
+                                    Counters
+
+    What the host pays for the guest: cycles, instructions, branch misses and
+    L1i misses of this process in user mode, from perf_event_open(2), counted
+    while counters_run runs the interpreter, and printed per million guest
+    instructions (the steps of interp->step_count). A counter the host or the
+    virtual machine does not have is left out and printed as n/a; when the kernel
+    multiplexes the counters, the values are scaled up by the time they ran.
+
+    With a sample period and the profile variant of the interpreter,
+    every counter also interrupts the run every period events, and the handler
+    charges the period to the class of the operation being dispatched,
+    interp->profile_op. That is the class which was running, give or take the
+    skid of the interrupt, so the classes come out as a statistical breakdown.
+    The kernel signals an overflow once it has written the sample to the ring
+    buffer of the counter, so each counter has one mapped, and the handler
+    empties it every time so it never fills up and stops the signals.
+
+    The signal is per process, so one counters runs at a time.
+*/
+
+#include <stdint.h>
+#include "interpreter.h"
+
+
+enum
+{
+    COUNTERS_CYCLES = 0,
+    COUNTERS_INSTRUCTIONS,
+    COUNTERS_BRANCH_MISSES,
+    COUNTERS_L1I_MISSES,
+
+    COUNTERS_COUNT,
+};
+
+/* Data pages of the ring buffer of each counter, a power of two */
+#define COUNTERS_RING_PAGES 1
+
+typedef struct
+{
+    int32_t fds[COUNTERS_COUNT];        /* -1 when the host does not have the counter */
+    uint64_t values[COUNTERS_COUNT];
+    uint64_t step_count;                /* Guest instructions the values are for */
+
+    /* Sampling mode, when sample_period is not 0 */
+    interpreter *interp;
+    uint64_t sample_period;
+    uint64_t next_sample[COUNTERS_COUNT];
+    uint64_t samples[COUNTERS_COUNT];   /* Periods the handler charged */
+    void *rings[COUNTERS_COUNT];        /* perf_event_mmap_page and COUNTERS_RING_PAGES of samples */
+    uint64_t class_events[COUNTERS_COUNT][INTERPRETER_CLASS_COUNT];
+} counters;
+
+
+/* sample_period 0 counts only, otherwise the run needs INTERPRETER_VARIANT_PROFILE */
+int32_t counters_open(counters *c, uint64_t sample_period);
+/* Runs the interpreter until it stops with the counters on, returns what interpreter_run returned last */
+int32_t counters_run(counters *c, interpreter *interp);
+void counters_print(counters *c);
+/* After a sampled run, fails for a counter that went past its period and never got a sample */
+int32_t counters_check_samples(counters *c);
+void counters_close(counters *c);
+
+
+#endif /* PINAPL_COUNTERS_H_ */
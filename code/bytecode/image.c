@@ -0,0 +1,256 @@
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static int32_t bytecode_image_error(char const *msg)
+{
+    printf("%s", msg);
+    return 1;
+}
+
+static uint64_t bytecode_image_align(uint64_t value)
+{
+    return (value + BYTECODE_IMAGE_PAGE_SIZE - 1) & ~(uint64_t) (BYTECODE_IMAGE_PAGE_SIZE - 1);
+}
+
+static int32_t bytecode_image_write_all(int fd, void const *data, uint64_t size)
+{
+    uint8_t const *bytes = data;
+    while (size > 0)
+    {
+        ssize_t written = write(fd, bytes, size);
+        if (written <= 0)
+        {
+            return 1;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int32_t bytecode_image_write(char const *filename, bytecode_image const *image, bytecode_image_label const *labels, uint64_t label_count)
+{
+    static uint8_t const zeros[BYTECODE_IMAGE_PAGE_SIZE];
+    uint64_t image_size = image->data_address + image->data_size;
+    uint64_t string_size = 0;
+    bytecode_image_header header;
+    bytecode_image_symbol *symbols;
+    char *strings;
+    uint64_t i;
+    int32_t ec;
+    int fd;
+
+    if ((image->code_size > image->data_address) || (image_size > image->memory_size) || (image->entry >= image->code_size))
+    {
+        return bytecode_image_error("Error: image sections do not fit in the memory\n");
+    }
+
+    for (i = 0; i < label_count; i++)
+    {
+        string_size += strlen(labels[i].name) + 1;
+    }
+    symbols = calloc(label_count + 1, sizeof(bytecode_image_symbol));
+    strings = malloc(string_size + 1);
+    if ((symbols == 0) || (strings == 0))
+    {
+        free(symbols);
+        free(strings);
+        return bytecode_image_error("Error: could not allocate memory for the symbols\n");
+    }
+    string_size = 0;
+    for (i = 0; i < label_count; i++)
+    {
+        uint64_t name_size = strlen(labels[i].name);
+        symbols[i].address = labels[i].address;
+        symbols[i].name = (uint32_t) string_size;
+        symbols[i].name_size = (uint32_t) name_size;
+        memcpy(strings + string_size, labels[i].name, name_size + 1);
+        string_size += name_size + 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BYTECODE_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = BYTECODE_IMAGE_VERSION;
+    header.header_size = sizeof(header);
+    header.entry = image->entry;
+    header.memory_size = image->memory_size;
+    header.memory_offset = BYTECODE_IMAGE_PAGE_SIZE;
+    header.code_size = image->code_size;
+    header.data_address = image->data_address;
+    header.data_size = image->data_size;
+    header.symbol_offset = header.memory_offset + bytecode_image_align(image_size);
+    header.symbol_count = label_count;
+    header.string_offset = header.symbol_offset + label_count * sizeof(bytecode_image_symbol);
+    header.string_size = string_size;
+
+    ec = 0;
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        ec = bytecode_image_error("Error: could not open the image file\n");
+    }
+    else
+    {
+        if (bytecode_image_write_all(fd, &header, sizeof(header)) ||
+            bytecode_image_write_all(fd, zeros, BYTECODE_IMAGE_PAGE_SIZE - sizeof(header)) ||
+            bytecode_image_write_all(fd, image->memory, image_size) ||
+            bytecode_image_write_all(fd, zeros, bytecode_image_align(image_size) - image_size) ||
+            bytecode_image_write_all(fd, symbols, label_count * sizeof(bytecode_image_symbol)) ||
+            bytecode_image_write_all(fd, strings, string_size))
+        {
+            ec = bytecode_image_error("Error: could not write the image file\n");
+        }
+        close(fd);
+    }
+
+    free(symbols);
+    free(strings);
+    return ec;
+}
+
+/*
+    Every field comes from the file, so each one is compared against what is
+    left of the range it lives in, and no two of them are added together before
+    they have been checked.
+*/
+static int32_t bytecode_image_header_is_valid(bytecode_image_header const *header, uint64_t file_size)
+{
+    uint64_t image_size;
+
+    if ((memcmp(header->magic, BYTECODE_IMAGE_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != BYTECODE_IMAGE_VERSION) ||
+        (header->header_size != sizeof(bytecode_image_header)) ||
+        (header->memory_size > ~(uint64_t) 0 - BYTECODE_IMAGE_PAGE_SIZE) ||
+        (header->data_size > header->memory_size) ||
+        (header->data_address > header->memory_size - header->data_size) ||
+        (header->code_size > header->data_address) ||
+        (header->entry >= header->code_size))
+    {
+        return 0;
+    }
+    image_size = header->data_address + header->data_size;
+
+    if ((header->memory_offset % BYTECODE_IMAGE_PAGE_SIZE) ||
+        (header->memory_offset > file_size) ||
+        (header->symbol_offset < header->memory_offset) ||
+        (header->symbol_offset > file_size) ||
+        (bytecode_image_align(image_size) > header->symbol_offset - header->memory_offset) ||
+        (header->string_offset < header->symbol_offset) ||
+        (header->string_offset > file_size) ||
+        (header->symbol_count > (header->string_offset - header->symbol_offset) / sizeof(bytecode_image_symbol)) ||
+        (header->string_size > file_size - header->string_offset))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+int32_t bytecode_image_load(bytecode_image *image, char const *filename)
+{
+    bytecode_image_header const *header;
+    uint64_t image_size;
+    struct stat st;
+    int fd;
+
+    memset(image, 0, sizeof(*image));
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return bytecode_image_error("Error: could not open the image file\n");
+    }
+    if ((fstat(fd, &st) != 0) || (st.st_size < BYTECODE_IMAGE_PAGE_SIZE))
+    {
+        close(fd);
+        return bytecode_image_error("Error: the file is not a bytecode image\n");
+    }
+
+    image->file_size = st.st_size;
+    image->file = mmap(0, image->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image->file == MAP_FAILED)
+    {
+        image->file = 0;
+        close(fd);
+        return bytecode_image_error("Error: could not map the image file\n");
+    }
+
+    header = image->file;
+    if (!bytecode_image_header_is_valid(header, image->file_size))
+    {
+        close(fd);
+        bytecode_image_unload(image);
+        return bytecode_image_error("Error: the file is not a bytecode image\n");
+    }
+
+    image_size = header->data_address + header->data_size;
+
+    /*
+        Reserve the whole guest memory, then put the pages of the file over its start.
+        The mapping is private, so the program writes into its own copy of the pages it touches.
+    */
+    image->memory = mmap(0, bytecode_image_align(header->memory_size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (image->memory == MAP_FAILED)
+    {
+        image->memory = 0;
+        close(fd);
+        bytecode_image_unload(image);
+        return bytecode_image_error("Error: could not allocate the guest memory\n");
+    }
+    image->memory_size = header->memory_size;
+    if (image_size > 0)
+    {
+        if (mmap(image->memory, bytecode_image_align(image_size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, header->memory_offset) == MAP_FAILED)
+        {
+            close(fd);
+            bytecode_image_unload(image);
+            return bytecode_image_error("Error: could not map the image file\n");
+        }
+    }
+    close(fd);
+
+    image->code_size = header->code_size;
+    image->data_address = header->data_address;
+    image->data_size = header->data_size;
+    image->entry = header->entry;
+    image->symbols = (bytecode_image_symbol const *) ((uint8_t const *) image->file + header->symbol_offset);
+    image->symbol_count = header->symbol_count;
+    image->strings = (char const *) image->file + header->string_offset;
+    image->string_size = header->string_size;
+    return 0;
+}
+
+void bytecode_image_unload(bytecode_image *image)
+{
+    if (image->memory)
+    {
+        munmap(image->memory, bytecode_image_align(image->memory_size));
+    }
+    if (image->file)
+    {
+        munmap(image->file, image->file_size);
+    }
+    memset(image, 0, sizeof(*image));
+}
+
+int32_t bytecode_image_find_symbol(bytecode_image const *image, char const *name, uint64_t *address)
+{
+    uint64_t name_size = strlen(name);
+    uint64_t i;
+    for (i = 0; i < image->symbol_count; i++)
+    {
+        if ((image->symbols[i].name_size == name_size) &&
+            ((uint64_t) image->symbols[i].name + name_size < image->string_size) &&
+            (memcmp(image->strings + image->symbols[i].name, name, name_size) == 0))
+        {
+            *address = image->symbols[i].address;
+            return 0;
+        }
+    }
+    return 1;
+}
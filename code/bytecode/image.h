@@ -0,0 +1,91 @@
+#ifndef PINAPL_IMAGE_H_
+#define PINAPL_IMAGE_H_
+
+/*
+                                Bytecode image
+
+    File with a program ready to run, laid out so that loading it is one mmap:
+
+        0x0000           header
+        memory_offset    guest memory from address 0 up to data_address + data_size,
+                         code at address 0, initialised data at data_address,
+                         padded with zeros to the page size
+        symbol_offset    bytecode_image_symbol[symbol_count]
+        string_offset    names of the symbols, each one terminated by 0
+
+    memory_offset is aligned to the page, so the loader maps that part of
+    the file privately over the start of the guest memory, and the rest of
+    memory_size is zero pages nobody touched yet. All numbers are little-endian.
+*/
+
+#include <stdint.h>
+
+
+#define BYTECODE_IMAGE_MAGIC "PINAPLBC"
+
+enum
+{
+    BYTECODE_IMAGE_VERSION = 1,
+    BYTECODE_IMAGE_PAGE_SIZE = 0x1000,
+};
+
+typedef struct
+{
+    uint8_t magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t entry;             /* Address of the first instruction to execute */
+    uint64_t memory_size;       /* Guest memory the program needs */
+    uint64_t memory_offset;
+    uint64_t code_size;
+    uint64_t data_address;
+    uint64_t data_size;
+    uint64_t symbol_offset;
+    uint64_t symbol_count;
+    uint64_t string_offset;
+    uint64_t string_size;
+} bytecode_image_header;
+
+typedef struct
+{
+    uint64_t address;
+    uint32_t name;      /* Offset in the strings */
+    uint32_t name_size; /* Without the terminating 0 */
+} bytecode_image_symbol;
+
+/* Symbols as the assembler has them, before they are written */
+typedef struct
+{
+    char const *name;
+    uint64_t address;
+} bytecode_image_label;
+
+typedef struct
+{
+    uint8_t *memory;        /* Guest memory, mapped from the file */
+    uint64_t memory_size;
+    uint64_t code_size;
+    uint64_t data_address;
+    uint64_t data_size;
+    uint64_t entry;
+
+    bytecode_image_symbol const *symbols;
+    uint64_t symbol_count;
+    char const *strings;
+    uint64_t string_size;
+
+    void *file;             /* Whole file, mapped read-only */
+    uint64_t file_size;
+} bytecode_image;
+
+
+/* Writes memory[0, image->data_address + image->data_size) with the header and the labels */
+int32_t bytecode_image_write(char const *filename, bytecode_image const *image, bytecode_image_label const *labels, uint64_t label_count);
+int32_t bytecode_image_load(bytecode_image *image, char const *filename);
+void bytecode_image_unload(bytecode_image *image);
+
+/* Returns 0 when found */
+int32_t bytecode_image_find_symbol(bytecode_image const *image, char const *name, uint64_t *address);
+
+
+#endif /* PINAPL_IMAGE_H_ */
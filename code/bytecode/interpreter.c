@@ -1,5 +1,18 @@
 #include "interpreter.h"
+#include <setjmp.h>
+#include <signal.h>
+#include <ucontext.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include <x86intrin.h>
 
 
 int32_t interpreter_error(char const *msg)
@@ -9,15 +22,1047 @@ int32_t interpreter_error(char const *msg)
 }
 
 
-int32_t interpreter_step(interpreter *interp)
+/* Reserved around the memory with INTERPRETER_SANDBOX_GUARD */
+#define INTERPRETER_GUARD_BELOW 0x10000          /* For imm16 addresses down to -32k */
+#define INTERPRETER_GUARD_ABOVE 0x100000000ull   /* For 32-bit address registers */
+#define INTERPRETER_GUARD_PAST  0x10000          /* For imm16 and the access size on top of that */
+
+#define INTERPRETER_HUGE_PAGE_SIZE 0x200000
+
+/*
+    The memory is address space reserved with MAP_NORESERVE, the kernel commits
+    a page the first time the program touches it. So memory_size can be as big
+    as the program might ever need, and only what it uses costs anything.
+*/
+int32_t interpreter_create_memory(interpreter *interp, uint64_t memory_size)
+{
+    uint64_t page_size = interp->huge_pages ? INTERPRETER_HUGE_PAGE_SIZE : (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t mapped_size = memory_size;
+    uint64_t below = 0;
+    uint64_t above;
+    uint64_t reservation_size;
+    uint8_t *reservation;
+    uint8_t *memory;
+
+    interp->memory = 0;
+    interp->memory_size = 0;
+    interp->reservation = 0;
+    interp->reservation_size = 0;
+
+    if (interp->sandbox == INTERPRETER_SANDBOX_MASK)
+    {
+        if ((memory_size == 0) || (memory_size & (memory_size - 1)))
+        {
+            return interpreter_error("Error: masked memory size has to be a power of two\n");
+        }
+        /* Masked addresses still reach up to 7 bytes past the end with the wider accesses. */
+        mapped_size += 8;
+    }
+    mapped_size = (mapped_size + page_size - 1) & ~(page_size - 1);
+    above = mapped_size;
+    if (interp->sandbox == INTERPRETER_SANDBOX_GUARD)
+    {
+        below = INTERPRETER_GUARD_BELOW;
+        above = ((mapped_size > INTERPRETER_GUARD_ABOVE) ? mapped_size : INTERPRETER_GUARD_ABOVE) + INTERPRETER_GUARD_PAST;
+    }
+    /* Room to move the memory up to the start of a huge page */
+    reservation_size = below + above + (interp->huge_pages ? page_size : 0);
+
+    reservation = mmap(0, reservation_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED)
+    {
+        return interpreter_error("Error: could not reserve address space for the interpreter memory\n");
+    }
+    memory = reservation + below;
+    if (interp->huge_pages)
+    {
+        memory = (uint8_t *) (((uintptr_t) memory + page_size - 1) & ~(uintptr_t) (page_size - 1));
+    }
+    if ((mapped_size > 0) && (mprotect(memory, mapped_size, PROT_READ | PROT_WRITE) != 0))
+    {
+        munmap(reservation, reservation_size);
+        return interpreter_error("Error: could not allocate memory for the interpreter\n");
+    }
+    if (interp->huge_pages && (mapped_size > 0) && (madvise(memory, mapped_size, MADV_HUGEPAGE) != 0))
+    {
+        munmap(reservation, reservation_size);
+        return interpreter_error("Error: huge pages are not available\n");
+    }
+    interp->reservation = reservation;
+    interp->reservation_size = reservation_size;
+    interp->memory = memory;
+    interp->memory_size = memory_size;
+    return 0;
+}
+
+void interpreter_release_memory(interpreter *interp)
+{
+    if (interp->reservation)
+    {
+        munmap(interp->reservation, interp->reservation_size);
+    }
+    interp->memory = 0;
+    interp->memory_size = 0;
+    interp->reservation = 0;
+    interp->reservation_size = 0;
+}
+
+/* Counts the pages the kernel has behind the memory so far, with mincore */
+uint64_t interpreter_committed_size(interpreter *interp)
+{
+    uint64_t page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t page_count = (interp->memory_size + page_size - 1) / page_size;
+    uint64_t committed = 0;
+    uint64_t page;
+    unsigned char *resident;
+
+    if (page_count == 0)
+    {
+        return 0;
+    }
+    resident = malloc(page_count);
+    if (resident == 0)
+    {
+        return 0;
+    }
+    if (mincore(interp->memory, page_count * page_size, resident) == 0)
+    {
+        for (page = 0; page < page_count; page++)
+        {
+            if (resident[page] & 0x1)
+                committed += page_size;
+        }
+    }
+    free(resident);
+    return committed;
+}
+
+static int32_t interpreter_page_is_zero(uint8_t *page, uint64_t page_size)
+{
+    uint64_t *words = (uint64_t *) page;
+    uint64_t i;
+    for (i = 0; i < page_size / 8; i++)
+    {
+        if (words[i])
+            return 0;
+    }
+    return 1;
+}
+
+#define INTERPRETER_SNAPSHOT_FILE_RANGES 16
+#define INTERPRETER_SNAPSHOT_PAGEMAP_CHUNK 512
+
+/*
+    Parts of the memory mapped from a file, the --load image. A page of those
+    can have data in it while the kernel has nothing behind it in this process.
+    With more than INTERPRETER_SNAPSHOT_FILE_RANGES of them, or no /proc/self/maps,
+    everything counts as file-backed.
+*/
+typedef struct
+{
+    uint8_t *begin[INTERPRETER_SNAPSHOT_FILE_RANGES];
+    uint8_t *end[INTERPRETER_SNAPSHOT_FILE_RANGES];
+    uint32_t count;
+    int32_t everything;
+} interpreter_snapshot_files;
+
+static void interpreter_find_file_ranges(interpreter_snapshot_files *files, uint8_t *memory, uint8_t *memory_end)
+{
+    char line[512];
+    FILE *maps = fopen("/proc/self/maps", "r");
+
+    memset(files, 0, sizeof(*files));
+    if (maps == 0)
+    {
+        files->everything = 1;
+        return;
+    }
+    while (fgets(line, sizeof(line), maps))
+    {
+        unsigned long long begin, end, inode;
+        if ((sscanf(line, "%llx-%llx %*s %*x %*x:%*x %llu", &begin, &end, &inode) != 3) || (inode == 0))
+            continue;
+        if ((end <= (uint64_t) memory) || (begin >= (uint64_t) memory_end))
+            continue;
+        if (files->count == INTERPRETER_SNAPSHOT_FILE_RANGES)
+        {
+            files->everything = 1;
+            break;
+        }
+        files->begin[files->count] = (begin < (uint64_t) memory) ? memory : (uint8_t *) begin;
+        files->end[files->count] = (end > (uint64_t) memory_end) ? memory_end : (uint8_t *) end;
+        files->count += 1;
+    }
+    fclose(maps);
+}
+
+static int32_t interpreter_is_file_page(interpreter_snapshot_files *files, uint8_t *page)
+{
+    uint32_t i;
+    if (files->everything)
+        return 1;
+    for (i = 0; i < files->count; i++)
+    {
+        if ((page >= files->begin[i]) && (page < files->end[i]))
+            return 1;
+    }
+    return 0;
+}
+
+static int32_t interpreter_write_snapshot_run(interpreter *interp, interpreter_snapshot *snapshot, uint64_t offset, uint64_t end)
+{
+    while (offset < end)
+    {
+        ssize_t written = pwrite(snapshot->fd, interp->memory + offset, end - offset, (off_t) offset);
+        if (written <= 0)
+        {
+            return interpreter_error("Error: could not write the snapshot memory\n");
+        }
+        offset += (uint64_t) written;
+    }
+    snapshot->file_size = end;
+    return 0;
+}
+
+/*
+    Only pages that can hold something are looked at: the ones /proc/self/pagemap
+    says are present (bit 63) or swapped out (bit 62), and the ones of a file
+    mapping, which may not be read in yet. The rest were never touched, or were
+    given back, and are zero without reading them, which would only fault in
+    the zero page for each. Of the pages looked at, those that are not zero are
+    written in runs, the rest of the memfd stays a hole.
+*/
+static int32_t interpreter_write_snapshot_memory(interpreter *interp, interpreter_snapshot *snapshot)
+{
+    uint64_t page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t size = interp->memory_size + ((interp->sandbox == INTERPRETER_SANDBOX_MASK) ? 8 : 0);
+    uint64_t page_count = (size + page_size - 1) / page_size;
+    uint64_t entries[INTERPRETER_SNAPSHOT_PAGEMAP_CHUNK];
+    interpreter_snapshot_files files;
+    uint64_t run = 0;
+    int32_t in_run = 0;
+    uint64_t chunk;
+    int pagemap;
+
+    interpreter_find_file_ranges(&files, interp->memory, interp->memory + page_count * page_size);
+    pagemap = open("/proc/self/pagemap", O_RDONLY);
+
+    for (chunk = 0; chunk < page_count; chunk += INTERPRETER_SNAPSHOT_PAGEMAP_CHUNK)
+    {
+        uint64_t count = page_count - chunk;
+        uint64_t i;
+        if (count > INTERPRETER_SNAPSHOT_PAGEMAP_CHUNK)
+            count = INTERPRETER_SNAPSHOT_PAGEMAP_CHUNK;
+
+        /* Without the pagemap every page might hold something */
+        if ((pagemap < 0) ||
+            (pread(pagemap, entries, count * sizeof(uint64_t), (off_t) (((uint64_t) interp->memory / page_size + chunk) * sizeof(uint64_t))) != (ssize_t) (count * sizeof(uint64_t))))
+        {
+            memset(entries, 0xff, sizeof(entries));
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            uint64_t page = chunk + i;
+            uint8_t *address = interp->memory + page * page_size;
+            int32_t data = ((entries[i] >> 62) & 0x3) || interpreter_is_file_page(&files, address);
+            if (data && !interpreter_page_is_zero(address, page_size))
+            {
+                if (!in_run)
+                    run = page;
+                in_run = 1;
+            }
+            else if (in_run)
+            {
+                in_run = 0;
+                if (interpreter_write_snapshot_run(interp, snapshot, run * page_size, page * page_size) != 0)
+                {
+                    if (pagemap >= 0)
+                        close(pagemap);
+                    return 1;
+                }
+            }
+        }
+    }
+    if (pagemap >= 0)
+    {
+        close(pagemap);
+    }
+    if (in_run)
+    {
+        return interpreter_write_snapshot_run(interp, snapshot, run * page_size, page_count * page_size);
+    }
+    return 0;
+}
+
+int32_t interpreter_take_snapshot(interpreter *interp, interpreter_snapshot *snapshot)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+    interpreter_flush(interp);
+
+    snapshot->fd = (int32_t) syscall(SYS_memfd_create, "pinapl-snapshot", MFD_CLOEXEC);
+    if (snapshot->fd < 0)
+    {
+        return interpreter_error("Error: could not create the snapshot memory\n");
+    }
+    snapshot->taken = 1;
+    if (interp->decoded_size > 0)
+    {
+        uint64_t decoded_bytes = (interp->decoded_size / 4 + 1) * sizeof(interpreter_instruction);
+        snapshot->decoded = malloc(decoded_bytes);
+        if (snapshot->decoded == 0)
+        {
+            interpreter_release_snapshot(snapshot);
+            return interpreter_error("Error: could not allocate memory for the snapshot\n");
+        }
+        memcpy(snapshot->decoded, interp->decoded, decoded_bytes);
+    }
+    if (interpreter_write_snapshot_memory(interp, snapshot) != 0)
+    {
+        interpreter_release_snapshot(snapshot);
+        return 1;
+    }
+
+    snapshot->memory_size = interp->memory_size;
+    snapshot->sandbox = interp->sandbox;
+    snapshot->huge_pages = interp->huge_pages;
+    memcpy(snapshot->registers, interp->registers, sizeof(snapshot->registers));
+    snapshot->flags = interp->flags;
+    snapshot->compare_lhs = interp->compare_lhs;
+    snapshot->compare_rhs = interp->compare_rhs;
+    snapshot->compare_kind = interp->compare_kind;
+    snapshot->decoded_size = interp->decoded_size;
+    snapshot->threaded = interp->threaded;
+    snapshot->code_version = interp->code_version;
+    memcpy(snapshot->return_stack, interp->return_stack, sizeof(snapshot->return_stack));
+    snapshot->return_top = interp->return_top;
+    snapshot->return_depth = interp->return_depth;
+    return 0;
+}
+
+int32_t interpreter_fork(interpreter *interp, interpreter_snapshot *snapshot)
+{
+    /* The output buffer is only read up to output_size, it is left as it is */
+    memset(interp, 0, offsetof(interpreter, output));
+    interp->output_size = 0;
+    interp->output_fd = 0;
+    interp->write_syscalls = 0;
+    interp->host_writes = 0;
+    interp->exit_status = 0;
+    memset(interp->profile_counts, 0, sizeof(interp->profile_counts));
+    memset(interp->profile_cycles, 0, sizeof(interp->profile_cycles));
+    interp->profile_op = 0;
+
+    interp->sandbox = snapshot->sandbox;
+    interp->huge_pages = snapshot->huge_pages;
+    if (interpreter_create_memory(interp, snapshot->memory_size) != 0)
+    {
+        return 1;
+    }
+    if ((snapshot->file_size > 0) &&
+        (mmap(interp->memory, snapshot->file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, snapshot->fd, 0) == MAP_FAILED))
+    {
+        interpreter_release_memory(interp);
+        return interpreter_error("Error: could not map the snapshot memory\n");
+    }
+    if (snapshot->decoded_size > 0)
+    {
+        uint64_t decoded_bytes = (snapshot->decoded_size / 4 + 1) * sizeof(interpreter_instruction);
+        interp->decoded = malloc(decoded_bytes);
+        if (interp->decoded == 0)
+        {
+            interpreter_release_memory(interp);
+            return interpreter_error("Error: could not allocate memory for the decoded instructions\n");
+        }
+        memcpy(interp->decoded, snapshot->decoded, decoded_bytes);
+    }
+
+    interp->address_mask = (interp->sandbox == INTERPRETER_SANDBOX_MASK) ? interp->memory_size - 1 : UINT64_MAX;
+    memcpy(interp->registers, snapshot->registers, sizeof(interp->registers));
+    interp->flags = snapshot->flags;
+    interp->compare_lhs = snapshot->compare_lhs;
+    interp->compare_rhs = snapshot->compare_rhs;
+    interp->compare_kind = snapshot->compare_kind;
+    interp->decoded_size = snapshot->decoded_size;
+    interp->threaded = snapshot->threaded;
+    interp->code_version = snapshot->code_version;
+    memcpy(interp->return_stack, snapshot->return_stack, sizeof(interp->return_stack));
+    interp->return_top = snapshot->return_top;
+    interp->return_depth = snapshot->return_depth;
+    return 0;
+}
+
+void interpreter_release_snapshot(interpreter_snapshot *snapshot)
+{
+    if (snapshot->taken)
+    {
+        close(snapshot->fd);
+    }
+    free(snapshot->decoded);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+
+int32_t interpreter_trace_create(interpreter_trace *trace, uint64_t capacity)
+{
+    memset(trace, 0, sizeof(*trace));
+    if ((capacity == 0) || (capacity & (capacity - 1)))
+    {
+        return interpreter_error("Error: trace capacity has to be a power of two\n");
+    }
+    trace->entries = calloc(capacity, sizeof(interpreter_trace_entry));
+    if (trace->entries == 0)
+    {
+        return interpreter_error("Error: could not allocate memory for the trace\n");
+    }
+    trace->capacity = capacity;
+    return 0;
+}
+
+void interpreter_trace_release(interpreter_trace *trace)
+{
+    free(trace->entries);
+    memset(trace, 0, sizeof(*trace));
+}
+
+/* The instruction before is done, registers has its value */
+static void interpreter_trace_publish(interpreter_trace *trace, uint64_t *registers)
+{
+    if (trace->pending)
+    {
+        trace->entries[trace->head & (trace->capacity - 1)].value = registers[trace->pending_register];
+        __atomic_store_n(&trace->head, trace->head + 1, __ATOMIC_RELEASE);
+        trace->pending = 0;
+    }
+}
+
+static void interpreter_trace_push(interpreter_trace *trace, uint64_t address, uint8_t op, uint8_t r0, uint64_t *registers)
+{
+    interpreter_trace_entry *entry;
+    interpreter_trace_publish(trace, registers);
+    entry = trace->entries + (trace->head & (trace->capacity - 1));
+    entry->address = (uint32_t) address;
+    entry->op = op;
+    entry->r0 = r0;
+    trace->pending = 1;
+    trace->pending_register = r0;
+}
+
+int32_t interpreter_trace_write(interpreter_trace *trace, char const *filename, uint64_t *count)
+{
+    interpreter_trace_header header;
+    interpreter_trace_entry *entries;
+    uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    uint64_t first = (head > trace->capacity) ? head - trace->capacity : 0;
+    uint64_t index;
+    FILE *file;
+
+    *count = 0;
+    entries = malloc((head - first) * sizeof(interpreter_trace_entry) + 1);
+    if (entries == 0)
+    {
+        return interpreter_error("Error: could not allocate memory for the trace\n");
+    }
+    for (index = first; index < head; index++)
+    {
+        entries[index - first] = trace->entries[index & (trace->capacity - 1)];
+    }
+    /* Drop what the interpreter could have written over in the meantime */
+    index = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    if (index >= trace->capacity)
+    {
+        index = index - trace->capacity + 1;
+    }
+    else
+    {
+        index = 0;
+    }
+    if (index > head)
+    {
+        index = head;
+    }
+    if (index < first)
+    {
+        index = first;
+    }
+
+    memcpy(header.magic, INTERPRETER_TRACE_MAGIC, sizeof(header.magic));
+    header.entry_size = sizeof(interpreter_trace_entry);
+    header.first = index;
+    header.count = head - index;
+    file = fopen(filename, "wb");
+    if (file == 0)
+    {
+        free(entries);
+        return interpreter_error("Error: could not open the trace file\n");
+    }
+    if ((fwrite(&header, sizeof(header), 1, file) != 1) ||
+        (fwrite(entries + (index - first), sizeof(interpreter_trace_entry), header.count, file) != header.count))
+    {
+        fclose(file);
+        free(entries);
+        return interpreter_error("Error: could not write the trace file\n");
+    }
+    fclose(file);
+    free(entries);
+    *count = header.count;
+    return 0;
+}
+
+
+static int32_t interpreter_cache_create_level(interpreter_cache_level *level, uint64_t line_size, uint64_t size, uint32_t ways)
+{
+    uint64_t index;
+    if ((ways == 0) || (size % (line_size * ways) != 0))
+    {
+        return interpreter_error("Error: cache size has to be a multiple of the line size times the ways\n");
+    }
+    level->set_count = size / (line_size * ways);
+    level->ways = ways;
+    if ((level->set_count == 0) || (level->set_count & (level->set_count - 1)))
+    {
+        return interpreter_error("Error: cache size over the line size times the ways has to be a power of two\n");
+    }
+    level->lines = malloc(level->set_count * ways * sizeof(uint64_t));
+    if (level->lines == 0)
+    {
+        return interpreter_error("Error: could not allocate memory for the cache model\n");
+    }
+    for (index = 0; index < level->set_count * ways; index++)
+        level->lines[index] = UINT64_MAX;
+    return 0;
+}
+
+int32_t interpreter_cache_create(interpreter_cache *cache, uint64_t code_size, uint64_t line_size,
+                                 uint64_t l1_size, uint32_t l1_ways, uint64_t l2_size, uint32_t l2_ways)
+{
+    memset(cache, 0, sizeof(*cache));
+    if ((line_size < 8) || (line_size & (line_size - 1)))
+    {
+        return interpreter_error("Error: cache line size has to be a power of two, at least 8\n");
+    }
+    while (((uint64_t) 1 << cache->line_shift) < line_size)
+        cache->line_shift += 1;
+    cache->slot_count = (code_size + 3) / 4;
+    cache->stats = calloc(cache->slot_count + 1, sizeof(interpreter_cache_stats));
+    if (cache->stats == 0)
+    {
+        return interpreter_error("Error: could not allocate memory for the cache model\n");
+    }
+    if ((interpreter_cache_create_level(&cache->l1, line_size, l1_size, l1_ways) != 0) ||
+        (interpreter_cache_create_level(&cache->l2, line_size, l2_size, l2_ways) != 0))
+    {
+        interpreter_cache_release(cache);
+        return 1;
+    }
+    return 0;
+}
+
+void interpreter_cache_release(interpreter_cache *cache)
+{
+    free(cache->l1.lines);
+    free(cache->l2.lines);
+    free(cache->stats);
+    memset(cache, 0, sizeof(*cache));
+}
+
+void interpreter_cache_sum(interpreter_cache *cache, uint64_t begin, uint64_t end, interpreter_cache_stats *sum)
+{
+    uint64_t slot = begin / 4;
+    uint64_t end_slot = (end > 4 * cache->slot_count) ? cache->slot_count + 1 : (end + 3) / 4;
+    memset(sum, 0, sizeof(*sum));
+    for (; slot < end_slot; slot++)
+    {
+        sum->accesses += cache->stats[slot].accesses;
+        sum->l1_misses += cache->stats[slot].l1_misses;
+        sum->l2_misses += cache->stats[slot].l2_misses;
+    }
+}
+
+/* Hit or miss, the line is the most recently used of its set after that */
+static int32_t interpreter_cache_lookup(interpreter_cache_level *level, uint64_t line)
+{
+    uint64_t *set = level->lines + (line & (level->set_count - 1)) * level->ways;
+    uint32_t way = 0;
+    int32_t hit;
+    while ((way < level->ways - 1) && (set[way] != line))
+        way += 1;
+    hit = (set[way] == line);
+    /* On a miss the least recently used line falls off the end */
+    memmove(set + 1, set, way * sizeof(uint64_t));
+    set[0] = line;
+    return hit;
+}
+
+static void interpreter_cache_access(interpreter_cache *cache, uint64_t code_address, uint64_t address, uint64_t size)
+{
+    uint64_t slot = code_address / 4;
+    interpreter_cache_stats *stats = cache->stats + ((slot < cache->slot_count) ? slot : cache->slot_count);
+    uint64_t line = address >> cache->line_shift;
+    uint64_t last = (address + size - 1) >> cache->line_shift;
+    for (; line <= last; line++)
+    {
+        stats->accesses += 1;
+        if (!interpreter_cache_lookup(&cache->l1, line))
+        {
+            stats->l1_misses += 1;
+            if (!interpreter_cache_lookup(&cache->l2, line))
+                stats->l2_misses += 1;
+        }
+    }
+}
+
+
+int32_t interpreter_predecode(interpreter *interp, uint64_t code_size)
+{
+    if (code_size > interp->memory_size)
+    {
+        return interpreter_error("Error: code region is outside of the interpreter memory\n");
+    }
+
+    free(interp->decoded);
+    interp->decoded = 0;
+    interp->decoded_size = 0;
+    interp->threaded = 0;
+    memset(interp->return_stack, 0xff, sizeof(interp->return_stack));
+    interp->return_top = 0;
+    interp->return_depth = 0;
+    interp->address_mask = (interp->sandbox == INTERPRETER_SANDBOX_MASK) ? interp->memory_size - 1 : UINT64_MAX;
+
+    /* Trailing bytes that do not make a whole instruction are left to the decoder. */
+    code_size = code_size & ~(uint64_t) 0x3;
+    if (code_size == 0)
+    {
+        return 0;
+    }
+
+    interp->decoded = calloc(code_size / 4 + 1, sizeof(interpreter_instruction));
+    if (interp->decoded == 0)
+    {
+        return interpreter_error("Error: could not allocate memory for the decoded instructions\n");
+    }
+    interp->decoded_size = code_size;
+    interp->decoded[code_size / 4].op = INTERPRETER_OP_SLOW;
+    interp->decoded[code_size / 4].cost = 1;
+    interpreter_invalidate(interp, 0, code_size);
+    return 0;
+}
+
+static uint8_t interpreter_select_op(interpreter *interp, uint64_t address, interpreter_instruction *in)
+{
+    bytecode bc = in->bc;
+    if ((bc.r0 == BYTECODE_RIP) || (bc.r1 == BYTECODE_RIP) || (bc.r2 == BYTECODE_RIP))
+    {
+        /* The run loop does not keep IP in the register file. */
+        return INTERPRETER_OP_SLOW;
+    }
+
+    switch (bc.opcode)
+    {
+        case BYTECODE_JMP_I:
+        case BYTECODE_JE_I:
+        case BYTECODE_JNE_I:
+        case BYTECODE_JL_I:
+        case BYTECODE_JLE_I:
+        case BYTECODE_JG_I:
+        case BYTECODE_JGE_I:
+        {
+            uint64_t target = address + 4 + bc.imm;
+            if ((target >= interp->decoded_size) || (target & 0x3))
+            {
+                return INTERPRETER_OP_SLOW;
+            }
+            in->target = target / 4;
+            return bc.opcode;
+        }
+
+        case BYTECODE_CALL_I:
+        {
+            uint64_t target = address + 4 + bc.imm;
+            if ((target >= interp->decoded_size) || (target & 0x3))
+            {
+                return INTERPRETER_OP_SLOW;
+            }
+            in->target = target / 4;
+            return bc.opcode;
+        }
+
+        case BYTECODE_SHL_RRI:
+        {
+            /* interpreter_step reports the error. */
+            if (bc.imm >= 64)
+            {
+                return INTERPRETER_OP_SLOW;
+            }
+            return bc.opcode;
+        }
+
+        case BYTECODE_LDC_RI:
+        {
+            /* The address of the constant is known now, so it is a plain LDR64 from then on. */
+            uint64_t constant = address + 4 + 4 * (int64_t) bc.imm;
+            if ((constant > 0x7fffffff) || (constant + 8 > interp->memory_size))
+            {
+                return INTERPRETER_OP_SLOW;
+            }
+            in->bc.opcode = BYTECODE_LDR64_RI;
+            in->bc.imm = (int32_t) constant;
+            return BYTECODE_LDR64_RI;
+        }
+
+        case BYTECODE_SYSCALL:
+        case BYTECODE_INVALID:
+            return INTERPRETER_OP_SLOW;
+    }
+    return bc.opcode;
+}
+
+static uint8_t interpreter_fuse_op(interpreter_instruction *in, interpreter_instruction *next)
+{
+    if ((in->op == INTERPRETER_OP_SLOW) || (next->op == INTERPRETER_OP_SLOW))
+    {
+        /* Only pairs of instructions the run loop executes directly. */
+        return in->op;
+    }
+
+    switch (in->bc.opcode)
+    {
+        case BYTECODE_CMP_RI:
+        case BYTECODE_CMP_RR:
+        {
+            if ((next->bc.opcode >= BYTECODE_JE_I) && (next->bc.opcode <= BYTECODE_JGE_I))
+            {
+                uint8_t first = (in->bc.opcode == BYTECODE_CMP_RI) ? INTERPRETER_OP_CMP_RI_JE : INTERPRETER_OP_CMP_RR_JE;
+                return first + (next->bc.opcode - BYTECODE_JE_I);
+            }
+        }
+        break;
+
+        case BYTECODE_MOV_RR:
+        {
+            if (next->bc.opcode == BYTECODE_MOV_RR)
+                return INTERPRETER_OP_MOV_RR_MOV_RR;
+        }
+        break;
+
+        case BYTECODE_ADD_RRI:
+        {
+            if (next->bc.opcode == BYTECODE_CMP_RI)
+                return INTERPRETER_OP_ADD_RRI_CMP_RI;
+        }
+        break;
+    }
+    return in->op;
+}
+
+static int32_t interpreter_ends_block(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case BYTECODE_JMP_I:
+        case BYTECODE_JE_I:
+        case BYTECODE_JNE_I:
+        case BYTECODE_JL_I:
+        case BYTECODE_JLE_I:
+        case BYTECODE_JG_I:
+        case BYTECODE_JGE_I:
+        case BYTECODE_CALL_I:
+        case BYTECODE_RET:
+            return 1;
+    }
+    return 0;
+}
+
+/*
+    Counts the cost of the slots before end_slot backwards. The cost of a slot
+    depends on the slots after it up to the end of the block, so the ones before
+    first_slot are counted again until one comes out as it was.
+*/
+static void interpreter_count_blocks(interpreter *interp, uint64_t first_slot, uint64_t end_slot)
+{
+    uint64_t slot = end_slot;
+    while (slot > 0)
+    {
+        interpreter_instruction *in = interp->decoded + (slot - 1);
+        uint32_t cost = interpreter_ends_block(in->bc.opcode) ? 1 : in[1].cost + 1;
+        slot -= 1;
+        if ((slot < first_slot) && (in->cost == cost))
+        {
+            break;
+        }
+        in->cost = cost;
+    }
+}
+
+void interpreter_invalidate(interpreter *interp, uint64_t address, uint64_t size)
+{
+    uint64_t end = address + size;
+    uint64_t slot, first_slot;
+    if (end > interp->decoded_size)
+    {
+        end = interp->decoded_size;
+    }
+
+    address = address & ~(uint64_t) 0x3;
+    if (address >= end)
+    {
+        return;
+    }
+
+    /* The slot after the touched ones could be extended by a WIDE prefix among them. */
+    end = ((end + 0x3) & ~(uint64_t) 0x3) + 4;
+    if (end > interp->decoded_size)
+    {
+        end = interp->decoded_size;
+    }
+
+    first_slot = address / 4;
+    for (; address < end; address += 4)
+    {
+        interpreter_instruction *in = interp->decoded + (address / 4);
+        uint64_t decoded;
+        memset(in, 0, sizeof(interpreter_instruction));
+        if ((address > 0) && (interp->memory[address - 4] == BYTECODE_WIDE))
+            decoded = bytecode_decode(interp->memory + address - 4, 8, &in->bc);
+        else
+            decoded = bytecode_decode(interp->memory + address, 4, &in->bc);
+        if (decoded == 0)
+        {
+            in->bc.opcode = BYTECODE_INVALID;
+        }
+        in->op = interpreter_select_op(interp, address, in);
+    }
+
+    /* Re-fuse the touched slots and the one before them, which could have been fused with the first. */
+    slot = (first_slot > 0) ? first_slot - 1 : 0;
+    for (; slot < end / 4; slot++)
+    {
+        interpreter_instruction *in = interp->decoded + slot;
+        in->op = interpreter_select_op(interp, slot * 4, in);
+        in->op = interpreter_fuse_op(in, in + 1);
+    }
+    interpreter_count_blocks(interp, first_slot, end / 4);
+    interp->threaded = 0;
+    interp->code_version += 1;
+}
+
+
+/* Addresses that are not a slot of the decoded region are kept as ones RET never matches. */
+static void interpreter_push_return(interpreter *interp, uint64_t address)
+{
+    if ((address >= interp->decoded_size) || (address & 0x3))
+    {
+        address = UINT64_MAX;
+    }
+    interp->return_top = (interp->return_top + 1) & (INTERPRETER_RETURN_STACK_SIZE - 1);
+    interp->return_stack[interp->return_top] = address;
+    if (interp->return_depth < INTERPRETER_RETURN_STACK_SIZE)
+        interp->return_depth += 1;
+}
+
+/* Returns whether the address was predicted */
+static int32_t interpreter_pop_return(interpreter *interp, uint64_t address)
+{
+    uint64_t predicted = interp->return_stack[interp->return_top];
+    interp->return_top = (interp->return_top - 1) & (INTERPRETER_RETURN_STACK_SIZE - 1);
+    if (interp->return_depth > 0)
+        interp->return_depth -= 1;
+    if (predicted != address)
+    {
+        interp->return_mispredicts += 1;
+        return 0;
+    }
+    return 1;
+}
+
+
+static int32_t interpreter_write_all(int fd, uint8_t const *data, uint64_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0)
+        {
+            return 1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+void interpreter_flush(interpreter *interp)
+{
+    if (interp->output_size > 0)
+    {
+        /* The host may have printed something before, it goes first */
+        fflush(0);
+        interpreter_write_all(interp->output_fd, interp->output, interp->output_size);
+        interp->output_size = 0;
+        interp->host_writes += 1;
+    }
+}
+
+static uint64_t interpreter_syscall_write(interpreter *interp, uint64_t fd, uint64_t address, uint64_t size)
+{
+    if (((fd != 1) && (fd != 2)) || (address > interp->memory_size) || (size > interp->memory_size - address))
+    {
+        return UINT64_MAX;
+    }
+    interp->write_syscalls += 1;
+    if ((interp->output_size > 0) && ((uint64_t) interp->output_fd != fd))
+    {
+        interpreter_flush(interp);
+    }
+    if (size > INTERPRETER_OUTPUT_SIZE - interp->output_size)
+    {
+        interpreter_flush(interp);
+    }
+    if (size >= INTERPRETER_OUTPUT_SIZE)
+    {
+        /* Would not fit anyway, so it goes out as it is */
+        fflush(0);
+        interp->host_writes += 1;
+        if (interpreter_write_all((int) fd, interp->memory + address, size))
+        {
+            return UINT64_MAX;
+        }
+        return size;
+    }
+    memcpy(interp->output + interp->output_size, interp->memory + address, size);
+    interp->output_size += size;
+    interp->output_fd = (int32_t) fd;
+    return size;
+}
+
+static uint64_t interpreter_syscall_read(interpreter *interp, uint64_t fd, uint64_t address, uint64_t size)
+{
+    ssize_t bytes_read;
+    if ((fd != 0) || (address > interp->memory_size) || (size > interp->memory_size - address))
+    {
+        return UINT64_MAX;
+    }
+    /* Whatever the program asked the user should be visible before it waits for the answer */
+    interpreter_flush(interp);
+    bytes_read = read((int) fd, interp->memory + address, size);
+    if (bytes_read < 0)
+    {
+        return UINT64_MAX;
+    }
+    if (address < interp->decoded_size)
+    {
+        interpreter_invalidate(interp, address, bytes_read);
+    }
+    return bytes_read;
+}
+
+static int32_t interpreter_syscall(interpreter *interp, uint32_t code)
+{
+    uint64_t *r = interp->registers;
+    switch (code)
+    {
+        case BYTECODE_SYSCALL_EXIT:
+        {
+            interpreter_flush(interp);
+            interp->exit_status = r[BYTECODE_R0];
+            return INTERPRETER_EXITED;
+        }
+
+        case BYTECODE_SYSCALL_WRITE:
+        {
+            r[BYTECODE_R0] = interpreter_syscall_write(interp, r[BYTECODE_R0], r[BYTECODE_R1], r[BYTECODE_R2]);
+        }
+        break;
+
+        case BYTECODE_SYSCALL_READ:
+        {
+            r[BYTECODE_R0] = interpreter_syscall_read(interp, r[BYTECODE_R0], r[BYTECODE_R1], r[BYTECODE_R2]);
+        }
+        break;
+
+        case BYTECODE_SYSCALL_CLOCK:
+        {
+            struct timespec t;
+            clock_gettime(CLOCK_MONOTONIC, &t);
+            r[BYTECODE_R0] = (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+        }
+        break;
+
+        default:
+            return interpreter_error("Error: unknown syscall\n");
+    }
+    return 0;
+}
+
+
+uint64_t interpreter_flags(interpreter *interp)
+{
+    uint64_t flags = 0;
+    if (interp->compare_kind == INTERPRETER_COMPARE_NONE)
+    {
+        return interp->flags;
+    }
+
+    if (interp->compare_lhs == interp->compare_rhs)
+        flags = (flags | INTERPRETER_FLAG_EQUAL);
+    if (interp->compare_lhs < interp->compare_rhs)
+        flags = (flags | INTERPRETER_FLAG_LESS);
+    if (interp->compare_lhs > interp->compare_rhs)
+        flags = (flags | INTERPRETER_FLAG_MORE);
+    return flags;
+}
+
+
+static int32_t interpreter_execute(interpreter *interp)
 {
     bytecode bc;
-    uint64_t advance = bytecode_decode(interp->memory + interp->registers[BYTECODE_RIP], interp->memory_size - interp->registers[BYTECODE_RIP], &bc);
+    uint64_t advance;
+    uint64_t ip = interp->registers[BYTECODE_RIP];
+    if ((ip < interp->decoded_size) && ((ip & 0x3) == 0))
+    {
+        bc = interp->decoded[ip / 4].bc;
+        advance = (bc.opcode == BYTECODE_INVALID) ? 0 : 4;
+    }
+    else if (ip < interp->memory_size)
+    {
+        advance = bytecode_decode(interp->memory + ip, interp->memory_size - ip, &bc);
+    }
+    else
+    {
+        /* RET can take the instruction pointer anywhere */
+        advance = 0;
+    }
     if (advance == 0)
     {
         return 1;
     }
 
+    /* What the variant of the run loop does for its instructions, for these ones */
+    if (interp->variant == INTERPRETER_VARIANT_TRACE)
+    {
+        interpreter_trace_push(interp->trace, ip, bc.opcode, bc.r0, interp->registers);
+    }
+    if (((interp->variant == INTERPRETER_VARIANT_CACHE) || (interp->variant == INTERPRETER_VARIANT_CHECKED)) &&
+        (bc.opcode >= BYTECODE_LDR8_RI) && (bc.opcode <= BYTECODE_STR64_RA))
+    {
+        /* Four sizes of each of LDR RI, LDR RA, STR RI, STR RA, in that order */
+        uint32_t form = bc.opcode - BYTECODE_LDR8_RI;
+        uint64_t size = 1 << (form & 0x3);
+        uint64_t address = (form & 0x4)
+            ? (uint32_t) (bc.cc * (1 << bc.c) * interp->registers[bc.r1] + bc.cr * interp->registers[bc.r2] + bc.a)
+            : (uint64_t) bc.imm;
+        address &= interp->address_mask;
+        if (interp->variant == INTERPRETER_VARIANT_CACHE)
+        {
+            interpreter_cache_access(interp->cache, ip, address, size);
+        }
+        else if (address > interp->memory_size - size)
+        {
+            interp->fault_address = (int64_t) address;
+            printf("Error: guest memory access at %lld is outside of the interpreter memory\n", (long long) interp->fault_address);
+            return INTERPRETER_FAULT;
+        }
+    }
     interp->registers[BYTECODE_RIP] += advance;
 
     switch (bc.opcode)
@@ -39,28 +1084,28 @@ int32_t interpreter_step(interpreter *interp)
         case BYTECODE_LDR8_RI:
         {
             /*printf("ldr r%d, byte [0x%x]\n", bc.r0, bc.imm);*/
-            interp->registers[bc.r0] = *(uint8_t *) (interp->memory + bc.imm);
+            interp->registers[bc.r0] = *(uint8_t *) (interp->memory + (bc.imm & interp->address_mask));
         }
         break;
 
         case BYTECODE_LDR16_RI:
         {
             /*printf("ldr r%d, word [0x%x]\n", bc.r0, bc.imm);*/
-            interp->registers[bc.r0] = *(uint16_t *) (interp->memory + bc.imm);
+            interp->registers[bc.r0] = *(uint16_t *) (interp->memory + (bc.imm & interp->address_mask));
         }
         break;
 
         case BYTECODE_LDR32_RI:
         {
             /*printf("ldr r%d, dword [0x%x]\n", bc.r0, bc.imm);*/
-            interp->registers[bc.r0] = *(uint32_t *) (interp->memory + bc.imm);
+            interp->registers[bc.r0] = *(uint32_t *) (interp->memory + (bc.imm & interp->address_mask));
         }
         break;
 
         case BYTECODE_LDR64_RI:
         {
             /*printf("ldr r%d, qword [0x%x]\n", bc.r0, bc.imm);*/
-            interp->registers[bc.r0] = *(uint64_t *) (interp->memory + bc.imm);
+            interp->registers[bc.r0] = *(uint64_t *) (interp->memory + (bc.imm & interp->address_mask));
         }
         break;
 
@@ -86,7 +1131,7 @@ int32_t interpreter_step(interpreter *interp)
             }
             /*printf("]\n");*/
 
-            uint32_t address = bc.cc * (1 << bc.c) * interp->registers[bc.r1] + bc.cr * interp->registers[bc.r2] + bc.a;
+            uint32_t address = (bc.cc * (1 << bc.c) * interp->registers[bc.r1] + bc.cr * interp->registers[bc.r2] + bc.a) & interp->address_mask;
             if (bc.opcode == BYTECODE_LDR8_RA)
                 interp->registers[bc.r0] = *(uint8_t *) (interp->memory + address);
             if (bc.opcode == BYTECODE_LDR16_RA)
@@ -101,28 +1146,40 @@ int32_t interpreter_step(interpreter *interp)
         case BYTECODE_STR8_RI:
         {
             /*printf("str r%d, byte [0x%x]\n", bc.r0, bc.imm);*/
-            *(uint8_t *) (interp->memory + bc.imm) = interp->registers[bc.r0];
+            uint64_t address = bc.imm & interp->address_mask;
+            *(uint8_t *) (interp->memory + address) = interp->registers[bc.r0];
+            if (address < interp->decoded_size)
+                interpreter_invalidate(interp, address, 1);
         }
         break;
 
         case BYTECODE_STR16_RI:
         {
             /*printf("str r%d, word [0x%x]\n", bc.r0, bc.imm);*/
-            *(uint16_t *) (interp->memory + bc.imm) = interp->registers[bc.r0];
+            uint64_t address = bc.imm & interp->address_mask;
+            *(uint16_t *) (interp->memory + address) = interp->registers[bc.r0];
+            if (address < interp->decoded_size)
+                interpreter_invalidate(interp, address, 2);
         }
         break;
 
         case BYTECODE_STR32_RI:
         {
             /*printf("str r%d, dword [0x%x]\n", bc.r0, bc.imm);*/
-            *(uint32_t *) (interp->memory + bc.imm) = interp->registers[bc.r0];
+            uint64_t address = bc.imm & interp->address_mask;
+            *(uint32_t *) (interp->memory + address) = interp->registers[bc.r0];
+            if (address < interp->decoded_size)
+                interpreter_invalidate(interp, address, 4);
         }
         break;
 
         case BYTECODE_STR64_RI:
         {
             /*printf("str r%d, qword [0x%x]\n", bc.r0, bc.imm);*/
-            *(uint64_t *) (interp->memory + bc.imm) = interp->registers[bc.r0];
+            uint64_t address = bc.imm & interp->address_mask;
+            *(uint64_t *) (interp->memory + address) = interp->registers[bc.r0];
+            if (address < interp->decoded_size)
+                interpreter_invalidate(interp, address, 8);
         }
         break;
 
@@ -148,7 +1205,7 @@ int32_t interpreter_step(interpreter *interp)
             }
             /*printf("]\n");*/
 
-            uint32_t address = bc.cc * (1 << bc.c) * interp->registers[bc.r1] + bc.cr * interp->registers[bc.r2] + bc.a;
+            uint32_t address = (bc.cc * (1 << bc.c) * interp->registers[bc.r1] + bc.cr * interp->registers[bc.r2] + bc.a) & interp->address_mask;
             if (bc.opcode == BYTECODE_STR8_RA)
                 *(uint8_t *) (interp->memory + address) = (uint8_t) interp->registers[bc.r0];
             if (bc.opcode == BYTECODE_STR16_RA)
@@ -157,6 +1214,9 @@ int32_t interpreter_step(interpreter *interp)
                 *(uint32_t *) (interp->memory + address) = (uint32_t) interp->registers[bc.r0];
             if (bc.opcode == BYTECODE_STR64_RA)
                 *(uint64_t *) (interp->memory + address) = (uint64_t) interp->registers[bc.r0];
+            /* Re-decoding the slots of the widest store is harmless for the narrower ones. */
+            if (address < interp->decoded_size)
+                interpreter_invalidate(interp, address, 8);
         }
         break;
 
@@ -287,26 +1347,18 @@ int32_t interpreter_step(interpreter *interp)
         case BYTECODE_CMP_RI:
         {
             /*printf("cmp r%d, 0x%x\n", bc.r0, bc.imm);*/
-            interp->flags = 0;
-            if (interp->registers[bc.r0] == bc.imm)
-                interp->flags = (interp->flags | INTERPRETER_FLAG_EQUAL);
-            if (interp->registers[bc.r0] < bc.imm)
-                interp->flags = (interp->flags | INTERPRETER_FLAG_LESS);
-            if (interp->registers[bc.r0] > bc.imm)
-                interp->flags = (interp->flags | INTERPRETER_FLAG_MORE);
+            interp->compare_kind = INTERPRETER_COMPARE_UNSIGNED;
+            interp->compare_lhs = interp->registers[bc.r0];
+            interp->compare_rhs = bc.imm;
         }
         break;
 
         case BYTECODE_CMP_RR:
         {
             /*printf("cmp r%d, r%d\n", bc.r0, bc.r1);*/
-            interp->flags = 0;
-            if (interp->registers[bc.r0] == interp->registers[bc.r1])
-                interp->flags = (interp->flags | INTERPRETER_FLAG_EQUAL);
-            if (interp->registers[bc.r0] < interp->registers[bc.r1])
-                interp->flags = (interp->flags | INTERPRETER_FLAG_LESS);
-            if (interp->registers[bc.r0] > interp->registers[bc.r1])
-                interp->flags = (interp->flags | INTERPRETER_FLAG_MORE);
+            interp->compare_kind = INTERPRETER_COMPARE_UNSIGNED;
+            interp->compare_lhs = interp->registers[bc.r0];
+            interp->compare_rhs = interp->registers[bc.r1];
         }
         break;
 
@@ -320,7 +1372,7 @@ int32_t interpreter_step(interpreter *interp)
         case BYTECODE_JE_I:
         {
             /*printf("je 0x%d\n", bc.imm);*/
-            if ((interp->flags & INTERPRETER_FLAG_EQUAL) > 0)
+            if ((interpreter_flags(interp) & INTERPRETER_FLAG_EQUAL) > 0)
             {
                 interp->registers[BYTECODE_RIP] += bc.imm;
             }
@@ -330,7 +1382,7 @@ int32_t interpreter_step(interpreter *interp)
         case BYTECODE_JNE_I:
         {
             /*printf("jne 0x%d\n", bc.imm);*/
-            if ((interp->flags & INTERPRETER_FLAG_EQUAL) == 0)
+            if ((interpreter_flags(interp) & INTERPRETER_FLAG_EQUAL) == 0)
             {
                 interp->registers[BYTECODE_RIP] += bc.imm;
             }
@@ -340,7 +1392,7 @@ int32_t interpreter_step(interpreter *interp)
         case BYTECODE_JL_I:
         {
             /*printf("jl 0x%d\n", bc.imm);*/
-            if ((interp->flags & INTERPRETER_FLAG_LESS) > 0)
+            if ((interpreter_flags(interp) & INTERPRETER_FLAG_LESS) > 0)
             {
                 interp->registers[BYTECODE_RIP] += bc.imm;
             }
@@ -350,8 +1402,8 @@ int32_t interpreter_step(interpreter *interp)
         case BYTECODE_JLE_I:
         {
             /*printf("jle 0x%d\n", bc.imm);*/
-            if (((interp->flags & INTERPRETER_FLAG_LESS) > 0) ||
-                ((interp->flags & INTERPRETER_FLAG_EQUAL) > 0))
+            if (((interpreter_flags(interp) & INTERPRETER_FLAG_LESS) > 0) ||
+                ((interpreter_flags(interp) & INTERPRETER_FLAG_EQUAL) > 0))
             {
                 interp->registers[BYTECODE_RIP] += bc.imm;
             }
@@ -361,7 +1413,7 @@ int32_t interpreter_step(interpreter *interp)
         case BYTECODE_JG_I:
         {
             /*printf("jg 0x%d\n", bc.imm);*/
-            if ((interp->flags & INTERPRETER_FLAG_MORE) > 0)
+            if ((interpreter_flags(interp) & INTERPRETER_FLAG_MORE) > 0)
             {
                 interp->registers[BYTECODE_RIP] += bc.imm;
             }
@@ -371,8 +1423,8 @@ int32_t interpreter_step(interpreter *interp)
         case BYTECODE_JGE_I:
         {
             /*printf("jge 0x%d\n", bc.imm);*/
-            if (((interp->flags & INTERPRETER_FLAG_MORE) > 0) ||
-                ((interp->flags & INTERPRETER_FLAG_EQUAL) > 0))
+            if (((interpreter_flags(interp) & INTERPRETER_FLAG_MORE) > 0) ||
+                ((interpreter_flags(interp) & INTERPRETER_FLAG_EQUAL) > 0))
             {
                 interp->registers[BYTECODE_RIP] += bc.imm;
             }
@@ -382,20 +1434,67 @@ int32_t interpreter_step(interpreter *interp)
         case BYTECODE_SETE_R:
         {
             /*printf("sete r%d\n", bc.r0);*/
-            interp->registers[bc.r0] = (interp->flags & INTERPRETER_FLAG_EQUAL) > 0;
+            interp->registers[bc.r0] = (interpreter_flags(interp) & INTERPRETER_FLAG_EQUAL) > 0;
         }
         break;
 
         case BYTECODE_SETNE_R:
         {
             /*printf("setne r%d\n", bc.r0);*/
-            interp->registers[bc.r0] = (interp->flags & INTERPRETER_FLAG_EQUAL) == 0;
+            interp->registers[bc.r0] = (interpreter_flags(interp) & INTERPRETER_FLAG_EQUAL) == 0;
+        }
+        break;
+
+        case BYTECODE_LDC_RI:
+        {
+            /* IP already points to the next instruction */
+            uint64_t constant = interp->registers[BYTECODE_RIP] + 4 * (int64_t) bc.imm;
+            if ((constant >= interp->memory_size) || (interp->memory_size - constant < 8))
+            {
+                return interpreter_error("Error: constant is outside of the interpreter memory\n");
+            }
+            interp->registers[bc.r0] = *(uint64_t *) (interp->memory + constant);
+        }
+        break;
+
+        case BYTECODE_WIDE:
+        {
+            /* Only in the decoded region, where the next slot has the prefix applied already. */
         }
         break;
 
         case BYTECODE_CALL_I:
+        {
+            /* IP already points to the return address */
+            uint64_t sp = interp->registers[BYTECODE_RSP] - 8;
+            if ((sp >= interp->memory_size) || (interp->memory_size - sp < 8))
+            {
+                return interpreter_error("Error: stack pointer is outside of the interpreter memory\n");
+            }
+            *(uint64_t *) (interp->memory + sp) = interp->registers[BYTECODE_RIP];
+            interp->registers[BYTECODE_RSP] = sp;
+            interpreter_push_return(interp, interp->registers[BYTECODE_RIP]);
+            interp->registers[BYTECODE_RIP] += bc.imm;
+            if (sp < interp->decoded_size)
+                interpreter_invalidate(interp, sp, 8);
+        }
+        break;
+
         case BYTECODE_RET:
+        {
+            uint64_t sp = interp->registers[BYTECODE_RSP];
+            if ((sp >= interp->memory_size) || (interp->memory_size - sp < 8))
+            {
+                return interpreter_error("Error: stack pointer is outside of the interpreter memory\n");
+            }
+            interp->registers[BYTECODE_RIP] = *(uint64_t *) (interp->memory + sp);
+            interp->registers[BYTECODE_RSP] = sp + 8;
+            interpreter_pop_return(interp, interp->registers[BYTECODE_RIP]);
+        }
+        break;
+
         case BYTECODE_SYSCALL:
+            return interpreter_syscall(interp, bc.imm);
 
         case BYTECODE_INVALID:
         default:
@@ -405,8 +1504,400 @@ int32_t interpreter_step(interpreter *interp)
     return 0;
 }
 
+#if defined(__GNUC__)
+#define INTERPRETER_THREADED 1
+#else
+#define INTERPRETER_THREADED 0
+#endif
+
+static char const *interpreter_op_names[INTERPRETER_OP_COUNT] =
+{
+    [BYTECODE_MOV_RI]   = "MOV_RI",
+    [BYTECODE_MOV_RR]   = "MOV_RR",
+    [BYTECODE_LDR8_RI]  = "LDR8_RI",
+    [BYTECODE_LDR16_RI] = "LDR16_RI",
+    [BYTECODE_LDR32_RI] = "LDR32_RI",
+    [BYTECODE_LDR64_RI] = "LDR64_RI",
+    [BYTECODE_LDR8_RA]  = "LDR8_RA",
+    [BYTECODE_LDR16_RA] = "LDR16_RA",
+    [BYTECODE_LDR32_RA] = "LDR32_RA",
+    [BYTECODE_LDR64_RA] = "LDR64_RA",
+    [BYTECODE_STR8_RI]  = "STR8_RI",
+    [BYTECODE_STR16_RI] = "STR16_RI",
+    [BYTECODE_STR32_RI] = "STR32_RI",
+    [BYTECODE_STR64_RI] = "STR64_RI",
+    [BYTECODE_STR8_RA]  = "STR8_RA",
+    [BYTECODE_STR16_RA] = "STR16_RA",
+    [BYTECODE_STR32_RA] = "STR32_RA",
+    [BYTECODE_STR64_RA] = "STR64_RA",
+    [BYTECODE_ADD_RRI]  = "ADD_RRI",
+    [BYTECODE_ADD_RRR]  = "ADD_RRR",
+    [BYTECODE_SUB_RRI]  = "SUB_RRI",
+    [BYTECODE_SUB_RRR]  = "SUB_RRR",
+    [BYTECODE_MUL_RRI]  = "MUL_RRI",
+    [BYTECODE_MUL_RRR]  = "MUL_RRR",
+    [BYTECODE_AND_RRI]  = "AND_RRI",
+    [BYTECODE_AND_RRR]  = "AND_RRR",
+    [BYTECODE_OR_RRI]   = "OR_RRI",
+    [BYTECODE_OR_RRR]   = "OR_RRR",
+    [BYTECODE_XOR_RRI]  = "XOR_RRI",
+    [BYTECODE_XOR_RRR]  = "XOR_RRR",
+    [BYTECODE_NOT_RR]   = "NOT_RR",
+    [BYTECODE_SHR_RRI]  = "SHR_RRI",
+    [BYTECODE_SHR_RRR]  = "SHR_RRR",
+    [BYTECODE_SHL_RRI]  = "SHL_RRI",
+    [BYTECODE_SHL_RRR]  = "SHL_RRR",
+    [BYTECODE_CMP_RI]   = "CMP_RI",
+    [BYTECODE_CMP_RR]   = "CMP_RR",
+    [BYTECODE_JMP_I]    = "JMP_I",
+    [BYTECODE_JE_I]     = "JE_I",
+    [BYTECODE_JNE_I]    = "JNE_I",
+    [BYTECODE_JL_I]     = "JL_I",
+    [BYTECODE_JLE_I]    = "JLE_I",
+    [BYTECODE_JG_I]     = "JG_I",
+    [BYTECODE_JGE_I]    = "JGE_I",
+    [BYTECODE_SETE_R]   = "SETE_R",
+    [BYTECODE_SETNE_R]  = "SETNE_R",
+    [BYTECODE_CALL_I]   = "CALL_I",
+    [BYTECODE_RET]      = "RET",
+    [BYTECODE_SYSCALL]  = "SYSCALL",
+    [BYTECODE_LDC_RI]   = "LDC_RI",
+    [BYTECODE_WIDE]     = "WIDE",
+
+    [INTERPRETER_OP_SLOW] = "SLOW",
+
+    [INTERPRETER_OP_CMP_RI_JE]      = "CMP_RI_JE",
+    [INTERPRETER_OP_CMP_RI_JNE]     = "CMP_RI_JNE",
+    [INTERPRETER_OP_CMP_RI_JL]      = "CMP_RI_JL",
+    [INTERPRETER_OP_CMP_RI_JLE]     = "CMP_RI_JLE",
+    [INTERPRETER_OP_CMP_RI_JG]      = "CMP_RI_JG",
+    [INTERPRETER_OP_CMP_RI_JGE]     = "CMP_RI_JGE",
+    [INTERPRETER_OP_CMP_RR_JE]      = "CMP_RR_JE",
+    [INTERPRETER_OP_CMP_RR_JNE]     = "CMP_RR_JNE",
+    [INTERPRETER_OP_CMP_RR_JL]      = "CMP_RR_JL",
+    [INTERPRETER_OP_CMP_RR_JLE]     = "CMP_RR_JLE",
+    [INTERPRETER_OP_CMP_RR_JG]      = "CMP_RR_JG",
+    [INTERPRETER_OP_CMP_RR_JGE]     = "CMP_RR_JGE",
+    [INTERPRETER_OP_MOV_RR_MOV_RR]  = "MOV_RR_MOV_RR",
+    [INTERPRETER_OP_ADD_RRI_CMP_RI] = "ADD_RRI_CMP_RI",
+};
+
+static char const *interpreter_class_names[INTERPRETER_CLASS_COUNT] =
+{
+    [INTERPRETER_CLASS_MOVE]       = "move",
+    [INTERPRETER_CLASS_LOAD]       = "load",
+    [INTERPRETER_CLASS_STORE]      = "store",
+    [INTERPRETER_CLASS_ARITHMETIC] = "arithmetic",
+    [INTERPRETER_CLASS_COMPARE]    = "compare",
+    [INTERPRETER_CLASS_BRANCH]     = "branch",
+    [INTERPRETER_CLASS_CALL]       = "call",
+    [INTERPRETER_CLASS_FUSED]      = "fused",
+    [INTERPRETER_CLASS_SLOW]       = "slow",
+};
+
+uint32_t interpreter_op_class(uint32_t op)
+{
+    if ((op == BYTECODE_MOV_RI) || (op == BYTECODE_MOV_RR) || (op == BYTECODE_WIDE))
+        return INTERPRETER_CLASS_MOVE;
+    if ((op >= BYTECODE_LDR8_RI) && (op <= BYTECODE_LDR64_RA))
+        return INTERPRETER_CLASS_LOAD;
+    if ((op >= BYTECODE_STR8_RI) && (op <= BYTECODE_STR64_RA))
+        return INTERPRETER_CLASS_STORE;
+    if ((op >= BYTECODE_ADD_RRI) && (op <= BYTECODE_SHL_RRR))
+        return INTERPRETER_CLASS_ARITHMETIC;
+    if ((op == BYTECODE_CMP_RI) || (op == BYTECODE_CMP_RR) || (op == BYTECODE_SETE_R) || (op == BYTECODE_SETNE_R))
+        return INTERPRETER_CLASS_COMPARE;
+    if ((op >= BYTECODE_JMP_I) && (op <= BYTECODE_JGE_I))
+        return INTERPRETER_CLASS_BRANCH;
+    if ((op == BYTECODE_CALL_I) || (op == BYTECODE_RET))
+        return INTERPRETER_CLASS_CALL;
+    if ((op > INTERPRETER_OP_SLOW) && (op < INTERPRETER_OP_COUNT))
+        return INTERPRETER_CLASS_FUSED;
+    return INTERPRETER_CLASS_SLOW;
+}
+
+char const *interpreter_class_name(uint32_t op_class)
+{
+    return (op_class < INTERPRETER_CLASS_COUNT) ? interpreter_class_names[op_class] : "unknown";
+}
+
+/*
+    Where the guarded run or step going on on this thread is in interpreter_execute:
+    what the interpreter is left with when an access there faults on the guard page
+    (see interpreter_fault_handler). Its registers are in interp already.
+*/
+typedef struct
+{
+    uint64_t address;       /* Instruction being executed */
+    uint64_t steps;         /* Steps the run has taken, not in interp->step_count yet */
+} interpreter_guard_frame;
+
+/* An access of a guarded run loop that may fault, and where to go on when it does, relative to each field */
+typedef struct
+{
+    int32_t access;
+    int32_t fixup;
+} interpreter_guard_fixup;
+
+/* The linker puts these around the section the guarded run loops fill in */
+extern interpreter_guard_fixup const __start_interpreter_guard_fixups[];
+extern interpreter_guard_fixup const __stop_interpreter_guard_fixups[];
+
+static __thread interpreter_guard_frame *interpreter_guard_current;
+
+#define INTERPRETER_LOOP          interpreter_run_fast
+#define INTERPRETER_LOOP_VARIANT  INTERPRETER_VARIANT_FAST
+#define INTERPRETER_LOOP_PROFILE  0
+#define INTERPRETER_LOOP_TRACE    0
+#define INTERPRETER_LOOP_CACHE    0
+#define INTERPRETER_LOOP_CHECKED  0
+#define INTERPRETER_LOOP_GUARD    0
+#include "interpreter_loop.c"
+
+#define INTERPRETER_LOOP          interpreter_run_trace
+#define INTERPRETER_LOOP_VARIANT  INTERPRETER_VARIANT_TRACE
+#define INTERPRETER_LOOP_PROFILE  0
+#define INTERPRETER_LOOP_TRACE    1
+#define INTERPRETER_LOOP_CACHE    0
+#define INTERPRETER_LOOP_CHECKED  0
+#define INTERPRETER_LOOP_GUARD    0
+#include "interpreter_loop.c"
+
+#define INTERPRETER_LOOP          interpreter_run_profile
+#define INTERPRETER_LOOP_VARIANT  INTERPRETER_VARIANT_PROFILE
+#define INTERPRETER_LOOP_PROFILE  1
+#define INTERPRETER_LOOP_TRACE    0
+#define INTERPRETER_LOOP_CACHE    0
+#define INTERPRETER_LOOP_CHECKED  0
+#define INTERPRETER_LOOP_GUARD    0
+#include "interpreter_loop.c"
+
+#define INTERPRETER_LOOP          interpreter_run_cache
+#define INTERPRETER_LOOP_VARIANT  INTERPRETER_VARIANT_CACHE
+#define INTERPRETER_LOOP_PROFILE  0
+#define INTERPRETER_LOOP_TRACE    0
+#define INTERPRETER_LOOP_CACHE    1
+#define INTERPRETER_LOOP_CHECKED  0
+#define INTERPRETER_LOOP_GUARD    0
+#include "interpreter_loop.c"
+
+#define INTERPRETER_LOOP          interpreter_run_checked
+#define INTERPRETER_LOOP_VARIANT  INTERPRETER_VARIANT_CHECKED
+#define INTERPRETER_LOOP_PROFILE  0
+#define INTERPRETER_LOOP_TRACE    0
+#define INTERPRETER_LOOP_CACHE    0
+#define INTERPRETER_LOOP_CHECKED  1
+#define INTERPRETER_LOOP_GUARD    0
+#include "interpreter_loop.c"
+
+/* The checked one never faults on the guard page, it has no copy here. */
+#define INTERPRETER_LOOP          interpreter_run_fast_guarded
+#define INTERPRETER_LOOP_VARIANT  INTERPRETER_VARIANT_FAST
+#define INTERPRETER_LOOP_PROFILE  0
+#define INTERPRETER_LOOP_TRACE    0
+#define INTERPRETER_LOOP_CACHE    0
+#define INTERPRETER_LOOP_CHECKED  0
+#define INTERPRETER_LOOP_GUARD    1
+#include "interpreter_loop.c"
+
+#define INTERPRETER_LOOP          interpreter_run_trace_guarded
+#define INTERPRETER_LOOP_VARIANT  INTERPRETER_VARIANT_TRACE
+#define INTERPRETER_LOOP_PROFILE  0
+#define INTERPRETER_LOOP_TRACE    1
+#define INTERPRETER_LOOP_CACHE    0
+#define INTERPRETER_LOOP_CHECKED  0
+#define INTERPRETER_LOOP_GUARD    1
+#include "interpreter_loop.c"
+
+#define INTERPRETER_LOOP          interpreter_run_profile_guarded
+#define INTERPRETER_LOOP_VARIANT  INTERPRETER_VARIANT_PROFILE
+#define INTERPRETER_LOOP_PROFILE  1
+#define INTERPRETER_LOOP_TRACE    0
+#define INTERPRETER_LOOP_CACHE    0
+#define INTERPRETER_LOOP_CHECKED  0
+#define INTERPRETER_LOOP_GUARD    1
+#include "interpreter_loop.c"
+
+#define INTERPRETER_LOOP          interpreter_run_cache_guarded
+#define INTERPRETER_LOOP_VARIANT  INTERPRETER_VARIANT_CACHE
+#define INTERPRETER_LOOP_PROFILE  0
+#define INTERPRETER_LOOP_TRACE    0
+#define INTERPRETER_LOOP_CACHE    1
+#define INTERPRETER_LOOP_CHECKED  0
+#define INTERPRETER_LOOP_GUARD    1
+#include "interpreter_loop.c"
+
+static int32_t (*interpreter_loops[INTERPRETER_VARIANT_COUNT])(interpreter *interp, uint64_t max_steps) =
+{
+    [INTERPRETER_VARIANT_FAST]    = interpreter_run_fast,
+    [INTERPRETER_VARIANT_TRACE]   = interpreter_run_trace,
+    [INTERPRETER_VARIANT_PROFILE] = interpreter_run_profile,
+    [INTERPRETER_VARIANT_CACHE]   = interpreter_run_cache,
+    [INTERPRETER_VARIANT_CHECKED] = interpreter_run_checked,
+};
+
+static int32_t (*interpreter_guarded_loops[INTERPRETER_VARIANT_COUNT])(interpreter *interp, uint64_t max_steps) =
+{
+    [INTERPRETER_VARIANT_FAST]    = interpreter_run_fast_guarded,
+    [INTERPRETER_VARIANT_TRACE]   = interpreter_run_trace_guarded,
+    [INTERPRETER_VARIANT_PROFILE] = interpreter_run_profile_guarded,
+    [INTERPRETER_VARIANT_CACHE]   = interpreter_run_cache_guarded,
+    [INTERPRETER_VARIANT_CHECKED] = interpreter_run_checked,
+};
+
+int32_t interpreter_select_variant(interpreter *interp, uint32_t variant)
+{
+    if (variant >= INTERPRETER_VARIANT_COUNT)
+    {
+        return interpreter_error("Error: unknown interpreter variant\n");
+    }
+    if ((variant == INTERPRETER_VARIANT_TRACE) && (interp->trace == 0))
+    {
+        return interpreter_error("Error: the trace variant needs a trace to record into\n");
+    }
+    if ((variant == INTERPRETER_VARIANT_CACHE) && (interp->cache == 0))
+    {
+        return interpreter_error("Error: the cache variant needs a cache model to feed\n");
+    }
+    interp->variant = variant;
+    return 0;
+}
+
+
+/*
+    With INTERPRETER_SANDBOX_GUARD, the SIGSEGV handler takes over faults inside the
+    reservation of the interpreter that is running on this thread. When the host
+    instruction is an access of a guarded run loop, the handler returns to the
+    fixup of it, and the loop stops before the access like the checked variant.
+    Otherwise the access is in interpreter_execute, the handler takes the way back
+    that interpreter_guard left, with the state of interpreter_guard_current.
+    Other faults get the default action, once the instruction runs again.
+*/
+static __thread interpreter *interpreter_guarded;
+static __thread sigjmp_buf *interpreter_guard_jump;
+
+/* REG_RIP of x86-64 Linux, <sys/ucontext.h> has it only with _GNU_SOURCE */
+#define INTERPRETER_HOST_RIP 16
+
+static uint8_t *interpreter_guard_find_fixup(uint8_t *host_address)
+{
+    interpreter_guard_fixup const *fixup = __start_interpreter_guard_fixups;
+    for (; fixup < __stop_interpreter_guard_fixups; fixup++)
+    {
+        if ((uint8_t const *) &fixup->access + fixup->access == host_address)
+            return (uint8_t *) &fixup->fixup + fixup->fixup;
+    }
+    return 0;
+}
+
+static void interpreter_fault_handler(int signal_number, siginfo_t *info, void *context)
+{
+    interpreter *interp = interpreter_guarded;
+    uint8_t *address = info->si_addr;
+    ucontext_t *host = context;
+
+    if (interp && (address >= interp->reservation) && (address < interp->reservation + interp->reservation_size))
+    {
+        uint8_t *fixup = interpreter_guard_find_fixup((uint8_t *) host->uc_mcontext.gregs[INTERPRETER_HOST_RIP]);
+        interpreter_guard_frame *frame = interpreter_guard_current;
+        sigset_t signals;
+
+        interp->fault_address = address - interp->memory;
+        if (fixup)
+        {
+            host->uc_mcontext.gregs[INTERPRETER_HOST_RIP] = (greg_t) fixup;
+            return;
+        }
+        interp->registers[BYTECODE_RIP] = frame->address;
+        interp->step_count += frame->steps;
+        interpreter_guarded = 0;
+        /* The jump does not restore the mask, the handler is left with the signal blocked. */
+        sigemptyset(&signals);
+        sigaddset(&signals, signal_number);
+        sigprocmask(SIG_UNBLOCK, &signals, 0);
+        siglongjmp(*interpreter_guard_jump, 1);
+    }
+    signal(signal_number, SIG_DFL);
+}
+
+static int32_t interpreter_guard(interpreter *interp, uint64_t max_steps, int32_t step)
+{
+    static int32_t installed;
+    interpreter_guard_frame frame;
+    sigjmp_buf jump;
+    int32_t ec;
+
+    /* Pool workers may get here together, installing the same handler twice is harmless. */
+    if (!__atomic_load_n(&installed, __ATOMIC_ACQUIRE))
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = interpreter_fault_handler;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGSEGV, &action, 0) != 0)
+        {
+            return interpreter_error("Error: could not install the guard page handler\n");
+        }
+        __atomic_store_n(&installed, 1, __ATOMIC_RELEASE);
+    }
+
+    if (sigsetjmp(jump, 0))
+    {
+        printf("Error: guest memory access at %lld is outside of the interpreter memory\n", (long long) interp->fault_address);
+        return INTERPRETER_FAULT;
+    }
+    /* A step keeps the address it started at, the guarded run loop sets the frame before interpreter_execute. */
+    memset(&frame, 0, sizeof(frame));
+    frame.address = interp->registers[BYTECODE_RIP];
+    interpreter_guard_current = &frame;
+    interpreter_guard_jump = &jump;
+    interpreter_guarded = interp;
+    ec = step ? interpreter_execute(interp) : interpreter_guarded_loops[interp->variant](interp, max_steps);
+    interpreter_guarded = 0;
+    return ec;
+}
+
+int32_t interpreter_step(interpreter *interp)
+{
+    int32_t ec;
+    interp->step_count += 1;
+    if (interp->sandbox == INTERPRETER_SANDBOX_GUARD)
+    {
+        ec = interpreter_guard(interp, 1, 1);
+    }
+    else
+    {
+        ec = interpreter_execute(interp);
+    }
+    if (interp->variant == INTERPRETER_VARIANT_TRACE)
+    {
+        interpreter_trace_publish(interp->trace, interp->registers);
+    }
+    return ec;
+}
+
+int32_t interpreter_run(interpreter *interp, uint64_t max_steps)
+{
+    int32_t ec;
+    if (interp->sandbox == INTERPRETER_SANDBOX_GUARD)
+    {
+        ec = interpreter_guard(interp, max_steps, 0);
+    }
+    else
+    {
+        ec = interpreter_loops[interp->variant](interp, max_steps);
+    }
+    if (interp->variant == INTERPRETER_VARIANT_TRACE)
+    {
+        interpreter_trace_publish(interp->trace, interp->registers);
+    }
+    return ec;
+}
+
 void interpreter_print_state(interpreter *interp)
 {
+    uint64_t flags = interpreter_flags(interp);
     int i, j;
     int printed_flags_a = 0;
     int printed_flags_b = 0;
@@ -414,25 +1905,25 @@ void interpreter_print_state(interpreter *interp)
     printf("Registers:            Address      | Memory                  | Ascii\n");
     for (i = 0; i < 40; i++)
     {
-        if (i < 16)
+        if (i < BYTECODE_REGISTER_COUNT)
         {
             if (i < 10) printf(" ");
             printf("r%d = %10lx      ", i, interp->registers[i]);
         }
         else
         {
-            if (i == 17)
+            if (i == BYTECODE_REGISTER_COUNT + 1)
             {
                 printed_flags_a = 1;
                 printf("Flags: = < >          ");
             }
-            else if (i == 18)
+            else if (i == BYTECODE_REGISTER_COUNT + 2)
             {
                 printed_flags_b = 1;
                 printf("       %d %d %d          ",
-                       (interp->flags & INTERPRETER_FLAG_EQUAL) > 0,
-                       (interp->flags & INTERPRETER_FLAG_LESS) > 0,
-                       (interp->flags & INTERPRETER_FLAG_MORE) > 0);
+                       (flags & INTERPRETER_FLAG_EQUAL) > 0,
+                       (flags & INTERPRETER_FLAG_LESS) > 0,
+                       (flags & INTERPRETER_FLAG_MORE) > 0);
             }
             else
             {
@@ -459,8 +1950,71 @@ void interpreter_print_state(interpreter *interp)
     if (!printed_flags_b)
     {
         printf("       %d %d %d\n",
-               (interp->flags & INTERPRETER_FLAG_EQUAL) > 0,
-               (interp->flags & INTERPRETER_FLAG_LESS) > 0,
-               (interp->flags & INTERPRETER_FLAG_MORE) > 0);
+               (flags & INTERPRETER_FLAG_EQUAL) > 0,
+               (flags & INTERPRETER_FLAG_LESS) > 0,
+               (flags & INTERPRETER_FLAG_MORE) > 0);
+    }
+}
+
+void interpreter_print_profile(interpreter *interp)
+{
+    uint32_t order[INTERPRETER_OP_COUNT];
+    uint64_t total = 0;
+    uint32_t i, j;
+
+    if (interp->variant != INTERPRETER_VARIANT_PROFILE)
+    {
+        return;
+    }
+
+    for (i = 0; i < INTERPRETER_OP_COUNT; i++)
+    {
+        order[i] = i;
+        total += interp->profile_counts[i];
+    }
+    /* Most dispatched first */
+    for (i = 1; i < INTERPRETER_OP_COUNT; i++)
+    {
+        uint32_t op = order[i];
+        for (j = i; (j > 0) && (interp->profile_counts[order[j - 1]] < interp->profile_counts[op]); j--)
+            order[j] = order[j - 1];
+        order[j] = op;
+    }
+
+    printf("Profile: %llu dispatches\n", (unsigned long long) total);
+    printf("  %-14s  %10s  %6s\n", "operation", "count", "%");
+    for (i = 0; (i < INTERPRETER_OP_COUNT) && (interp->profile_counts[order[i]] > 0); i++)
+    {
+        printf("  %-14s  %10llu  %5.1f%%\n", interpreter_op_name(order[i]),
+            (unsigned long long) interp->profile_counts[order[i]], 100.0 * interp->profile_counts[order[i]] / total);
+    }
+    {
+        uint64_t class_counts[INTERPRETER_CLASS_COUNT];
+        uint64_t cycles = 0;
+        memset(class_counts, 0, sizeof(class_counts));
+        for (i = 0; i < INTERPRETER_OP_COUNT; i++)
+            class_counts[interpreter_op_class(i)] += interp->profile_counts[i];
+        for (i = 0; i < INTERPRETER_CLASS_COUNT; i++)
+            cycles += interp->profile_cycles[i];
+        printf("  %-10s  %14s  %6s  %9s  (one in %d operations sampled)\n", "class", "cycles", "%", "cycles/op", INTERPRETER_PROFILE_PERIOD);
+        for (i = 0; i < INTERPRETER_CLASS_COUNT; i++)
+        {
+            if (interp->profile_cycles[i] == 0)
+                continue;
+            printf("  %-10s  %14llu  %5.1f%%", interpreter_class_name(i),
+                (unsigned long long) interp->profile_cycles[i], 100.0 * interp->profile_cycles[i] / cycles);
+            if (class_counts[i] > 0)
+                printf("  %9.1f", (double) interp->profile_cycles[i] / class_counts[i]);
+            printf("\n");
+        }
+    }
+}
+
+char const *interpreter_op_name(uint32_t op)
+{
+    if ((op < INTERPRETER_OP_COUNT) && interpreter_op_names[op])
+    {
+        return interpreter_op_names[op];
     }
+    return "?";
 }
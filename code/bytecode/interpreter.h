@@ -4,6 +4,37 @@
 #include <stdint.h>
 #include "bytecode.h"
 
+/*
+    interpreter_run runs one of several copies of the run loop, made out of
+    interpreter_loop.c with different parts compiled in. interpreter_select_variant
+    picks one for the interpreter, once, before it runs:
+
+        FAST     the program and nothing else, without a branch for the others
+        TRACE    records every instruction into interp->trace, see interpreter_trace
+        PROFILE  counts the operations it dispatches, and samples the cycles of
+                 every INTERPRETER_PROFILE_PERIOD-th one with the time stamp counter,
+                 they go to the class of the operation times the period,
+                 interpreter_print_profile prints the tables
+        CACHE    feeds every LDR and STR into interp->cache, see interpreter_cache
+        CHECKED  checks every LDR and STR against memory_size, and stops
+                 with INTERPRETER_FAULT before one that is outside
+
+    interpreter_step does the same for the variant at the cost of a branch,
+    it is the slow path.
+*/
+enum
+{
+    INTERPRETER_VARIANT_FAST = 0,
+    INTERPRETER_VARIANT_TRACE,
+    INTERPRETER_VARIANT_PROFILE,
+    INTERPRETER_VARIANT_CACHE,
+    INTERPRETER_VARIANT_CHECKED,
+
+    INTERPRETER_VARIANT_COUNT,
+};
+
+#define INTERPRETER_PROFILE_PERIOD 61 /* Prime, so it does not keep landing on the same place of a loop */
+
 enum
 {
     INTERPRETER_FLAG_EQUAL = 0x1,
@@ -11,17 +42,354 @@ enum
     INTERPRETER_FLAG_LESS  = 0x4,
 };
 
+enum
+{
+    INTERPRETER_HOT_BLOCK = 2,        /* interpreter_run stopped at the entry of a hot block, see hot_threshold */
+    INTERPRETER_EXITED = 3,           /* The program made the exit syscall, the status is in exit_status */
+    INTERPRETER_FAULT = 4,            /* A load or store hit a guard page, the address is in fault_address */
+    INTERPRETER_BUDGET_EXHAUSTED = 5, /* interpreter_run spent max_steps, calling it again goes on */
+};
+
+/*
+    Loads and stores do not compare addresses with memory_size, the memory
+    is made so that no address they can compute reaches the host instead:
+
+    INTERPRETER_SANDBOX_NONE   whatever the caller put into memory, unchecked.
+    INTERPRETER_SANDBOX_GUARD  memory sits in a PROT_NONE reservation that covers every
+                               address a load or store can make (imm16 down to -32k,
+                               32-bit address registers up to 4G), accesses past
+                               memory_size, rounded up to the page, fault.
+    INTERPRETER_SANDBOX_MASK   memory_size is a power of two and addresses wrap around it.
+
+    interpreter_create_memory makes the memory for interp->sandbox.
+    The JIT and the AOT compiler do not mask addresses, they refuse INTERPRETER_SANDBOX_MASK.
+    With INTERPRETER_SANDBOX_GUARD only interpreter_run and interpreter_step turn the fault
+    into INTERPRETER_FAULT, with the interpreter stopped before the access like the
+    CHECKED variant stops, a fault in the native code still kills the process.
+*/
+enum
+{
+    INTERPRETER_SANDBOX_NONE = 0,
+    INTERPRETER_SANDBOX_GUARD,
+    INTERPRETER_SANDBOX_MASK,
+};
+
+enum
+{
+    INTERPRETER_COMPARE_NONE = 0, /* flags holds the condition bits as they are */
+    INTERPRETER_COMPARE_UNSIGNED,
+};
+
+enum
+{
+    /* Operations above the bytecode opcodes exist only inside interpreter_run. */
+    INTERPRETER_OP_SLOW = 0x40, /* Hand the instruction over to interpreter_step */
+
+    /*
+        Fused pairs execute the instruction in their slot and the one in the next slot.
+        The next slot keeps its own operation, so jumping right into it still works.
+        Compare-and-branch operations follow the order of the BYTECODE_Jcc_I opcodes.
+    */
+    INTERPRETER_OP_CMP_RI_JE,
+    INTERPRETER_OP_CMP_RI_JNE,
+    INTERPRETER_OP_CMP_RI_JL,
+    INTERPRETER_OP_CMP_RI_JLE,
+    INTERPRETER_OP_CMP_RI_JG,
+    INTERPRETER_OP_CMP_RI_JGE,
+    INTERPRETER_OP_CMP_RR_JE,
+    INTERPRETER_OP_CMP_RR_JNE,
+    INTERPRETER_OP_CMP_RR_JL,
+    INTERPRETER_OP_CMP_RR_JLE,
+    INTERPRETER_OP_CMP_RR_JG,
+    INTERPRETER_OP_CMP_RR_JGE,
+    INTERPRETER_OP_MOV_RR_MOV_RR,
+    INTERPRETER_OP_ADD_RRI_CMP_RI,
+
+    INTERPRETER_OP_COUNT,
+};
+
+/* What the profile adds the cycles up by */
+enum
+{
+    INTERPRETER_CLASS_MOVE = 0,
+    INTERPRETER_CLASS_LOAD,
+    INTERPRETER_CLASS_STORE,
+    INTERPRETER_CLASS_ARITHMETIC,
+    INTERPRETER_CLASS_COMPARE,
+    INTERPRETER_CLASS_BRANCH,
+    INTERPRETER_CLASS_CALL,
+    INTERPRETER_CLASS_FUSED,
+    INTERPRETER_CLASS_SLOW,
+
+    INTERPRETER_CLASS_COUNT,
+};
+
+enum
+{
+    INTERPRETER_RETURN_STACK_SIZE = 64,  /* Entries of the shadow return stack, a power of two */
+    INTERPRETER_OUTPUT_SIZE = 0x10000,   /* Guest output collected before one host write */
+};
+
+typedef struct
+{
+    void const *handler; /* Label in interpreter_run the instruction is threaded to */
+    bytecode bc;
+    uint32_t target;     /* Slot index of the jump destination */
+    uint32_t hits;       /* Taken jumps that landed on this slot, counted only with hot_threshold set */
+    uint32_t cost;       /* Instructions from this slot to the end of its basic block */
+    uint8_t op;          /* Operation interpreter_run executes for this slot */
+} interpreter_instruction;
+
+typedef struct
+{
+    uint64_t value;     /* Of r0 after the instruction: the result, or what a store stored */
+    uint32_t address;
+    uint8_t op;         /* Bytecode opcode, or the fused operation the run loop did */
+    uint8_t r0;
+    uint16_t reserved;
+} interpreter_trace_entry;
+
+/*
+    Ring of the last capacity instructions, for one interpreter at a time.
+    The interpreter writes the entry at head, and publishes it with a release store
+    of head + 1 once the next instruction starts, or when interpreter_run returns.
+    Readers load head with acquire, copy, and load head again: whatever is older
+    than the second head - capacity could have been overwritten while copying.
+    interpreter_trace_write does that, so it can run next to the interpreter.
+*/
+typedef struct
+{
+    interpreter_trace_entry *entries;
+    uint64_t capacity;  /* A power of two */
+    uint64_t head;      /* Entries published since interpreter_trace_create */
+    int32_t pending;    /* The entry at head waits for its value */
+    uint8_t pending_register;
+} interpreter_trace;
+
+/* Starts a trace file, the entries follow oldest first */
+typedef struct
+{
+    char magic[4];      /* INTERPRETER_TRACE_MAGIC */
+    uint32_t entry_size;
+    uint64_t first;     /* Number of the first entry since the trace started */
+    uint64_t count;
+} interpreter_trace_header;
+
+#define INTERPRETER_TRACE_MAGIC "PTRC"
+
+/* One level of the cache model, set_count sets of ways lines each */
+typedef struct
+{
+    uint64_t *lines;    /* Line numbers of a set, the most recently used first, UINT64_MAX when empty */
+    uint64_t set_count; /* A power of two */
+    uint32_t ways;
+} interpreter_cache_level;
+
+/* What the loads and stores of some code did to the cache model, a line at a time */
+typedef struct
+{
+    uint64_t accesses;
+    uint64_t l1_misses;
+    uint64_t l2_misses; /* Of the L1 misses */
+} interpreter_cache_stats;
+
+/*
+    Two levels of set-associative cache with LRU replacement, for the guest
+    to see how its data layout does on a cache like that. Both levels allocate
+    on loads and on stores alike, and keep what they hold apart: what L1
+    evicts stays in L2 as long as L2 has room for it. An access that crosses
+    a line counts once per line. The stats are kept per slot of the code,
+    stats[slot_count] for the instructions that are past it, and
+    interpreter_cache_sum adds them up for a range of the code.
+*/
+typedef struct
+{
+    interpreter_cache_level l1;
+    interpreter_cache_level l2;
+    uint32_t line_shift;
+    interpreter_cache_stats *stats;
+    uint64_t slot_count;
+} interpreter_cache;
+
 typedef struct
 {
     uint8_t *memory;
     uint64_t memory_size;
-    uint64_t registers[16];
+
+    /*
+        Loads and stores use address & address_mask, which interpreter_predecode
+        sets to memory_size - 1 with INTERPRETER_SANDBOX_MASK and to all ones otherwise.
+        reservation is the mapping interpreter_create_memory made the memory in,
+        with huge_pages set it asks for transparent 2M pages there.
+        After INTERPRETER_FAULT, fault_address is the guest address of the access,
+        and the registers are the ones interpreter_run stored last, at worst the ones
+        it had on entry.
+    */
+    uint32_t sandbox;
+    int32_t huge_pages;
+    uint64_t address_mask;
+    uint8_t *reservation;
+    uint64_t reservation_size;
+    int64_t fault_address;
+
+    uint64_t registers[BYTECODE_REGISTER_COUNT];
+
+    /*
+        Compares only record their operands, and the condition bits are derived
+        from them when something reads them, see interpreter_flags.
+        Set compare_kind to INTERPRETER_COMPARE_NONE to use flags as they are.
+    */
     uint64_t flags;
+    uint64_t compare_lhs;
+    uint64_t compare_rhs;
+    uint32_t compare_kind;
+
+    /*
+        Pre-decoded code region [0, decoded_size), one decoded instruction
+        per 4-byte slot, so the instruction at address A lives at decoded[A / 4].
+        A WIDE prefix gets a slot that does nothing, and the slot after it
+        holds the instruction with the prefix applied.
+        Stores into this region re-decode the touched slots.
+        The slot past the end is a sentinel that leaves the run loop.
+    */
+    interpreter_instruction *decoded;
+    uint64_t decoded_size;
+    int32_t threaded;      /* The copy of the run loop + 1 the handlers of the slots belong to, 0 before any */
+    uint32_t code_version; /* Bumped by interpreter_invalidate, so other caches of the code know they are stale */
+
+    uint32_t variant;      /* INTERPRETER_VARIANT_*, forks start with the fast one */
+
+    /* Steps interpreter_run and interpreter_step charged so far, whole basic blocks at a time */
+    uint64_t step_count;
+
+    /*
+        When not 0, interpreter_run counts taken jumps per destination slot,
+        and returns INTERPRETER_HOT_BLOCK with IP at the destination
+        once the count reaches hot_threshold, and on every entry after that.
+    */
+    uint32_t hot_threshold;
+
+    /*
+        CALL pushes the return address on the guest stack at r13 and here,
+        RET pops both. Like the return stack of a CPU it is a ring that forgets
+        the oldest entries, so deep recursion only costs predictions. RET goes
+        straight to the slot when the address it pops from the guest stack is
+        the one on top of the ring, anything else is a mispredict: the guest
+        changed its return address, or unwound the stack without RET.
+    */
+    uint64_t return_stack[INTERPRETER_RETURN_STACK_SIZE];
+    uint32_t return_top;
+    uint32_t return_depth;  /* Entries under return_top that are still calls in progress */
+    uint64_t return_mispredicts;
+
+    /* For the trace and the cache variants, forks start without them */
+    interpreter_trace *trace;
+    interpreter_cache *cache;
+
+    /*
+        Guest writes to stdout and stderr collect in output, and go to the host
+        in one write(2) when it fills up, when the guest writes to the other fd
+        or reads, and at exit. interpreter_flush does it when the program stops
+        some other way.
+    */
+    uint8_t output[INTERPRETER_OUTPUT_SIZE];
+    uint64_t output_size;
+    int32_t output_fd;
+    uint64_t write_syscalls;
+    uint64_t host_writes;
+    uint64_t exit_status;
+
+    /*
+        Of the profile variant: dispatches of every operation, INTERPRETER_OP_SLOW
+        counts the instructions interpreter_step did for the loop. Fused pairs
+        count once, as the pair.
+    */
+    uint64_t profile_counts[INTERPRETER_OP_COUNT];
+    uint64_t profile_cycles[INTERPRETER_CLASS_COUNT];
+    /* The operation being dispatched, for a signal handler to see what it interrupted */
+    volatile uint8_t profile_op;
 } interpreter;
 
+/*
+    What interpreter_fork needs to start an instance where interpreter_take_snapshot
+    stopped one: registers, flags, the return stack, the decoded code, and the memory.
+    The memory is a copy in a memfd, every fork maps it MAP_PRIVATE over its own memory,
+    so the forks share its pages and copy one only when they write it.
+    The memory past file_size was zero, the forks get zero pages of their own there.
+    The snapshot does not change when the instance goes on, and can be forked many times.
+*/
+typedef struct
+{
+    int32_t fd;
+    int32_t taken;      /* fd is a memfd of this snapshot, a zeroed snapshot owns nothing */
+    uint64_t file_size;
+    uint64_t memory_size;
+    uint32_t sandbox;
+    int32_t huge_pages;
+
+    uint64_t registers[BYTECODE_REGISTER_COUNT];
+    uint64_t flags;
+    uint64_t compare_lhs;
+    uint64_t compare_rhs;
+    uint32_t compare_kind;
 
+    interpreter_instruction *decoded;
+    uint64_t decoded_size;
+    int32_t threaded;
+    uint32_t code_version;
+
+    uint64_t return_stack[INTERPRETER_RETURN_STACK_SIZE];
+    uint32_t return_top;
+    uint32_t return_depth;
+} interpreter_snapshot;
+
+
+/*
+    Memory of memory_size zero bytes for interp->sandbox and interp->huge_pages,
+    released by interpreter_release_memory. Pages are committed as the program touches them.
+*/
+int32_t interpreter_create_memory(interpreter *interp, uint64_t memory_size);
+void interpreter_release_memory(interpreter *interp);
+uint64_t interpreter_committed_size(interpreter *interp);
+/*
+    interpreter_take_snapshot flushes the output of interp and captures it in snapshot,
+    interpreter_fork makes interp a new instance with the memory of the snapshot,
+    the sandbox and huge_pages of the instance it was taken from, and no hot_threshold.
+    The part of the memory mapped from the snapshot has small pages anyway.
+    A fork is released like any other instance.
+*/
+int32_t interpreter_take_snapshot(interpreter *interp, interpreter_snapshot *snapshot);
+int32_t interpreter_fork(interpreter *interp, interpreter_snapshot *snapshot);
+void interpreter_release_snapshot(interpreter_snapshot *snapshot);
+int32_t interpreter_predecode(interpreter *interp, uint64_t code_size);
+void interpreter_invalidate(interpreter *interp, uint64_t address, uint64_t size);
+/* Checks that the trace or the cache the variant needs is there */
+int32_t interpreter_select_variant(interpreter *interp, uint32_t variant);
 int32_t interpreter_step(interpreter *interp);
+int32_t interpreter_run(interpreter *interp, uint64_t max_steps);
+uint64_t interpreter_flags(interpreter *interp);
+void interpreter_flush(interpreter *interp);
 void interpreter_print_state(interpreter *interp);
+/* Does nothing but for the profile variant */
+void interpreter_print_profile(interpreter *interp);
+/* BYTECODE_* opcode or INTERPRETER_OP_* operation as text */
+char const *interpreter_op_name(uint32_t op);
+/* INTERPRETER_CLASS_* of an operation, and the class as text */
+uint32_t interpreter_op_class(uint32_t op);
+char const *interpreter_class_name(uint32_t op_class);
+
+/* capacity is the number of entries, a power of two */
+int32_t interpreter_trace_create(interpreter_trace *trace, uint64_t capacity);
+void interpreter_trace_release(interpreter_trace *trace);
+/* Writes the published entries still in the ring as a trace file, returns how many in count */
+int32_t interpreter_trace_write(interpreter_trace *trace, char const *filename, uint64_t *count);
+
+/* Sizes in bytes, powers of two but for the ways; stats for the code of code_size */
+int32_t interpreter_cache_create(interpreter_cache *cache, uint64_t code_size, uint64_t line_size,
+                                 uint64_t l1_size, uint32_t l1_ways, uint64_t l2_size, uint32_t l2_ways);
+void interpreter_cache_release(interpreter_cache *cache);
+/* Stats of the instructions at [begin, end), the end past the code takes in stats[slot_count] */
+void interpreter_cache_sum(interpreter_cache *cache, uint64_t begin, uint64_t end, interpreter_cache_stats *sum);
 
 
 #endif /* PINAPL_INTERPRETER_H_ */
@@ -0,0 +1,855 @@
+/*
+    The run loop, included by interpreter.c once per INTERPRETER_VARIANT_*,
+    with the parts of the variant turned on:
+
+        INTERPRETER_LOOP          name of the function
+        INTERPRETER_LOOP_VARIANT  INTERPRETER_VARIANT_* it is
+        INTERPRETER_LOOP_PROFILE  counts operations and samples their cycles
+        INTERPRETER_LOOP_TRACE    records instructions into interp->trace
+        INTERPRETER_LOOP_CACHE    feeds loads and stores into interp->cache
+        INTERPRETER_LOOP_CHECKED  checks loads and stores against the memory size
+        INTERPRETER_LOOP_GUARD    lets the guard page handler stop it before a faulting access
+
+    A part that is off leaves nothing behind in the loop.
+*/
+
+#if INTERPRETER_LOOP_PROFILE
+/*
+    A sample starts at a dispatch, and ends at the next one with the cycles
+    of the operation in between, which stand for INTERPRETER_PROFILE_PERIOD of its class.
+    profile_class is INTERPRETER_CLASS_COUNT between samples.
+*/
+#define INTERPRETER_PROFILE_OP(OP) \
+    do { \
+        interp->profile_counts[OP] += 1; \
+        interp->profile_op = (OP); \
+        if (--profile_countdown == 0) \
+        { \
+            uint64_t now = __rdtsc(); \
+            if (profile_class < INTERPRETER_CLASS_COUNT) \
+            { \
+                interp->profile_cycles[profile_class] += (now - profile_time) * INTERPRETER_PROFILE_PERIOD; \
+                profile_class = INTERPRETER_CLASS_COUNT; \
+                profile_countdown = INTERPRETER_PROFILE_PERIOD - 1; \
+            } \
+            else \
+            { \
+                profile_time = now; \
+                profile_class = op_classes[OP]; \
+                profile_countdown = 1; \
+            } \
+        } \
+    } while (0)
+#else
+#define INTERPRETER_PROFILE_OP(OP)
+#endif
+
+/* interpreter_execute records the instructions the loop hands over to it. */
+#if INTERPRETER_LOOP_TRACE
+#define INTERPRETER_TRACE_OP(OP) \
+    do { \
+        if ((OP) != INTERPRETER_OP_SLOW) \
+            interpreter_trace_push(trace, (ip - code) * 4, (OP), ip->bc.r0, r); \
+    } while (0)
+#else
+#define INTERPRETER_TRACE_OP(OP)
+#endif
+
+/* Loads and stores are checked, then go through the cache model, before they touch the memory. */
+#if INTERPRETER_LOOP_CHECKED
+#define INTERPRETER_CHECK(ADDRESS, SIZE) \
+    do { \
+        if ((ADDRESS) > memory_limit - (SIZE)) \
+        { \
+            fault_address = (ADDRESS); \
+            goto fault; \
+        } \
+    } while (0)
+#else
+#define INTERPRETER_CHECK(ADDRESS, SIZE)
+#endif
+
+/*
+    With the guard page, every load and store is a single move with an entry in
+    the interpreter_guard_fixups section: the address of the move, and of
+    guard_fault in this loop. When the move faults, interpreter_fault_handler
+    sends the host on to guard_fault instead, and the loop stops there the way
+    the checked variant stops, with its state in its locals as they were before
+    the access. So the accesses cost what they cost unguarded.
+    interpreter_execute is plain C, before it the loop leaves the address and
+    the steps it has taken in the frame of interpreter_guard.
+*/
+#if INTERPRETER_LOOP_GUARD
+#define INTERPRETER_GUARD_FIXUP \
+    ".pushsection interpreter_guard_fixups, \"a\"\n\t" \
+    ".balign 4\n\t" \
+    ".long 1b - ., %l[guard_fault] - .\n\t" \
+    ".popsection"
+#define INTERPRETER_GUARD_LOAD_uint8_t   "movzbl %[memory], %k[value]"
+#define INTERPRETER_GUARD_LOAD_uint16_t  "movzwl %[memory], %k[value]"
+#define INTERPRETER_GUARD_LOAD_uint32_t  "movl %[memory], %k[value]"
+#define INTERPRETER_GUARD_LOAD_uint64_t  "movq %[memory], %q[value]"
+#define INTERPRETER_GUARD_STORE_uint8_t  "movb %b[value], %[memory]"
+#define INTERPRETER_GUARD_STORE_uint16_t "movw %w[value], %[memory]"
+#define INTERPRETER_GUARD_STORE_uint32_t "movl %k[value], %[memory]"
+#define INTERPRETER_GUARD_STORE_uint64_t "movq %q[value], %[memory]"
+#define INTERPRETER_LOAD(TYPE, ADDRESS) \
+    do { \
+        uint64_t loaded; \
+        __asm__ goto ("1: " INTERPRETER_GUARD_LOAD_##TYPE "\n\t" INTERPRETER_GUARD_FIXUP \
+            : [value] "=r" (loaded) \
+            : [memory] "m" (*(TYPE const *) (interp->memory + (ADDRESS))) \
+            : : guard_fault); \
+        r[ip->bc.r0] = loaded; \
+    } while (0)
+#define INTERPRETER_MOVE_STORE(TYPE, ADDRESS) \
+    __asm__ goto ("1: " INTERPRETER_GUARD_STORE_##TYPE "\n\t" INTERPRETER_GUARD_FIXUP \
+        : [memory] "=m" (*(TYPE *) (interp->memory + (ADDRESS))) \
+        : [value] "r" (r[ip->bc.r0]) \
+        : : guard_fault)
+#define INTERPRETER_GUARD_EXECUTE(ADDRESS) \
+    do { \
+        guard->address = (ADDRESS); \
+        guard->steps = max_steps - steps; \
+    } while (0)
+#else
+#define INTERPRETER_LOAD(TYPE, ADDRESS) r[ip->bc.r0] = *(TYPE *) (interp->memory + (ADDRESS))
+#define INTERPRETER_MOVE_STORE(TYPE, ADDRESS) *(TYPE *) (interp->memory + (ADDRESS)) = (TYPE) r[ip->bc.r0]
+#define INTERPRETER_GUARD_EXECUTE(ADDRESS)
+#endif
+
+#if INTERPRETER_LOOP_CACHE
+#define INTERPRETER_CACHE_ACCESS(ADDRESS, SIZE) interpreter_cache_access(cache, (ip - code) * 4, (ADDRESS), (SIZE))
+#else
+#define INTERPRETER_CACHE_ACCESS(ADDRESS, SIZE)
+#endif
+
+#define INTERPRETER_ACCESS(ADDRESS, SIZE) \
+    do { \
+        INTERPRETER_CHECK(ADDRESS, SIZE); \
+        INTERPRETER_CACHE_ACCESS(ADDRESS, SIZE); \
+    } while (0)
+
+#if INTERPRETER_THREADED
+#define INTERPRETER_CASE(OP) handler_##OP:
+#define INTERPRETER_DISPATCH() \
+    do { \
+        INTERPRETER_PROFILE_OP(ip->op); \
+        INTERPRETER_TRACE_OP(ip->op); \
+        goto *ip->handler; \
+    } while (0)
+#else
+#define INTERPRETER_CASE(OP) case OP:
+#define INTERPRETER_DISPATCH() goto dispatch
+#endif
+
+/* The copy of the loop the handlers of the slots belong to, see interp->threaded */
+#define INTERPRETER_LOOP_THREADED (INTERPRETER_LOOP_GUARD * INTERPRETER_VARIANT_COUNT + INTERPRETER_LOOP_VARIANT + 1)
+
+#define INTERPRETER_NEXT() do { ip += 1; INTERPRETER_DISPATCH(); } while (0)
+
+/*
+    The budget is charged a basic block at a time, as the loop enters one:
+    on the way in, at jump destinations, and after a branch that was not taken.
+    The instructions inside the block do not look at it.
+*/
+#define INTERPRETER_ENTER() \
+    do { \
+        if (steps == 0) \
+            goto exhausted; \
+        steps = (steps > ip->cost) ? steps - ip->cost : 0; \
+        INTERPRETER_DISPATCH(); \
+    } while (0)
+
+/* Hands the instruction in the slot over to interpreter_step after all, the step is already charged. */
+#if INTERPRETER_THREADED
+#define INTERPRETER_SLOW() do { INTERPRETER_PROFILE_OP(INTERPRETER_OP_SLOW); goto handler_INTERPRETER_OP_SLOW; } while (0)
+#else
+#define INTERPRETER_SLOW() do { op = INTERPRETER_OP_SLOW; goto dispatch_op; } while (0)
+#endif
+
+#define INTERPRETER_COMPARE(LHS, RHS) \
+    do { \
+        lhs = (LHS); \
+        rhs = (RHS); \
+        kind = INTERPRETER_COMPARE_UNSIGNED; \
+    } while (0)
+
+/* Flags left over from before the first compare are only looked at when there was no compare. */
+#define INTERPRETER_CONDITION(CONDITION, FLAGS_CONDITION) \
+    ((kind == INTERPRETER_COMPARE_UNSIGNED) ? (lhs CONDITION rhs) : (FLAGS_CONDITION))
+
+/* Taken jumps count the hits of their destination, see hot_threshold. */
+#define INTERPRETER_JUMP(TARGET) \
+    do { \
+        ip = code + (TARGET); \
+        if (hot_threshold && (++ip->hits >= hot_threshold)) \
+            goto hot; \
+        INTERPRETER_ENTER(); \
+    } while (0)
+
+#define INTERPRETER_BRANCH(TAKEN) \
+    do { \
+        if (TAKEN) \
+            INTERPRETER_JUMP(ip->target); \
+        ip += 1; \
+        INTERPRETER_ENTER(); \
+    } while (0)
+
+#define INTERPRETER_COMPARE_AND_BRANCH(LHS, RHS, CONDITION) \
+    do { \
+        uint64_t compare_lhs = (LHS); \
+        uint64_t compare_rhs = (RHS); \
+        INTERPRETER_COMPARE(compare_lhs, compare_rhs); \
+        if (lhs CONDITION rhs) \
+            INTERPRETER_JUMP(ip[1].target); \
+        ip += 2; \
+        INTERPRETER_ENTER(); \
+    } while (0)
+
+#define INTERPRETER_SAVE(ADDRESS) \
+    do { \
+        r[BYTECODE_RIP] = (ADDRESS); \
+        memcpy(interp->registers, r, sizeof(r)); \
+        interp->flags = flags; \
+        interp->compare_lhs = lhs; \
+        interp->compare_rhs = rhs; \
+        interp->compare_kind = kind; \
+    } while (0)
+
+#define INTERPRETER_STORE(TYPE, ADDRESS) \
+    do { \
+        uint64_t masked = (ADDRESS) & mask; \
+        INTERPRETER_ACCESS(masked, sizeof(TYPE)); \
+        INTERPRETER_MOVE_STORE(TYPE, masked); \
+        if (masked < interp->decoded_size) \
+        { \
+            INTERPRETER_SAVE((ip - code + 1) * 4); \
+            interpreter_invalidate(interp, masked, sizeof(TYPE)); \
+            goto resume; \
+        } \
+    } while (0)
+
+/*
+    Runs the program out of the pre-decoded region until max_steps are spent,
+    keeping the registers, flags and the instruction pointer in locals.
+    Whatever the loop does not handle itself (IP outside of the region,
+    instructions that use r15 as an operand, unknown opcodes) goes through
+    interpreter_step, so the result is the same as stepping one by one.
+
+    Steps are charged per basic block on entering it (see INTERPRETER_ENTER),
+    so the run stops at a block entry, at most one block past max_steps.
+    Instructions handed over to interpreter_step are charged again from
+    where the loop resumes, so they can make it stop a little early.
+
+    Returns INTERPRETER_BUDGET_EXHAUSTED when max_steps are spent, with
+    the interpreter ready to go on, INTERPRETER_HOT_BLOCK when a jump landed
+    on a hot slot, and the interpreter_step result otherwise.
+*/
+static int32_t INTERPRETER_LOOP(interpreter *interp, uint64_t max_steps)
+{
+#if INTERPRETER_THREADED
+    static void const *dispatch_table[INTERPRETER_OP_COUNT] =
+    {
+        [BYTECODE_MOV_RI]   = &&handler_BYTECODE_MOV_RI,
+        [BYTECODE_MOV_RR]   = &&handler_BYTECODE_MOV_RR,
+        [BYTECODE_LDR8_RI]  = &&handler_BYTECODE_LDR8_RI,
+        [BYTECODE_LDR16_RI] = &&handler_BYTECODE_LDR16_RI,
+        [BYTECODE_LDR32_RI] = &&handler_BYTECODE_LDR32_RI,
+        [BYTECODE_LDR64_RI] = &&handler_BYTECODE_LDR64_RI,
+        [BYTECODE_LDR8_RA]  = &&handler_BYTECODE_LDR8_RA,
+        [BYTECODE_LDR16_RA] = &&handler_BYTECODE_LDR16_RA,
+        [BYTECODE_LDR32_RA] = &&handler_BYTECODE_LDR32_RA,
+        [BYTECODE_LDR64_RA] = &&handler_BYTECODE_LDR64_RA,
+        [BYTECODE_STR8_RI]  = &&handler_BYTECODE_STR8_RI,
+        [BYTECODE_STR16_RI] = &&handler_BYTECODE_STR16_RI,
+        [BYTECODE_STR32_RI] = &&handler_BYTECODE_STR32_RI,
+        [BYTECODE_STR64_RI] = &&handler_BYTECODE_STR64_RI,
+        [BYTECODE_STR8_RA]  = &&handler_BYTECODE_STR8_RA,
+        [BYTECODE_STR16_RA] = &&handler_BYTECODE_STR16_RA,
+        [BYTECODE_STR32_RA] = &&handler_BYTECODE_STR32_RA,
+        [BYTECODE_STR64_RA] = &&handler_BYTECODE_STR64_RA,
+        [BYTECODE_ADD_RRI]  = &&handler_BYTECODE_ADD_RRI,
+        [BYTECODE_ADD_RRR]  = &&handler_BYTECODE_ADD_RRR,
+        [BYTECODE_SUB_RRI]  = &&handler_BYTECODE_SUB_RRI,
+        [BYTECODE_SUB_RRR]  = &&handler_BYTECODE_SUB_RRR,
+        [BYTECODE_MUL_RRI]  = &&handler_BYTECODE_MUL_RRI,
+        [BYTECODE_MUL_RRR]  = &&handler_BYTECODE_MUL_RRR,
+        [BYTECODE_AND_RRI]  = &&handler_BYTECODE_AND_RRI,
+        [BYTECODE_AND_RRR]  = &&handler_BYTECODE_AND_RRR,
+        [BYTECODE_OR_RRI]   = &&handler_BYTECODE_OR_RRI,
+        [BYTECODE_OR_RRR]   = &&handler_BYTECODE_OR_RRR,
+        [BYTECODE_XOR_RRI]  = &&handler_BYTECODE_XOR_RRI,
+        [BYTECODE_XOR_RRR]  = &&handler_BYTECODE_XOR_RRR,
+        [BYTECODE_NOT_RR]   = &&handler_BYTECODE_NOT_RR,
+        [BYTECODE_SHR_RRI]  = &&handler_BYTECODE_SHR_RRI,
+        [BYTECODE_SHR_RRR]  = &&handler_BYTECODE_SHR_RRR,
+        [BYTECODE_SHL_RRI]  = &&handler_BYTECODE_SHL_RRI,
+        [BYTECODE_SHL_RRR]  = &&handler_BYTECODE_SHL_RRR,
+        [BYTECODE_CMP_RI]   = &&handler_BYTECODE_CMP_RI,
+        [BYTECODE_CMP_RR]   = &&handler_BYTECODE_CMP_RR,
+        [BYTECODE_JMP_I]    = &&handler_BYTECODE_JMP_I,
+        [BYTECODE_JE_I]     = &&handler_BYTECODE_JE_I,
+        [BYTECODE_JNE_I]    = &&handler_BYTECODE_JNE_I,
+        [BYTECODE_JL_I]     = &&handler_BYTECODE_JL_I,
+        [BYTECODE_JLE_I]    = &&handler_BYTECODE_JLE_I,
+        [BYTECODE_JG_I]     = &&handler_BYTECODE_JG_I,
+        [BYTECODE_JGE_I]    = &&handler_BYTECODE_JGE_I,
+        [BYTECODE_SETE_R]   = &&handler_BYTECODE_SETE_R,
+        [BYTECODE_SETNE_R]  = &&handler_BYTECODE_SETNE_R,
+        [BYTECODE_CALL_I]   = &&handler_BYTECODE_CALL_I,
+        [BYTECODE_RET]      = &&handler_BYTECODE_RET,
+        [BYTECODE_WIDE]     = &&handler_BYTECODE_WIDE,
+
+        [INTERPRETER_OP_SLOW] = &&handler_INTERPRETER_OP_SLOW,
+
+        [INTERPRETER_OP_CMP_RI_JE]      = &&handler_INTERPRETER_OP_CMP_RI_JE,
+        [INTERPRETER_OP_CMP_RI_JNE]     = &&handler_INTERPRETER_OP_CMP_RI_JNE,
+        [INTERPRETER_OP_CMP_RI_JL]      = &&handler_INTERPRETER_OP_CMP_RI_JL,
+        [INTERPRETER_OP_CMP_RI_JLE]     = &&handler_INTERPRETER_OP_CMP_RI_JLE,
+        [INTERPRETER_OP_CMP_RI_JG]      = &&handler_INTERPRETER_OP_CMP_RI_JG,
+        [INTERPRETER_OP_CMP_RI_JGE]     = &&handler_INTERPRETER_OP_CMP_RI_JGE,
+        [INTERPRETER_OP_CMP_RR_JE]      = &&handler_INTERPRETER_OP_CMP_RR_JE,
+        [INTERPRETER_OP_CMP_RR_JNE]     = &&handler_INTERPRETER_OP_CMP_RR_JNE,
+        [INTERPRETER_OP_CMP_RR_JL]      = &&handler_INTERPRETER_OP_CMP_RR_JL,
+        [INTERPRETER_OP_CMP_RR_JLE]     = &&handler_INTERPRETER_OP_CMP_RR_JLE,
+        [INTERPRETER_OP_CMP_RR_JG]      = &&handler_INTERPRETER_OP_CMP_RR_JG,
+        [INTERPRETER_OP_CMP_RR_JGE]     = &&handler_INTERPRETER_OP_CMP_RR_JGE,
+        [INTERPRETER_OP_MOV_RR_MOV_RR]  = &&handler_INTERPRETER_OP_MOV_RR_MOV_RR,
+        [INTERPRETER_OP_ADD_RRI_CMP_RI] = &&handler_INTERPRETER_OP_ADD_RRI_CMP_RI,
+    };
+#endif
+    interpreter_instruction *code;
+    interpreter_instruction *ip;
+    uint64_t r[BYTECODE_REGISTER_COUNT];
+    uint64_t flags, lhs, rhs;
+    uint32_t kind;
+    uint64_t steps = max_steps;
+    uint32_t hot_threshold = interp->hot_threshold;
+    uint64_t mask = interp->address_mask;
+    uint64_t address;
+    int32_t ec;
+#if !INTERPRETER_THREADED
+    uint8_t op;
+#endif
+#if INTERPRETER_LOOP_TRACE
+    interpreter_trace *trace = interp->trace;
+#endif
+#if INTERPRETER_LOOP_CACHE
+    interpreter_cache *cache = interp->cache;
+#endif
+#if INTERPRETER_LOOP_CHECKED
+    uint64_t memory_limit = interp->memory_size;
+    uint64_t fault_address;
+#endif
+#if INTERPRETER_LOOP_GUARD
+    interpreter_guard_frame *guard = interpreter_guard_current;
+#endif
+#if INTERPRETER_LOOP_PROFILE
+    uint8_t op_classes[INTERPRETER_OP_COUNT];
+    uint64_t profile_time = 0;
+    uint32_t profile_class = INTERPRETER_CLASS_COUNT;
+    uint32_t profile_countdown = INTERPRETER_PROFILE_PERIOD;
+    uint32_t profile_op;
+    for (profile_op = 0; profile_op < INTERPRETER_OP_COUNT; profile_op++)
+        op_classes[profile_op] = interpreter_op_class(profile_op);
+#endif
+resume:
+    address = interp->registers[BYTECODE_RIP];
+    if ((address >= interp->decoded_size) || (address & 0x3))
+    {
+        /* Outside of the decoded region, one instruction at a time. */
+        if (steps == 0)
+        {
+            interp->step_count += max_steps;
+            return INTERPRETER_BUDGET_EXHAUSTED;
+        }
+        steps -= 1;
+        INTERPRETER_PROFILE_OP(INTERPRETER_OP_SLOW);
+        INTERPRETER_GUARD_EXECUTE(address);
+        ec = interpreter_execute(interp);
+        if (ec != 0)
+        {
+            interp->step_count += max_steps - steps;
+            return ec;
+        }
+        goto resume;
+    }
+
+    code = interp->decoded;
+#if INTERPRETER_THREADED
+    if (interp->threaded != INTERPRETER_LOOP_THREADED)
+    {
+        uint64_t slot = 0;
+        for (; slot <= interp->decoded_size / 4; slot++)
+        {
+            code[slot].handler = dispatch_table[code[slot].op];
+        }
+        interp->threaded = INTERPRETER_LOOP_THREADED;
+    }
+#endif
+    memcpy(r, interp->registers, sizeof(r));
+    flags = interp->flags;
+    lhs = interp->compare_lhs;
+    rhs = interp->compare_rhs;
+    kind = interp->compare_kind;
+    ip = code + address / 4;
+    INTERPRETER_ENTER();
+
+#if !INTERPRETER_THREADED
+dispatch:
+    op = ip->op;
+dispatch_op:
+    INTERPRETER_PROFILE_OP(op);
+    INTERPRETER_TRACE_OP(op);
+    switch (op)
+    {
+#endif
+        INTERPRETER_CASE(BYTECODE_MOV_RI)
+        {
+            r[ip->bc.r0] = ip->bc.imm;
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_MOV_RR)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1];
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_LDR8_RI)
+        {
+            INTERPRETER_ACCESS(ip->bc.imm & mask, sizeof(uint8_t));
+            INTERPRETER_LOAD(uint8_t, ip->bc.imm & mask);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_LDR16_RI)
+        {
+            INTERPRETER_ACCESS(ip->bc.imm & mask, sizeof(uint16_t));
+            INTERPRETER_LOAD(uint16_t, ip->bc.imm & mask);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_LDR32_RI)
+        {
+            INTERPRETER_ACCESS(ip->bc.imm & mask, sizeof(uint32_t));
+            INTERPRETER_LOAD(uint32_t, ip->bc.imm & mask);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_LDR64_RI)
+        {
+            INTERPRETER_ACCESS(ip->bc.imm & mask, sizeof(uint64_t));
+            INTERPRETER_LOAD(uint64_t, ip->bc.imm & mask);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_LDR8_RA)
+        {
+            uint32_t ea = ip->bc.cc * (1 << ip->bc.c) * r[ip->bc.r1] + ip->bc.cr * r[ip->bc.r2] + ip->bc.a;
+            INTERPRETER_ACCESS(ea & mask, sizeof(uint8_t));
+            INTERPRETER_LOAD(uint8_t, ea & mask);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_LDR16_RA)
+        {
+            uint32_t ea = ip->bc.cc * (1 << ip->bc.c) * r[ip->bc.r1] + ip->bc.cr * r[ip->bc.r2] + ip->bc.a;
+            INTERPRETER_ACCESS(ea & mask, sizeof(uint16_t));
+            INTERPRETER_LOAD(uint16_t, ea & mask);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_LDR32_RA)
+        {
+            uint32_t ea = ip->bc.cc * (1 << ip->bc.c) * r[ip->bc.r1] + ip->bc.cr * r[ip->bc.r2] + ip->bc.a;
+            INTERPRETER_ACCESS(ea & mask, sizeof(uint32_t));
+            INTERPRETER_LOAD(uint32_t, ea & mask);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_LDR64_RA)
+        {
+            uint32_t ea = ip->bc.cc * (1 << ip->bc.c) * r[ip->bc.r1] + ip->bc.cr * r[ip->bc.r2] + ip->bc.a;
+            INTERPRETER_ACCESS(ea & mask, sizeof(uint64_t));
+            INTERPRETER_LOAD(uint64_t, ea & mask);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_STR8_RI)
+        {
+            INTERPRETER_STORE(uint8_t, ip->bc.imm);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_STR16_RI)
+        {
+            INTERPRETER_STORE(uint16_t, ip->bc.imm);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_STR32_RI)
+        {
+            INTERPRETER_STORE(uint32_t, ip->bc.imm);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_STR64_RI)
+        {
+            INTERPRETER_STORE(uint64_t, ip->bc.imm);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_STR8_RA)
+        {
+            uint32_t ea = ip->bc.cc * (1 << ip->bc.c) * r[ip->bc.r1] + ip->bc.cr * r[ip->bc.r2] + ip->bc.a;
+            INTERPRETER_STORE(uint8_t, ea);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_STR16_RA)
+        {
+            uint32_t ea = ip->bc.cc * (1 << ip->bc.c) * r[ip->bc.r1] + ip->bc.cr * r[ip->bc.r2] + ip->bc.a;
+            INTERPRETER_STORE(uint16_t, ea);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_STR32_RA)
+        {
+            uint32_t ea = ip->bc.cc * (1 << ip->bc.c) * r[ip->bc.r1] + ip->bc.cr * r[ip->bc.r2] + ip->bc.a;
+            INTERPRETER_STORE(uint32_t, ea);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_STR64_RA)
+        {
+            uint32_t ea = ip->bc.cc * (1 << ip->bc.c) * r[ip->bc.r1] + ip->bc.cr * r[ip->bc.r2] + ip->bc.a;
+            INTERPRETER_STORE(uint64_t, ea);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_ADD_RRI)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] + ip->bc.imm;
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_ADD_RRR)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] + r[ip->bc.r2];
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_SUB_RRI)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] - ip->bc.imm;
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_SUB_RRR)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] - r[ip->bc.r2];
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_MUL_RRI)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] * ip->bc.imm;
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_MUL_RRR)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] * r[ip->bc.r2];
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_AND_RRI)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] & ip->bc.imm;
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_AND_RRR)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] & r[ip->bc.r2];
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_OR_RRI)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] | ip->bc.imm;
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_OR_RRR)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] | r[ip->bc.r2];
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_XOR_RRI)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] ^ ip->bc.imm;
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_XOR_RRR)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] ^ r[ip->bc.r2];
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_NOT_RR)
+        {
+            r[ip->bc.r0] = ~r[ip->bc.r1];
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_SHR_RRI)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] >> ip->bc.imm;
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_SHR_RRR)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] >> r[ip->bc.r2];
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_SHL_RRI)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] << ip->bc.imm;
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_SHL_RRR)
+        {
+            r[ip->bc.r0] = r[ip->bc.r1] << r[ip->bc.r2];
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_CMP_RI)
+        {
+            INTERPRETER_COMPARE(r[ip->bc.r0], ip->bc.imm);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_CMP_RR)
+        {
+            INTERPRETER_COMPARE(r[ip->bc.r0], r[ip->bc.r1]);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_JMP_I)
+        {
+            INTERPRETER_JUMP(ip->target);
+        }
+
+        INTERPRETER_CASE(BYTECODE_JE_I)
+        {
+            INTERPRETER_BRANCH(INTERPRETER_CONDITION(==, (flags & INTERPRETER_FLAG_EQUAL)));
+        }
+
+        INTERPRETER_CASE(BYTECODE_JNE_I)
+        {
+            INTERPRETER_BRANCH(INTERPRETER_CONDITION(!=, !(flags & INTERPRETER_FLAG_EQUAL)));
+        }
+
+        INTERPRETER_CASE(BYTECODE_JL_I)
+        {
+            INTERPRETER_BRANCH(INTERPRETER_CONDITION(<, (flags & INTERPRETER_FLAG_LESS)));
+        }
+
+        INTERPRETER_CASE(BYTECODE_JLE_I)
+        {
+            INTERPRETER_BRANCH(INTERPRETER_CONDITION(<=, (flags & (INTERPRETER_FLAG_LESS | INTERPRETER_FLAG_EQUAL))));
+        }
+
+        INTERPRETER_CASE(BYTECODE_JG_I)
+        {
+            INTERPRETER_BRANCH(INTERPRETER_CONDITION(>, (flags & INTERPRETER_FLAG_MORE)));
+        }
+
+        INTERPRETER_CASE(BYTECODE_JGE_I)
+        {
+            INTERPRETER_BRANCH(INTERPRETER_CONDITION(>=, (flags & (INTERPRETER_FLAG_MORE | INTERPRETER_FLAG_EQUAL))));
+        }
+
+        INTERPRETER_CASE(BYTECODE_SETE_R)
+        {
+            r[ip->bc.r0] = INTERPRETER_CONDITION(==, (flags & INTERPRETER_FLAG_EQUAL) > 0);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_SETNE_R)
+        {
+            r[ip->bc.r0] = INTERPRETER_CONDITION(!=, (flags & INTERPRETER_FLAG_EQUAL) == 0);
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(BYTECODE_CALL_I)
+        {
+            uint64_t sp = r[BYTECODE_RSP] - 8;
+            uint64_t return_address = (ip - code + 1) * 4;
+            if ((sp >= interp->memory_size) || (interp->memory_size - sp < 8) || (sp < interp->decoded_size))
+            {
+                /* interpreter_step reports the error, or re-decodes the code under the push. */
+                INTERPRETER_SLOW();
+            }
+            *(uint64_t *) (interp->memory + sp) = return_address;
+            r[BYTECODE_RSP] = sp;
+            interpreter_push_return(interp, return_address);
+            INTERPRETER_JUMP(ip->target);
+        }
+
+        INTERPRETER_CASE(BYTECODE_RET)
+        {
+            uint64_t sp = r[BYTECODE_RSP];
+            uint64_t return_address;
+            if ((sp >= interp->memory_size) || (interp->memory_size - sp < 8))
+            {
+                INTERPRETER_SLOW();
+            }
+            return_address = *(uint64_t *) (interp->memory + sp);
+            r[BYTECODE_RSP] = sp + 8;
+            if ((return_address == interp->return_stack[interp->return_top]) && (return_address < interp->decoded_size))
+            {
+                /* Only slots of the region are predicted, so it is where to go. */
+                interp->return_top = (interp->return_top - 1) & (INTERPRETER_RETURN_STACK_SIZE - 1);
+                if (interp->return_depth > 0)
+                    interp->return_depth -= 1;
+                ip = code + return_address / 4;
+                INTERPRETER_ENTER();
+            }
+            interpreter_pop_return(interp, return_address);
+            if ((return_address < interp->decoded_size) && ((return_address & 0x3) == 0))
+            {
+                ip = code + return_address / 4;
+                INTERPRETER_ENTER();
+            }
+            INTERPRETER_SAVE(return_address);
+            goto resume;
+        }
+
+        INTERPRETER_CASE(BYTECODE_WIDE)
+        {
+            INTERPRETER_NEXT();
+        }
+
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RI_JE)  { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], ip->bc.imm, ==); }
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RI_JNE) { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], ip->bc.imm, !=); }
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RI_JL)  { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], ip->bc.imm, <); }
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RI_JLE) { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], ip->bc.imm, <=); }
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RI_JG)  { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], ip->bc.imm, >); }
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RI_JGE) { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], ip->bc.imm, >=); }
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RR_JE)  { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], r[ip->bc.r1], ==); }
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RR_JNE) { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], r[ip->bc.r1], !=); }
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RR_JL)  { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], r[ip->bc.r1], <); }
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RR_JLE) { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], r[ip->bc.r1], <=); }
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RR_JG)  { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], r[ip->bc.r1], >); }
+        INTERPRETER_CASE(INTERPRETER_OP_CMP_RR_JGE) { INTERPRETER_COMPARE_AND_BRANCH(r[ip->bc.r0], r[ip->bc.r1], >=); }
+
+        INTERPRETER_CASE(INTERPRETER_OP_MOV_RR_MOV_RR)
+        {
+            r[ip[0].bc.r0] = r[ip[0].bc.r1];
+            r[ip[1].bc.r0] = r[ip[1].bc.r1];
+            ip += 2;
+            INTERPRETER_DISPATCH();
+        }
+
+        INTERPRETER_CASE(INTERPRETER_OP_ADD_RRI_CMP_RI)
+        {
+            r[ip[0].bc.r0] = r[ip[0].bc.r1] + ip[0].bc.imm;
+            INTERPRETER_COMPARE(r[ip[1].bc.r0], ip[1].bc.imm);
+            ip += 2;
+            INTERPRETER_DISPATCH();
+        }
+
+        INTERPRETER_CASE(INTERPRETER_OP_SLOW)
+        {
+            /* The step is charged with the block it is in. */
+            INTERPRETER_SAVE((ip - code) * 4);
+            INTERPRETER_GUARD_EXECUTE((ip - code) * 4);
+            ec = interpreter_execute(interp);
+            if (ec != 0)
+            {
+                interp->step_count += max_steps - steps;
+                return ec;
+            }
+            goto resume;
+        }
+#if !INTERPRETER_THREADED
+    }
+#endif
+
+exhausted:
+    INTERPRETER_SAVE((ip - code) * 4);
+    interp->step_count += max_steps - steps;
+    return INTERPRETER_BUDGET_EXHAUSTED;
+
+hot:
+    INTERPRETER_SAVE((ip - code) * 4);
+    interp->step_count += max_steps - steps;
+    return INTERPRETER_HOT_BLOCK;
+
+#if INTERPRETER_LOOP_CHECKED
+fault:
+    /* Stops where the guard page would have, before the access */
+    INTERPRETER_SAVE((ip - code) * 4);
+    interp->step_count += max_steps - steps;
+    interp->fault_address = (int64_t) fault_address;
+    printf("Error: guest memory access at %lld is outside of the interpreter memory\n", (long long) interp->fault_address);
+    return INTERPRETER_FAULT;
+#endif
+
+#if INTERPRETER_LOOP_GUARD
+guard_fault:
+    /* interpreter_fault_handler has set fault_address */
+    INTERPRETER_SAVE((ip - code) * 4);
+    interp->step_count += max_steps - steps;
+    printf("Error: guest memory access at %lld is outside of the interpreter memory\n", (long long) interp->fault_address);
+    return INTERPRETER_FAULT;
+#endif
+}
+
+#undef INTERPRETER_STORE
+#undef INTERPRETER_SAVE
+#undef INTERPRETER_COMPARE_AND_BRANCH
+#undef INTERPRETER_BRANCH
+#undef INTERPRETER_JUMP
+#undef INTERPRETER_CONDITION
+#undef INTERPRETER_COMPARE
+#undef INTERPRETER_SLOW
+#undef INTERPRETER_NEXT
+#undef INTERPRETER_ENTER
+#undef INTERPRETER_DISPATCH
+#undef INTERPRETER_CASE
+#undef INTERPRETER_LOOP_THREADED
+#undef INTERPRETER_PROFILE_OP
+#undef INTERPRETER_TRACE_OP
+#undef INTERPRETER_CACHE_ACCESS
+#undef INTERPRETER_GUARD_EXECUTE
+#undef INTERPRETER_MOVE_STORE
+#undef INTERPRETER_LOAD
+#undef INTERPRETER_GUARD_STORE_uint64_t
+#undef INTERPRETER_GUARD_STORE_uint32_t
+#undef INTERPRETER_GUARD_STORE_uint16_t
+#undef INTERPRETER_GUARD_STORE_uint8_t
+#undef INTERPRETER_GUARD_LOAD_uint64_t
+#undef INTERPRETER_GUARD_LOAD_uint32_t
+#undef INTERPRETER_GUARD_LOAD_uint16_t
+#undef INTERPRETER_GUARD_LOAD_uint8_t
+#undef INTERPRETER_GUARD_FIXUP
+#undef INTERPRETER_CHECK
+#undef INTERPRETER_ACCESS
+
+#undef INTERPRETER_LOOP
+#undef INTERPRETER_LOOP_VARIANT
+#undef INTERPRETER_LOOP_PROFILE
+#undef INTERPRETER_LOOP_TRACE
+#undef INTERPRETER_LOOP_CACHE
+#undef INTERPRETER_LOOP_CHECKED
+#undef INTERPRETER_LOOP_GUARD
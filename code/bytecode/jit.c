@@ -0,0 +1,1454 @@
+#include "jit.h"
+#include "x86_64.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+
+/* The templates address the context through these offsets. */
+typedef char jit_context_registers_check[(offsetof(jit_context, registers) == BYTECODE_X86_64_CONTEXT_REGISTERS) ? 1 : -1];
+typedef char jit_context_flags_check[(offsetof(jit_context, flags) == BYTECODE_X86_64_CONTEXT_FLAGS) ? 1 : -1];
+typedef char jit_context_code_size_check[(offsetof(jit_context, code_size) == BYTECODE_X86_64_CONTEXT_CODE_SIZE) ? 1 : -1];
+typedef char jit_context_memory_check[(offsetof(jit_context, memory) == JIT_CONTEXT_MEMORY) ? 1 : -1];
+typedef char jit_context_exit_ip_check[(offsetof(jit_context, exit_ip) == JIT_CONTEXT_EXIT_IP) ? 1 : -1];
+typedef char jit_context_exit_reason_check[(offsetof(jit_context, exit_reason) == JIT_CONTEXT_EXIT_REASON) ? 1 : -1];
+typedef char jit_context_entry_check[(offsetof(jit_context, entry) == JIT_CONTEXT_ENTRY) ? 1 : -1];
+typedef char jit_context_memory_size_check[(offsetof(jit_context, memory_size) == JIT_CONTEXT_MEMORY_SIZE) ? 1 : -1];
+typedef char jit_context_entries_check[(offsetof(jit_context, entries) == JIT_CONTEXT_ENTRIES) ? 1 : -1];
+
+#define JIT_ENTER_LEAVE_SIZE 256
+#define JIT_EXIT_SIZE 27 /* Bytes of jit_exit */
+#define JIT_TRACE_LENGTH 256
+
+typedef struct
+{
+    uint8_t *jump;   /* End of the rel32 to link to the native code of target */
+    uint8_t *store;  /* End of the rel32 to link to the code-modified exit */
+    uint32_t target;
+} jit_fixup;
+
+
+static int32_t jit_error(char const *msg)
+{
+    printf("%s", msg);
+    return 1;
+}
+
+static uint64_t jit_now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static uint8_t *jit_exit(uint8_t *out, uint8_t *leave, uint64_t ip, uint32_t reason)
+{
+    /* mov qword [rbp + exit_ip], ip; mov qword [rbp + exit_reason], reason; jmp leave */
+    out = x86_64_rm(out, X86_64_W, 0xc7, 0, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_EXIT_IP);
+    out = x86_64_imm32(out, (int32_t) ip);
+    out = x86_64_rm(out, X86_64_W, 0xc7, 0, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_EXIT_REASON);
+    out = x86_64_imm32(out, (int32_t) reason);
+    out = x86_64_jmp(out);
+    x86_64_patch_rel32(out, leave);
+    return out;
+}
+
+/*
+    CALL, the checks are the ones of interpreter_step, a failing one leaves
+    for the interpreter to report it (or to re-decode after a push into the code):
+        push rax
+        mov rax, [rbp + r13]
+        cmp rax, [rbp + memory_size]
+        ja fail
+        sub rax, 8
+        jb fail
+        cmp rax, [rbp + code_size]
+        jb fail
+        mov qword [r15 + rax], return address
+        mov [rbp + r13], rax
+        pop rax
+        jmp target
+    fail:
+        pop rax
+        exit to the interpreter at the CALL
+    The rel32 of the jump to the target is left for the caller to link, *jump is its end.
+*/
+static uint8_t *jit_call(uint8_t *out, uint8_t *leave, uint64_t slot, uint8_t **jump)
+{
+    uint8_t *fail[3];
+    int32_t i;
+
+    out = x86_64_push(out, X86_64_RAX);
+    out = x86_64_rm(out, X86_64_W, 0x8b, X86_64_RAX, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * BYTECODE_RSP);
+    out = x86_64_rm(out, X86_64_W, 0x3b, X86_64_RAX, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_MEMORY_SIZE);
+    fail[0] = out = x86_64_jcc(out, X86_64_CC_A);
+    out = x86_64_imm32(x86_64_rr(out, X86_64_W, 0x81, 5, X86_64_RAX), 8);
+    fail[1] = out = x86_64_jcc(out, X86_64_CC_B);
+    out = x86_64_rm(out, X86_64_W, 0x3b, X86_64_RAX, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_CODE_SIZE);
+    fail[2] = out = x86_64_jcc(out, X86_64_CC_B);
+    out = x86_64_rm(out, X86_64_W, 0xc7, 0, X86_64_R15, X86_64_RAX, 0, 0);
+    out = x86_64_imm32(out, (int32_t) (slot * 4 + 4));
+    out = x86_64_rm(out, X86_64_W, 0x89, X86_64_RAX, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * BYTECODE_RSP);
+    out = x86_64_pop(out, X86_64_RAX);
+    *jump = out = x86_64_jmp(out);
+
+    for (i = 0; i < 3; i++)
+        x86_64_patch_rel32(fail[i], out);
+    out = x86_64_pop(out, X86_64_RAX);
+    return jit_exit(out, leave, slot * 4, JIT_EXIT_INTERPRET);
+}
+
+/*
+    RET, goes on in the native code of the slot it returns to, and leaves only
+    when that slot has none (or the address is not a slot at all):
+        push rax
+        mov rax, [rbp + r13]
+        add rax, 8
+        jc fail
+        cmp rax, [rbp + memory_size]
+        ja fail
+        mov [rbp + r13], rax
+        mov rax, [r15 + rax - 8]
+        mov [rbp + exit_ip], rax
+        cmp rax, [rbp + code_size]
+        jae out
+        test eax, 3
+        jnz out
+        add rax, rax
+        add rax, [rbp + entries]
+        mov rax, [rax]
+        test rax, rax
+        jz out
+        mov [rbp + entry], rax
+        pop rax
+        jmp [rbp + entry]
+    out:
+        mov qword [rbp + exit_reason], JIT_EXIT_BLOCK
+        pop rax
+        jmp leave
+    fail:
+        pop rax
+        exit to the interpreter at the RET
+*/
+static uint8_t *jit_return(uint8_t *out, uint8_t *leave, uint64_t slot)
+{
+    uint8_t *fail[2];
+    uint8_t *outside[3];
+    int32_t i;
+
+    out = x86_64_push(out, X86_64_RAX);
+    out = x86_64_rm(out, X86_64_W, 0x8b, X86_64_RAX, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * BYTECODE_RSP);
+    out = x86_64_imm32(x86_64_rr(out, X86_64_W, 0x81, 0, X86_64_RAX), 8);
+    fail[0] = out = x86_64_jcc(out, X86_64_CC_B);
+    out = x86_64_rm(out, X86_64_W, 0x3b, X86_64_RAX, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_MEMORY_SIZE);
+    fail[1] = out = x86_64_jcc(out, X86_64_CC_A);
+    out = x86_64_rm(out, X86_64_W, 0x89, X86_64_RAX, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * BYTECODE_RSP);
+    out = x86_64_rm(out, X86_64_W, 0x8b, X86_64_RAX, X86_64_R15, X86_64_RAX, 0, -8);
+    out = x86_64_rm(out, X86_64_W, 0x89, X86_64_RAX, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_EXIT_IP);
+    out = x86_64_rm(out, X86_64_W, 0x3b, X86_64_RAX, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_CODE_SIZE);
+    outside[0] = out = x86_64_jcc(out, X86_64_CC_AE);
+    out = x86_64_imm32(x86_64_rr(out, 0, 0xf7, 0, X86_64_RAX), 3);
+    outside[1] = out = x86_64_jcc(out, X86_64_CC_NE);
+    out = x86_64_rr(out, X86_64_W, 0x01, X86_64_RAX, X86_64_RAX);
+    out = x86_64_rm(out, X86_64_W, 0x03, X86_64_RAX, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_ENTRIES);
+    out = x86_64_rm(out, X86_64_W, 0x8b, X86_64_RAX, X86_64_RAX, X86_64_NONE, 0, 0);
+    out = x86_64_rr(out, X86_64_W, 0x85, X86_64_RAX, X86_64_RAX);
+    outside[2] = out = x86_64_jcc(out, X86_64_CC_E);
+    out = x86_64_rm(out, X86_64_W, 0x89, X86_64_RAX, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_ENTRY);
+    out = x86_64_pop(out, X86_64_RAX);
+    out = x86_64_rm(out, 0, 0xff, 4, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_ENTRY);
+
+    for (i = 0; i < 3; i++)
+        x86_64_patch_rel32(outside[i], out);
+    out = x86_64_rm(out, X86_64_W, 0xc7, 0, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_EXIT_REASON);
+    out = x86_64_imm32(out, JIT_EXIT_BLOCK);
+    out = x86_64_pop(out, X86_64_RAX);
+    out = x86_64_jmp(out);
+    x86_64_patch_rel32(out, leave);
+
+    for (i = 0; i < 2; i++)
+        x86_64_patch_rel32(fail[i], out);
+    out = x86_64_pop(out, X86_64_RAX);
+    return jit_exit(out, leave, slot * 4, JIT_EXIT_INTERPRET);
+}
+
+/* Host condition of the fused compare-and-branch operation, or 0 for the other operations */
+static uint8_t jit_fused_condition(uint8_t op)
+{
+    static uint8_t const conditions[6] =
+    {
+        X86_64_CC_E, X86_64_CC_NE, X86_64_CC_B, X86_64_CC_BE, X86_64_CC_A, X86_64_CC_AE,
+    };
+    if ((op >= INTERPRETER_OP_CMP_RI_JE) && (op <= INTERPRETER_OP_CMP_RR_JGE))
+    {
+        return conditions[(op - INTERPRETER_OP_CMP_RI_JE) % 6];
+    }
+    return 0;
+}
+
+/*
+    Host registers of a compiled block.
+
+    The host registers of r0-r12 that no instruction of the block takes are taken over
+    for the block: their values go to the context on the way in and come back on the way out.
+    The wide registers (r13, r14, r16-r31) the block uses the most live in them from the way
+    in to the way out. When there are more wide registers than that, two of the taken ones
+    are scratch registers the rest of the wide ones are loaded into around every instruction.
+*/
+typedef struct
+{
+    uint8_t registers[BYTECODE_REGISTER_COUNT]; /* Host register of every bytecode register inside the block */
+    uint8_t narrow[BYTECODE_REGISTER_COUNT];    /* Register whose host register is taken */
+    uint8_t wide[BYTECODE_REGISTER_COUNT];      /* Register living there, BYTECODE_RIP for a scratch register */
+    uint32_t count;
+    uint32_t scratch;                           /* Host registers the instructions may clobber */
+} jit_window;
+
+#define JIT_WINDOW_SCRATCH 2
+
+static void jit_window_clear(jit_window *w)
+{
+    memcpy(w->registers, bytecode_x86_64_registers, sizeof(w->registers));
+    w->count = 0;
+    w->scratch = 0;
+}
+
+/* Plans the window of the instructions at the slots first to first + length, or at trace[0] to trace[length - 1] */
+static void jit_window_plan(jit_window *w, interpreter *interp, uint32_t const *trace, uint64_t first, uint64_t length)
+{
+    uint32_t uses[BYTECODE_REGISTER_COUNT];
+    uint8_t donors[BYTECODE_REGISTER_COUNT];
+    uint32_t donor_count = 0;
+    uint32_t wide_count = 0;
+    uint32_t used = 0;
+    uint32_t pinned, scratch_count;
+    uint64_t i;
+    uint32_t r, k;
+
+    jit_window_clear(w);
+    memset(uses, 0, sizeof(uses));
+    for (i = 0; i < length; i++)
+    {
+        interpreter_instruction *in = interp->decoded + (trace ? trace[i] : first + i);
+        uint32_t operands = (in->op == INTERPRETER_OP_SLOW) ? 0 : bytecode_x86_64_operands(in->bc);
+        used = used | operands;
+        for (r = 0; r < BYTECODE_REGISTER_COUNT; r++)
+        {
+            if (operands & (1u << r))
+                uses[r] += 1;
+        }
+    }
+
+    for (r = 0; r < BYTECODE_REGISTER_COUNT; r++)
+    {
+        uint8_t host = bytecode_x86_64_registers[r];
+        if ((host == X86_64_NONE) && (r != BYTECODE_RIP) && uses[r])
+            wide_count += 1;
+        /* rcx stays, variable shifts take it whatever the mapping is. */
+        if ((host != X86_64_NONE) && (host != X86_64_RCX) && !(used & (1u << r)))
+            donors[donor_count++] = (uint8_t) r;
+    }
+
+    pinned = wide_count;
+    scratch_count = 0;
+    if (wide_count > donor_count)
+    {
+        scratch_count = (donor_count < JIT_WINDOW_SCRATCH) ? donor_count : JIT_WINDOW_SCRATCH;
+        pinned = donor_count - scratch_count;
+    }
+
+    for (k = 0; k < pinned + scratch_count; k++)
+    {
+        uint8_t host = bytecode_x86_64_registers[donors[k]];
+        uint8_t wide = BYTECODE_RIP;
+        if (k < pinned)
+        {
+            for (r = 0; r < BYTECODE_REGISTER_COUNT; r++)
+            {
+                if ((w->registers[r] == X86_64_NONE) && (r != BYTECODE_RIP) && ((wide == BYTECODE_RIP) || (uses[r] > uses[wide])))
+                    wide = (uint8_t) r;
+            }
+            w->registers[wide] = host;
+        }
+        else
+        {
+            w->scratch = w->scratch | (1u << host);
+        }
+        w->narrow[w->count] = donors[k];
+        w->wide[w->count] = wide;
+        w->count += 1;
+    }
+}
+
+/* Bytes the window adds to a block of length slots at most: the ways in, and a way out in front of every exit */
+static uint64_t jit_window_room(jit_window const *w, uint64_t length)
+{
+    uint64_t moves = 2 * 7 * w->count; /* A mov with a disp32 is 7 bytes */
+    return 3 * moves + 16 + length * (moves + 16);
+}
+
+/* Way into the block, when it comes from code that keeps the registers where jit_prepare loads them */
+static uint8_t *jit_window_enter(uint8_t *out, jit_window const *w)
+{
+    uint32_t i;
+    for (i = 0; i < w->count; i++)
+    {
+        uint8_t host = bytecode_x86_64_registers[w->narrow[i]];
+        out = x86_64_rm(out, X86_64_W, 0x89, host, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * w->narrow[i]);
+        if (w->wide[i] != BYTECODE_RIP)
+            out = x86_64_rm(out, X86_64_W, 0x8b, host, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * w->wide[i]);
+    }
+    return out;
+}
+
+/* Way out of the block, which puts the registers back for the exits and the other blocks */
+static uint8_t *jit_window_leave(uint8_t *out, jit_window const *w)
+{
+    uint32_t i;
+    for (i = 0; i < w->count; i++)
+    {
+        uint8_t host = bytecode_x86_64_registers[w->narrow[i]];
+        if (w->wide[i] != BYTECODE_RIP)
+            out = x86_64_rm(out, X86_64_W, 0x89, host, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * w->wide[i]);
+        out = x86_64_rm(out, X86_64_W, 0x8b, host, X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * w->narrow[i]);
+    }
+    return out;
+}
+
+/*
+    Drops the native code and starts a new buffer for the current code region,
+    with the enter and leave sequences at its beginning.
+*/
+static int32_t jit_prepare(jit *j, interpreter *interp, uint64_t buffer_size)
+{
+    static uint8_t const saved[6] =
+    {
+        X86_64_RBX, X86_64_RBP, X86_64_R12, X86_64_R13, X86_64_R14, X86_64_R15,
+    };
+    uint64_t count = interp->decoded_size / 4;
+    uint8_t *out;
+    int32_t i;
+
+    if (interp->sandbox == INTERPRETER_SANDBOX_MASK)
+    {
+        return jit_error("Error: the native code does not mask addresses, run the masked memory with the interpreter\n");
+    }
+    if (j->buffer)
+    {
+        munmap(j->buffer, j->buffer_size);
+    }
+    free(j->entries);
+    j->buffer = 0;
+    j->buffer_size = 0;
+    j->entries = 0;
+    j->link_count = 0;
+
+    buffer_size = (buffer_size + JIT_ENTER_LEAVE_SIZE + 0xfff) & ~(uint64_t) 0xfff;
+    j->buffer = mmap(0, buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->buffer == MAP_FAILED)
+    {
+        j->buffer = 0;
+        return jit_error("Error: could not allocate memory for the native code\n");
+    }
+    j->buffer_size = buffer_size;
+    j->entries = calloc(count + 1, sizeof(uint8_t *));
+    if (j->entries == 0)
+    {
+        munmap(j->buffer, j->buffer_size);
+        j->buffer = 0;
+        return jit_error("Error: could not allocate memory for the native code\n");
+    }
+    j->code_size = interp->decoded_size;
+    j->code_version = interp->code_version;
+
+    /*
+        Enter, called as void enter(jit_context *context):
+            push the callee-saved registers
+            mov rbp, rdi
+            mov r15, [rbp + memory]
+            load r0-r12
+            jmp [rbp + entry]
+    */
+    out = j->buffer;
+    for (i = 0; i < 6; i++)
+        out = x86_64_push(out, saved[i]);
+    out = x86_64_rr(out, X86_64_W, 0x89, X86_64_RDI, X86_64_RBP);
+    out = x86_64_rm(out, X86_64_W, 0x8b, X86_64_R15, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_MEMORY);
+    for (i = 0; i < BYTECODE_REGISTER_COUNT; i++)
+    {
+        if (bytecode_x86_64_registers[i] != X86_64_NONE)
+            out = x86_64_rm(out, X86_64_W, 0x8b, bytecode_x86_64_registers[i], X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * i);
+    }
+    out = x86_64_rm(out, 0, 0xff, 4, X86_64_RBP, X86_64_NONE, 0, JIT_CONTEXT_ENTRY);
+
+    /* Leave, every exit stub comes here after writing exit_ip and exit_reason */
+    j->leave = out;
+    for (i = 0; i < BYTECODE_REGISTER_COUNT; i++)
+    {
+        if (bytecode_x86_64_registers[i] != X86_64_NONE)
+            out = x86_64_rm(out, X86_64_W, 0x89, bytecode_x86_64_registers[i], X86_64_RBP, X86_64_NONE, 0, BYTECODE_X86_64_CONTEXT_REGISTERS + 8 * i);
+    }
+    for (i = 5; i >= 0; i--)
+        out = x86_64_pop(out, saved[i]);
+    *out++ = 0xc3;
+
+    j->cursor = out;
+    return 0;
+}
+
+/* Whether the instruction leaves the block: jumps, calls, returns and what interpreter_step does */
+static int32_t jit_ends_block(interpreter_instruction *in)
+{
+    return (in->op == INTERPRETER_OP_SLOW) || (in->op == BYTECODE_CALL_I) || (in->op == BYTECODE_RET) ||
+           ((in->bc.opcode >= BYTECODE_JMP_I) && (in->bc.opcode <= BYTECODE_JGE_I));
+}
+
+/*
+    Slots are compiled a basic block at a time, every block with its jit_window.
+    Slots inside a block that takes registers over are entered through a stub
+    which calls the way in and jumps to the slot.
+*/
+int32_t jit_compile_region(jit *j, interpreter *interp)
+{
+    uint64_t count = interp->decoded_size / 4;
+    uint8_t *buffer_end = j->buffer + j->buffer_size;
+    jit_fixup *fixups;
+    uint8_t *starts;
+    uint8_t *out;
+    uint64_t tail = 0;  /* Bytes of the exits of stores left for the end */
+    uint64_t slot, first, end;
+
+    fixups = calloc(count + 1, sizeof(jit_fixup));
+    starts = calloc(count + 1, sizeof(uint8_t));
+    if ((fixups == 0) || (starts == 0))
+    {
+        free(fixups);
+        free(starts);
+        return jit_error("Error: could not allocate memory for the native code\n");
+    }
+
+    /* Blocks start at the destinations of the jumps and calls, and after everything that leaves a block. */
+    starts[0] = 1;
+    for (slot = 0; slot < count; slot++)
+    {
+        interpreter_instruction *in = interp->decoded + slot;
+        if (jit_ends_block(in))
+        {
+            starts[slot + 1] = 1;
+            if ((in->op != INTERPRETER_OP_SLOW) && (in->op != BYTECODE_RET))
+                starts[in->target] = 1;
+        }
+    }
+
+    out = j->cursor;
+    for (first = 0; first < count; first = end)
+    {
+        jit_window w;
+        uint8_t *body;
+        uint8_t *through = 0;
+
+        for (end = first + 1; (end < count) && !starts[end]; end++);
+        jit_window_plan(&w, interp, 0, first, end - first);
+        if ((uint64_t) (buffer_end - out) < (count - first + 1) * JIT_SLOT_SIZE + tail + jit_window_room(&w, end - first))
+        {
+            /* No room left for it, the block keeps the wide registers in the context. */
+            jit_window_clear(&w);
+        }
+
+        j->entries[first] = out;
+        out = jit_window_enter(out, &w);
+        body = out;
+        for (slot = first; slot < end; slot++)
+        {
+            interpreter_instruction *in = interp->decoded + slot;
+            uint64_t size = 0;
+
+            if (slot > first)
+                j->entries[slot] = out;
+            through = 0;
+            if (in->op == BYTECODE_CALL_I)
+            {
+                out = jit_window_leave(out, &w);
+                out = jit_call(out, j->leave, slot, &fixups[slot].jump);
+                fixups[slot].target = in->target;
+                continue;
+            }
+            if (in->op == BYTECODE_RET)
+            {
+                out = jit_window_leave(out, &w);
+                out = jit_return(out, j->leave, slot);
+                continue;
+            }
+            if (in->op != INTERPRETER_OP_SLOW)
+            {
+                size = bytecode_encode_x86_64_block(out, buffer_end - out, in->bc, w.registers, w.scratch);
+            }
+            if (size == 0)
+            {
+                out = jit_window_leave(out, &w);
+                out = jit_exit(out, j->leave, slot * 4, JIT_EXIT_INTERPRET);
+                continue;
+            }
+            out += size;
+            through = out;
+
+            switch (in->bc.opcode)
+            {
+                case BYTECODE_JMP_I:
+                case BYTECODE_JE_I:
+                case BYTECODE_JNE_I:
+                case BYTECODE_JL_I:
+                case BYTECODE_JLE_I:
+                case BYTECODE_JG_I:
+                case BYTECODE_JGE_I:
+                {
+                    fixups[slot].jump = out;
+                    fixups[slot].target = in->target;
+                    if (in->bc.opcode == BYTECODE_JMP_I)
+                        through = 0;
+                }
+                break;
+
+                case BYTECODE_STR8_RA:
+                case BYTECODE_STR16_RA:
+                case BYTECODE_STR32_RA:
+                case BYTECODE_STR64_RA:
+                {
+                    fixups[slot].store = out;
+                    tail += JIT_EXIT_SIZE;
+                }
+                break;
+
+                case BYTECODE_STR8_RI:
+                case BYTECODE_STR16_RI:
+                case BYTECODE_STR32_RI:
+                case BYTECODE_STR64_RI:
+                {
+                    if ((uint64_t) in->bc.imm < j->code_size)
+                    {
+                        out = jit_window_leave(out, &w);
+                        out = jit_exit(out, j->leave, slot * 4 + 4, JIT_EXIT_CODE_MODIFIED);
+                        through = 0;
+                    }
+                }
+                break;
+
+                case BYTECODE_CMP_RI:
+                case BYTECODE_CMP_RR:
+                {
+                    /* The compare left the host flags, so a fused branch takes them right away. */
+                    if (jit_fused_condition(in->op))
+                    {
+                        out = x86_64_jcc(out, jit_fused_condition(in->op));
+                        fixups[slot].jump = out;
+                        fixups[slot].target = in[1].target;
+                    }
+                }
+                break;
+            }
+        }
+        if (w.count == 0)
+        {
+            /* The next block goes on right here, the exits are linked below. */
+            continue;
+        }
+
+        /* The way out and then the next block, past the stubs of this one. */
+        if (through)
+        {
+            out = jit_window_leave(out, &w);
+            through = out = x86_64_jmp(out);
+        }
+        for (slot = first; slot < end; slot++)
+        {
+            if (interp->decoded[slot].op == BYTECODE_CALL_I)
+            {
+                /* Left the block already, the call goes to the target like from any other block. */
+                continue;
+            }
+            if (fixups[slot].jump && (fixups[slot].target == first))
+            {
+                /* Back to the top of the block, which keeps the registers. */
+                x86_64_patch_rel32(fixups[slot].jump, body);
+                fixups[slot].jump = 0;
+            }
+            else if (fixups[slot].jump)
+            {
+                x86_64_patch_rel32(fixups[slot].jump, out);
+                out = jit_window_leave(out, &w);
+                fixups[slot].jump = out = x86_64_jmp(out);
+            }
+            if (fixups[slot].store)
+            {
+                x86_64_patch_rel32(fixups[slot].store, out);
+                out = jit_window_leave(out, &w);
+                out = jit_exit(out, j->leave, slot * 4 + 4, JIT_EXIT_CODE_MODIFIED);
+                fixups[slot].store = 0;
+                tail -= JIT_EXIT_SIZE;
+            }
+        }
+        if (end - first > 1)
+        {
+            uint8_t *enter = out;
+            out = jit_window_enter(out, &w);
+            *out++ = 0xc3;
+            for (slot = first + 1; slot < end; slot++)
+            {
+                uint8_t *code = j->entries[slot];
+                j->entries[slot] = out;
+                out = x86_64_call(out);
+                x86_64_patch_rel32(out, enter);
+                out = x86_64_jmp(out);
+                x86_64_patch_rel32(out, code);
+            }
+        }
+        if (through)
+        {
+            x86_64_patch_rel32(through, out);
+        }
+    }
+
+    /* Falling off the end of the code is left to the interpreter. */
+    j->entries[count] = out;
+    out = jit_exit(out, j->leave, count * 4, JIT_EXIT_INTERPRET);
+
+    for (slot = 0; slot < count; slot++)
+    {
+        if (fixups[slot].jump)
+        {
+            x86_64_patch_rel32(fixups[slot].jump, j->entries[fixups[slot].target]);
+        }
+        if (fixups[slot].store)
+        {
+            x86_64_patch_rel32(fixups[slot].store, out);
+            out = jit_exit(out, j->leave, slot * 4 + 4, JIT_EXIT_CODE_MODIFIED);
+        }
+    }
+    free(fixups);
+    free(starts);
+    j->cursor = out;
+    return 0;
+}
+
+int32_t jit_compile(jit *j, interpreter *interp)
+{
+    if (jit_prepare(j, interp, 2 * (interp->decoded_size / 4 + 1) * JIT_SLOT_SIZE) != 0)
+    {
+        return 1;
+    }
+    if (jit_compile_region(j, interp) != 0)
+    {
+        jit_release(j);
+        return 1;
+    }
+    if (mprotect(j->buffer, j->buffer_size, PROT_READ | PROT_EXEC) != 0)
+    {
+        jit_release(j);
+        return jit_error("Error: could not make the native code executable\n");
+    }
+    return 0;
+}
+
+/* Point the jump ending at the given rel32 to the block at target, or to an exit stub for now */
+static uint8_t *jit_link_block(jit *j, uint8_t *out, uint8_t *jump, uint32_t target)
+{
+    if (j->entries[target])
+    {
+        x86_64_patch_rel32(jump, j->entries[target]);
+        return out;
+    }
+
+    if (j->link_count == j->link_capacity)
+    {
+        uint64_t capacity = j->link_capacity ? 2 * j->link_capacity : 64;
+        jit_link *links = realloc(j->links, capacity * sizeof(jit_link));
+        if (links == 0)
+        {
+            /* Stays an exit, which is slower but still right. */
+            x86_64_patch_rel32(jump, out);
+            return jit_exit(out, j->leave, target * 4, JIT_EXIT_BLOCK);
+        }
+        j->links = links;
+        j->link_capacity = capacity;
+    }
+    j->links[j->link_count].jump = jump;
+    j->links[j->link_count].target = target;
+    j->link_count += 1;
+
+    x86_64_patch_rel32(jump, out);
+    return jit_exit(out, j->leave, target * 4, JIT_EXIT_BLOCK);
+}
+
+/*
+    Makes the code at start the native code of the slot: links the exits waiting for it,
+    makes the buffer executable again and records the stats.
+*/
+static int32_t jit_finish(jit *j, uint64_t slot, uint8_t *start, uint8_t *end, uint64_t instruction_count, uint64_t start_ns, uint32_t kind)
+{
+    uint64_t i;
+
+    j->entries[slot] = start;
+    for (i = 0; i < j->link_count;)
+    {
+        if (j->links[i].target == slot)
+        {
+            x86_64_patch_rel32(j->links[i].jump, start);
+            j->links[i] = j->links[--j->link_count];
+        }
+        else
+        {
+            i++;
+        }
+    }
+    j->cursor = end;
+
+    if (mprotect(j->buffer, j->buffer_size, PROT_READ | PROT_EXEC) != 0)
+    {
+        jit_release(j);
+        return jit_error("Error: could not make the native code executable\n");
+    }
+
+    if (j->block_count == j->block_capacity)
+    {
+        uint64_t capacity = j->block_capacity ? 2 * j->block_capacity : 16;
+        jit_block *blocks = realloc(j->blocks, capacity * sizeof(jit_block));
+        if (blocks == 0)
+        {
+            return 0;
+        }
+        j->blocks = blocks;
+        j->block_capacity = capacity;
+    }
+    j->blocks[j->block_count].address = slot * 4;
+    j->blocks[j->block_count].instruction_count = instruction_count;
+    j->blocks[j->block_count].native_size = end - start;
+    j->blocks[j->block_count].compile_ns = jit_now_ns() - start_ns;
+    j->blocks[j->block_count].kind = kind;
+    j->block_count += 1;
+    return 0;
+}
+
+/*
+    Compiles the basic block starting at the slot: instructions up to the first
+    jump, CALL or RET, or up to what has to leave the native code anyway (an
+    instruction for interpreter_step, a store into the code).
+    Returns 0 when the block is compiled and entries[slot] points to it.
+*/
+int32_t jit_compile_block(jit *j, interpreter *interp, uint64_t slot)
+{
+    uint64_t count = interp->decoded_size / 4;
+    uint64_t start_ns = jit_now_ns();
+    uint64_t length, i;
+    uint8_t *start, *body, *out;
+    jit_window w;
+    uint8_t **jumps;
+    uint32_t *targets;
+    uint64_t jump_count = 0;
+    uint8_t **stores;
+    uint64_t *store_ips;
+    uint64_t store_count = 0;
+    int32_t ends = 0;
+    int32_t calls = 0;      /* The last jump is the one of a CALL, which has left the window already */
+
+    if ((slot >= count) || (interp->decoded[slot].op == INTERPRETER_OP_SLOW) || j->entries[slot])
+    {
+        return 1;
+    }
+
+    for (length = 0; slot + length < count; length++)
+    {
+        interpreter_instruction *in = interp->decoded + slot + length;
+        if (in->op == INTERPRETER_OP_SLOW)
+            break;
+        if (((in->bc.opcode >= BYTECODE_JMP_I) && (in->bc.opcode <= BYTECODE_JGE_I)) ||
+            (in->op == BYTECODE_CALL_I) || (in->op == BYTECODE_RET))
+        {
+            length += 1;
+            break;
+        }
+    }
+    if ((uint64_t) (j->buffer + j->buffer_size - j->cursor) < (length + 2) * JIT_SLOT_SIZE)
+    {
+        /* Out of space, the block stays with the interpreter. */
+        return 1;
+    }
+    jit_window_plan(&w, interp, 0, slot, length);
+    if ((uint64_t) (j->buffer + j->buffer_size - j->cursor) < (length + 2) * JIT_SLOT_SIZE + jit_window_room(&w, length))
+    {
+        jit_window_clear(&w);
+    }
+
+    jumps = calloc(length + 2, sizeof(uint8_t *));
+    targets = calloc(length + 2, sizeof(uint32_t));
+    stores = calloc(length + 1, sizeof(uint8_t *));
+    store_ips = calloc(length + 1, sizeof(uint64_t));
+    if ((jumps == 0) || (targets == 0) || (stores == 0) || (store_ips == 0))
+    {
+        free(jumps);
+        free(targets);
+        free(stores);
+        free(store_ips);
+        return 1;
+    }
+
+    if (mprotect(j->buffer, j->buffer_size, PROT_READ | PROT_WRITE) != 0)
+    {
+        free(jumps);
+        free(targets);
+        free(stores);
+        free(store_ips);
+        return jit_error("Error: could not make the native code writable\n");
+    }
+
+    start = out = j->cursor;
+    j->entries[slot] = start;
+    out = jit_window_enter(out, &w);
+    body = out;
+    for (i = slot; (i < slot + length) && !ends; i++)
+    {
+        interpreter_instruction *in = interp->decoded + i;
+        uint64_t size = 0;
+
+        if (in->op == BYTECODE_CALL_I)
+        {
+            out = jit_window_leave(out, &w);
+            out = jit_call(out, j->leave, i, &jumps[jump_count]);
+            targets[jump_count++] = in->target;
+            calls = 1;
+            ends = 1;
+            break;
+        }
+        if (in->op == BYTECODE_RET)
+        {
+            out = jit_window_leave(out, &w);
+            out = jit_return(out, j->leave, i);
+            ends = 1;
+            break;
+        }
+        if (in->op != INTERPRETER_OP_SLOW)
+        {
+            size = bytecode_encode_x86_64_block(out, j->buffer + j->buffer_size - out, in->bc, w.registers, w.scratch);
+        }
+        if (size == 0)
+        {
+            out = jit_window_leave(out, &w);
+            out = jit_exit(out, j->leave, i * 4, JIT_EXIT_INTERPRET);
+            ends = 1;
+            break;
+        }
+        out += size;
+
+        switch (in->bc.opcode)
+        {
+            case BYTECODE_JMP_I:
+            {
+                jumps[jump_count] = out;
+                targets[jump_count++] = in->target;
+                ends = 1;
+            }
+            break;
+
+            case BYTECODE_JE_I:
+            case BYTECODE_JNE_I:
+            case BYTECODE_JL_I:
+            case BYTECODE_JLE_I:
+            case BYTECODE_JG_I:
+            case BYTECODE_JGE_I:
+            {
+                jumps[jump_count] = out;
+                targets[jump_count++] = in->target;
+                out = x86_64_jmp(out);
+                jumps[jump_count] = out;
+                targets[jump_count++] = i + 1;
+                ends = 1;
+            }
+            break;
+
+            case BYTECODE_STR8_RA:
+            case BYTECODE_STR16_RA:
+            case BYTECODE_STR32_RA:
+            case BYTECODE_STR64_RA:
+            {
+                stores[store_count] = out;
+                store_ips[store_count++] = i * 4 + 4;
+            }
+            break;
+
+            case BYTECODE_STR8_RI:
+            case BYTECODE_STR16_RI:
+            case BYTECODE_STR32_RI:
+            case BYTECODE_STR64_RI:
+            {
+                if ((uint64_t) in->bc.imm < j->code_size)
+                {
+                    out = jit_window_leave(out, &w);
+                    out = jit_exit(out, j->leave, i * 4 + 4, JIT_EXIT_CODE_MODIFIED);
+                    ends = 1;
+                }
+            }
+            break;
+
+            case BYTECODE_CMP_RI:
+            case BYTECODE_CMP_RR:
+            {
+                if (jit_fused_condition(in->op))
+                {
+                    out = x86_64_jcc(out, jit_fused_condition(in->op));
+                    jumps[jump_count] = out;
+                    targets[jump_count++] = in[1].target;
+                }
+            }
+            break;
+        }
+    }
+    if (!ends)
+    {
+        /* Ran into an instruction for the interpreter, or off the end of the code. */
+        out = jit_window_leave(out, &w);
+        out = jit_exit(out, j->leave, i * 4, JIT_EXIT_INTERPRET);
+    }
+
+    for (i = 0; i < jump_count; i++)
+    {
+        if (calls && (i + 1 == jump_count))
+        {
+            out = jit_link_block(j, out, jumps[i], targets[i]);
+            continue;
+        }
+        if (targets[i] == slot)
+        {
+            /* Back to the top of the block, which keeps the registers. */
+            x86_64_patch_rel32(jumps[i], body);
+            continue;
+        }
+        if (w.count)
+        {
+            x86_64_patch_rel32(jumps[i], out);
+            out = jit_window_leave(out, &w);
+            jumps[i] = out = x86_64_jmp(out);
+        }
+        out = jit_link_block(j, out, jumps[i], targets[i]);
+    }
+    for (i = 0; i < store_count; i++)
+    {
+        x86_64_patch_rel32(stores[i], out);
+        out = jit_window_leave(out, &w);
+        out = jit_exit(out, j->leave, store_ips[i], JIT_EXIT_CODE_MODIFIED);
+    }
+
+    free(jumps);
+    free(targets);
+    free(stores);
+    free(store_ips);
+    return jit_finish(j, slot, start, out, length, start_ns, JIT_BLOCK_BASIC);
+}
+
+/* Register the instruction writes, BYTECODE_RIP when it writes none */
+static uint8_t jit_destination(bytecode bc)
+{
+    switch (bc.opcode)
+    {
+        case BYTECODE_STR8_RI:
+        case BYTECODE_STR16_RI:
+        case BYTECODE_STR32_RI:
+        case BYTECODE_STR64_RI:
+        case BYTECODE_STR8_RA:
+        case BYTECODE_STR16_RA:
+        case BYTECODE_STR32_RA:
+        case BYTECODE_STR64_RA:
+        case BYTECODE_CMP_RI:
+        case BYTECODE_CMP_RR:
+        case BYTECODE_JMP_I:
+        case BYTECODE_JE_I:
+        case BYTECODE_JNE_I:
+        case BYTECODE_JL_I:
+        case BYTECODE_JLE_I:
+        case BYTECODE_JG_I:
+        case BYTECODE_JGE_I:
+            return BYTECODE_RIP;
+    }
+    return bc.r0;
+}
+
+/* Only the host flags, the context keeps the flags of the previous compare */
+static uint8_t *jit_compare(uint8_t *out, bytecode bc, uint8_t const *registers)
+{
+    uint8_t lhs = registers[bc.r0];
+    if (bc.opcode == BYTECODE_CMP_RI)
+        return x86_64_imm32(x86_64_rr(out, X86_64_W, 0x81, 7, lhs), bc.imm);
+    return x86_64_rr(out, X86_64_W, 0x39, registers[bc.r1], lhs);
+}
+
+typedef struct
+{
+    uint8_t *jump;       /* End of the rel32 of the guard */
+    uint32_t target;     /* Slot the exit continues at */
+    uint32_t reason;     /* JIT_EXIT_BLOCK, or JIT_EXIT_CODE_MODIFIED */
+    int32_t pending;     /* The context flags are behind, compare is to be redone on the way out */
+    bytecode compare;
+} jit_side_exit;
+
+/*
+    Compiles the recorded path, which starts and ends at trace[0], into one native loop.
+
+    Branches become guards, which leave the loop when they go the other way than recorded.
+    Compares set only the host flags, the flags in the context are written
+    when something reads them, when the compared registers are about to change,
+    and on the way out of the loop.
+*/
+static int32_t jit_compile_trace(jit *j, interpreter *interp, uint32_t *trace, uint64_t length)
+{
+    /* Host condition of every Jcc_I, in the order of the opcodes */
+    static uint8_t const conditions[6] =
+    {
+        X86_64_CC_E, X86_64_CC_NE, X86_64_CC_B, X86_64_CC_BE, X86_64_CC_A, X86_64_CC_AE,
+    };
+    uint64_t start_ns = jit_now_ns();
+    uint64_t head = trace[0];
+    uint8_t *buffer_end = j->buffer + j->buffer_size;
+    jit_side_exit *exits;
+    uint64_t exit_count = 0;
+    uint8_t *start, *loop, *out;
+    jit_window w;
+    bytecode compare;
+    int32_t pending = 0;    /* compare is done on the host flags only */
+    int32_t live = 0;       /* The host flags are those of the last compare */
+    int32_t flags_read_first = 0;  /* The flags in the context have to be right at the head */
+    int32_t closed = 0;            /* The last branch jumps back to the head already */
+    uint64_t k;
+
+    if ((uint64_t) (buffer_end - j->cursor) < (length + 2) * JIT_SLOT_SIZE)
+    {
+        return 1;
+    }
+    jit_window_plan(&w, interp, trace, 0, length);
+    if ((uint64_t) (buffer_end - j->cursor) < (length + 2) * JIT_SLOT_SIZE + jit_window_room(&w, length))
+    {
+        jit_window_clear(&w);
+    }
+    exits = calloc(length + 1, sizeof(jit_side_exit));
+    if (exits == 0)
+    {
+        return 1;
+    }
+    if (mprotect(j->buffer, j->buffer_size, PROT_READ | PROT_WRITE) != 0)
+    {
+        free(exits);
+        return jit_error("Error: could not make the native code writable\n");
+    }
+
+    /* Whether the loop reads the flags of the previous iteration, or can leave, before its own compare. */
+    for (k = 0; k < length; k++)
+    {
+        uint8_t opcode = interp->decoded[trace[k]].bc.opcode;
+        if ((opcode == BYTECODE_CMP_RI) || (opcode == BYTECODE_CMP_RR))
+            break;
+        if (((opcode >= BYTECODE_JE_I) && (opcode <= BYTECODE_JGE_I)) ||
+            ((opcode >= BYTECODE_STR8_RA) && (opcode <= BYTECODE_STR64_RA)) ||
+            (opcode == BYTECODE_SETE_R) || (opcode == BYTECODE_SETNE_R))
+        {
+            flags_read_first = 1;
+            break;
+        }
+    }
+
+    memset(&compare, 0, sizeof(compare));
+    start = out = j->cursor;
+    out = jit_window_enter(out, &w);
+    loop = out;
+    for (k = 0; k < length; k++)
+    {
+        interpreter_instruction *in = interp->decoded + trace[k];
+        uint64_t next = (k + 1 < length) ? trace[k + 1] : head;
+        bytecode bc = in->bc;
+
+        switch (bc.opcode)
+        {
+            case BYTECODE_JMP_I:
+            break;
+
+            case BYTECODE_JE_I:
+            case BYTECODE_JNE_I:
+            case BYTECODE_JL_I:
+            case BYTECODE_JLE_I:
+            case BYTECODE_JG_I:
+            case BYTECODE_JGE_I:
+            {
+                uint8_t condition = conditions[bc.opcode - BYTECODE_JE_I];
+                int32_t taken = (next == in->target) && (next != trace[k] + 1);
+                jit_side_exit *e = exits + exit_count++;
+
+                e->target = taken ? trace[k] + 1 : in->target;
+                e->reason = JIT_EXIT_BLOCK;
+                e->pending = pending;
+                e->compare = compare;
+                if (pending && !live)
+                {
+                    out = jit_compare(out, compare, w.registers);
+                    live = 1;
+                }
+                if (live && taken && (next == head) && (k + 1 == length) && !(pending && flags_read_first))
+                {
+                    /* The back edge itself, the loop stays on the taken branch. */
+                    out = x86_64_jcc(out, condition);
+                    x86_64_patch_rel32(out, loop);
+                    out = x86_64_jmp(out);
+                    e->jump = out;
+                    closed = 1;
+                }
+                else if (live)
+                {
+                    /* Conditions come in pairs, the lowest bit negates them. */
+                    out = x86_64_jcc(out, taken ? (condition ^ 1) : condition);
+                    e->jump = out;
+                }
+                else
+                {
+                    /* The template jumps when the condition holds. */
+                    out += bytecode_encode_x86_64_block(out, buffer_end - out, bc, w.registers, w.scratch);
+                    if (taken)
+                    {
+                        uint8_t *holds = out;
+                        out = x86_64_jmp(out);
+                        x86_64_patch_rel32(holds, out);
+                    }
+                    e->jump = out;
+                }
+            }
+            break;
+
+            case BYTECODE_CMP_RI:
+            case BYTECODE_CMP_RR:
+            {
+                if ((w.registers[bc.r0] != X86_64_NONE) &&
+                    ((bc.opcode == BYTECODE_CMP_RI) || (w.registers[bc.r1] != X86_64_NONE)))
+                {
+                    out = jit_compare(out, bc, w.registers);
+                    compare = bc;
+                    pending = 1;
+                }
+                else
+                {
+                    out += bytecode_encode_x86_64_block(out, buffer_end - out, bc, w.registers, w.scratch);
+                    pending = 0;
+                }
+                live = 1;
+            }
+            break;
+
+            default:
+            {
+                uint8_t destination = jit_destination(bc);
+                uint64_t size;
+                if (pending &&
+                    ((bc.opcode == BYTECODE_SETE_R) || (bc.opcode == BYTECODE_SETNE_R) ||
+                     (destination == compare.r0) || ((compare.opcode == BYTECODE_CMP_RR) && (destination == compare.r1))))
+                {
+                    out += bytecode_encode_x86_64_block(out, buffer_end - out, compare, w.registers, w.scratch);
+                    pending = 0;
+                }
+
+                size = bytecode_encode_x86_64_block(out, buffer_end - out, bc, w.registers, w.scratch);
+                if (size == 0)
+                {
+                    /* The recorder does not let such instructions in. */
+                    free(exits);
+                    mprotect(j->buffer, j->buffer_size, PROT_READ | PROT_EXEC);
+                    return 1;
+                }
+                out += size;
+                live = 0;
+
+                if ((bc.opcode >= BYTECODE_STR8_RA) && (bc.opcode <= BYTECODE_STR64_RA))
+                {
+                    jit_side_exit *e = exits + exit_count++;
+                    e->jump = out;
+                    e->target = trace[k] + 1;
+                    e->reason = JIT_EXIT_CODE_MODIFIED;
+                    e->pending = pending;
+                    e->compare = compare;
+                }
+            }
+            break;
+        }
+    }
+    if (!closed)
+    {
+        if (pending && flags_read_first)
+        {
+            out += bytecode_encode_x86_64_block(out, buffer_end - out, compare, w.registers, w.scratch);
+        }
+        out = x86_64_jmp(out);
+        x86_64_patch_rel32(out, loop);
+    }
+
+    for (k = 0; k < exit_count; k++)
+    {
+        jit_side_exit *e = exits + k;
+        x86_64_patch_rel32(e->jump, out);
+        if (e->pending)
+        {
+            out += bytecode_encode_x86_64_block(out, buffer_end - out, e->compare, w.registers, w.scratch);
+        }
+        out = jit_window_leave(out, &w);
+        if (e->reason == JIT_EXIT_BLOCK)
+        {
+            out = x86_64_jmp(out);
+            out = jit_link_block(j, out, out, e->target);
+        }
+        else
+        {
+            out = jit_exit(out, j->leave, e->target * 4, e->reason);
+        }
+    }
+    free(exits);
+
+    return jit_finish(j, head, start, out, length, start_ns, JIT_BLOCK_TRACE);
+}
+
+/*
+    Executes the program with interpreter_step from the hot slot, remembering the slots it goes through.
+    When it comes back to the hot slot, the path gets compiled into a trace, and *compiled is set.
+    Leaving the code, calls, instructions for interpreter_step, stores into the code and too long paths give up.
+    Returns the interpreter_step result.
+*/
+static int32_t jit_record_trace(jit *j, interpreter *interp, uint64_t head, int32_t *compiled)
+{
+    uint32_t trace[JIT_TRACE_LENGTH];
+    uint64_t length = 0;
+    uint32_t code_version = interp->code_version;
+    *compiled = 0;
+    for (;;)
+    {
+        uint64_t ip = interp->registers[BYTECODE_RIP];
+        interpreter_instruction *in;
+        int32_t ec;
+
+        if ((ip >= j->code_size) || (ip & 0x3))
+        {
+            return 0;
+        }
+        if ((ip / 4 == head) && (length > 0))
+        {
+            *compiled = (jit_compile_trace(j, interp, trace, length) == 0);
+            return 0;
+        }
+
+        in = interp->decoded + ip / 4;
+        if ((length == JIT_TRACE_LENGTH) || (in->op == INTERPRETER_OP_SLOW))
+        {
+            return 0;
+        }
+        if ((in->op == BYTECODE_CALL_I) || (in->op == BYTECODE_RET))
+        {
+            /* Traces stay in one frame, the slot gets a basic block, which keeps CALL and RET native. */
+            return 0;
+        }
+        if ((in->bc.opcode >= BYTECODE_STR8_RI) && (in->bc.opcode <= BYTECODE_STR64_RI) && ((uint64_t) in->bc.imm < j->code_size))
+        {
+            return 0;
+        }
+
+        trace[length++] = ip / 4;
+        ec = interpreter_step(interp);
+        if ((ec != 0) || (interp->code_version != code_version))
+        {
+            return ec;
+        }
+    }
+}
+
+/* Runs the native code at the slot of IP until it exits, returns the exit reason. */
+static uint64_t jit_enter(jit *j, interpreter *interp)
+{
+    jit_context *context = &j->context;
+    void (*enter)(jit_context *) = (void (*)(jit_context *)) j->buffer;
+    uint64_t flags = interpreter_flags(interp);
+
+    memcpy(context->registers, interp->registers, sizeof(context->registers));
+    memset(context->flags, 0, sizeof(context->flags));
+    context->flags[0] = (flags & INTERPRETER_FLAG_LESS) > 0;
+    context->flags[1] = (flags & INTERPRETER_FLAG_EQUAL) > 0;
+    context->flags[2] = (flags & INTERPRETER_FLAG_MORE) > 0;
+    context->code_size = j->code_size;
+    context->memory = interp->memory;
+    context->entry = j->entries[interp->registers[BYTECODE_RIP] / 4];
+    context->memory_size = interp->memory_size;
+    context->entries = j->entries;
+
+    enter(context);
+
+    memcpy(interp->registers, context->registers, sizeof(context->registers));
+    interp->registers[BYTECODE_RIP] = context->exit_ip;
+    interp->flags = (context->flags[0] ? INTERPRETER_FLAG_LESS : 0) |
+                    (context->flags[1] ? INTERPRETER_FLAG_EQUAL : 0) |
+                    (context->flags[2] ? INTERPRETER_FLAG_MORE : 0);
+    interp->compare_kind = INTERPRETER_COMPARE_NONE;
+
+    if (context->exit_reason == JIT_EXIT_CODE_MODIFIED)
+    {
+        /* Re-decoding bumps code_version, which drops the native code. */
+        interpreter_invalidate(interp, 0, interp->decoded_size);
+    }
+    return context->exit_reason;
+}
+
+static int32_t jit_is_stale(jit *j, interpreter *interp)
+{
+    return (j->buffer == 0) || (j->code_version != interp->code_version) || (j->code_size != interp->decoded_size);
+}
+
+static int32_t jit_has_native(jit *j, uint64_t ip)
+{
+    return (ip < j->code_size) && ((ip & 0x3) == 0) && (j->entries[ip / 4] != 0);
+}
+
+int32_t jit_run(jit *j, interpreter *interp)
+{
+    int32_t ec = 0;
+    while (ec == 0)
+    {
+        if (jit_is_stale(j, interp))
+        {
+            ec = jit_compile(j, interp);
+            if (ec != 0)
+            {
+                return ec;
+            }
+        }
+
+        if (jit_has_native(j, interp->registers[BYTECODE_RIP]))
+        {
+            if (jit_enter(j, interp) != JIT_EXIT_INTERPRET)
+            {
+                continue;
+            }
+        }
+
+        ec = interpreter_step(interp);
+    }
+    return ec;
+}
+
+/* The slot got hot: compile a trace from it, or a basic block when the path does not come back to it. */
+static int32_t jit_tier_up(jit *j, interpreter *interp, uint64_t slot, int32_t traces)
+{
+    int32_t compiled = 0;
+    int32_t ec = 0;
+    if (j->entries[slot])
+    {
+        return 0;
+    }
+
+    if (traces)
+    {
+        ec = jit_record_trace(j, interp, slot, &compiled);
+    }
+    if (!compiled && (ec == 0) && !jit_is_stale(j, interp) && (jit_compile_block(j, interp, slot) != 0))
+    {
+        /* Try again after as many hits, instead of stopping at every one. */
+        interp->decoded[slot].hits = 0;
+    }
+    return ec;
+}
+
+static int32_t jit_run_hot(jit *j, interpreter *interp, uint32_t hot_threshold, int32_t traces)
+{
+    int32_t ec = 0;
+    interp->hot_threshold = hot_threshold;
+    while (ec == 0)
+    {
+        if (jit_is_stale(j, interp))
+        {
+            ec = jit_prepare(j, interp, 2 * (interp->decoded_size / 4 + 1) * JIT_SLOT_SIZE);
+            if (ec != 0)
+            {
+                break;
+            }
+        }
+
+        if (jit_has_native(j, interp->registers[BYTECODE_RIP]))
+        {
+            uint64_t reason = jit_enter(j, interp);
+            uint64_t ip = interp->registers[BYTECODE_RIP];
+            if (reason == JIT_EXIT_INTERPRET)
+            {
+                ec = interpreter_step(interp);
+            }
+            else if ((reason == JIT_EXIT_BLOCK) && (ip < j->code_size))
+            {
+                /* Jumps out of the native code count like the interpreted ones. */
+                interp->decoded[ip / 4].hits += 1;
+                if (interp->decoded[ip / 4].hits >= hot_threshold)
+                    ec = jit_tier_up(j, interp, ip / 4, traces);
+            }
+            continue;
+        }
+
+        ec = interpreter_run(interp, UINT64_MAX);
+        if (ec == INTERPRETER_HOT_BLOCK)
+        {
+            ec = jit_tier_up(j, interp, interp->registers[BYTECODE_RIP] / 4, traces);
+        }
+        else if (ec == INTERPRETER_BUDGET_EXHAUSTED)
+        {
+            ec = 0;
+        }
+    }
+    interp->hot_threshold = 0;
+    return ec;
+}
+
+int32_t jit_run_tiered(jit *j, interpreter *interp, uint32_t hot_threshold)
+{
+    return jit_run_hot(j, interp, hot_threshold, 0);
+}
+
+int32_t jit_run_traced(jit *j, interpreter *interp, uint32_t hot_threshold)
+{
+    return jit_run_hot(j, interp, hot_threshold, 1);
+}
+
+void jit_print_stats(jit *j)
+{
+    uint64_t total_ns = 0;
+    uint64_t i;
+    for (i = 0; i < j->block_count; i++)
+    {
+        total_ns += j->blocks[i].compile_ns;
+    }
+
+    printf("JIT: %lu block(s) compiled in %lu ns\n", j->block_count, total_ns);
+    if (j->block_count > 0)
+    {
+        printf("    Address      | Kind  | Instructions | Native bytes | Compile ns\n");
+    }
+    for (i = 0; i < j->block_count; i++)
+    {
+        printf("    0x%010lx | %s | %12lu | %12lu | %10lu\n",
+               j->blocks[i].address,
+               (j->blocks[i].kind == JIT_BLOCK_TRACE) ? "trace" : "block",
+               j->blocks[i].instruction_count,
+               j->blocks[i].native_size,
+               j->blocks[i].compile_ns);
+    }
+}
+
+void jit_release(jit *j)
+{
+    if (j->buffer)
+    {
+        munmap(j->buffer, j->buffer_size);
+    }
+    free(j->entries);
+    free(j->links);
+    free(j->blocks);
+    memset(j, 0, sizeof(jit));
+}
+
+
+#undef JIT_ENTER_LEAVE_SIZE
+#undef JIT_TRACE_LENGTH
@@ -0,0 +1,139 @@
+#ifndef PINAPL_JIT_H_
+#define PINAPL_JIT_H_
+
+/*
+                                    JIT
+
+    Template compiler of the pre-decoded code region into x86-64.
+    Every slot of interp->decoded gets the native code made by
+    bytecode_encode_x86_64, jumps inside the region are linked
+    directly to the native code of their destination.
+
+    Instructions the templates do not cover (SYSCALL, r15 operands, ...)
+    leave the native code, jit_run executes them with interpreter_step and enters
+    the native code again at the next instruction.
+
+    CALL and RET stay in the native code: the return address goes on the guest
+    stack at r13 like in the interpreter, and RET looks the address it pops up
+    in the entries of the slots. They leave only when the stack pointer is out
+    of the memory or the push lands in the code, for interpreter_step to report
+    or re-decode, and RET when the slot it returns to has no native code yet.
+    The shadow return stack of the interpreter does not see them.
+
+    Stores into the code region also leave the native code, the code gets
+    re-decoded and compiled anew, so self-modifying code behaves like in the interpreter.
+
+    jit_run_tiered starts with the interpreter instead, and compiles only the
+    basic blocks that become hot (see interpreter.hot_threshold). Blocks run
+    up to their first jump, exits to blocks compiled later are linked to them
+    as soon as they are.
+
+    jit_run_traced records the path the program takes from a hot slot instead,
+    and when the path comes back to the slot, compiles it into one native loop
+    where branches are guards leaving the loop. Hot slots that do not start
+    a loop get a basic block.
+*/
+
+#include <stdint.h>
+#include "bytecode.h"
+#include "interpreter.h"
+
+
+enum
+{
+    JIT_EXIT_INTERPRET = 0,     /* Execute the instruction at exit_ip with interpreter_step */
+    JIT_EXIT_CODE_MODIFIED = 1, /* A store landed in the code region, continue at exit_ip after recompiling */
+    JIT_EXIT_BLOCK = 2,         /* Left the compiled block, continue at exit_ip */
+};
+
+/* Layout of the first fields is fixed by BYTECODE_X86_64_CONTEXT_* */
+typedef struct
+{
+    uint64_t registers[BYTECODE_REGISTER_COUNT];
+    uint8_t flags[8];       /* less, equal, more */
+    uint64_t code_size;
+    uint8_t *memory;
+    uint64_t exit_ip;
+    uint64_t exit_reason;
+    void *entry;            /* Native code jit_enter jumps to, RET goes through it too */
+    uint64_t memory_size;
+    uint8_t **entries;      /* Native code of every slot for RET, 0 when not compiled */
+} jit_context;
+
+enum
+{
+    JIT_CONTEXT_MEMORY      = 0x110,
+    JIT_CONTEXT_EXIT_IP     = 0x118,
+    JIT_CONTEXT_EXIT_REASON = 0x120,
+    JIT_CONTEXT_ENTRY       = 0x128,
+    JIT_CONTEXT_MEMORY_SIZE = 0x130,
+    JIT_CONTEXT_ENTRIES     = 0x138,
+};
+
+/* Room for the exits and the fused branch that come with the instruction template */
+enum
+{
+    JIT_SLOT_SIZE = BYTECODE_X86_64_MAX_SIZE + 96,
+};
+
+enum
+{
+    JIT_BLOCK_BASIC = 0, /* Instructions up to the first jump */
+    JIT_BLOCK_TRACE = 1, /* Recorded path around a loop, see jit_run_traced */
+};
+
+typedef struct
+{
+    uint64_t address;           /* Bytecode address of the first instruction */
+    uint64_t instruction_count;
+    uint64_t native_size;
+    uint64_t compile_ns;
+    uint32_t kind;
+} jit_block;
+
+typedef struct
+{
+    uint8_t *jump;   /* End of the rel32 of a jump to the exit stub of the block at target */
+    uint32_t target;
+} jit_link;
+
+typedef struct
+{
+    uint8_t *buffer;
+    uint64_t buffer_size;
+    uint8_t *leave;         /* Common exit, stores the registers and returns to jit_run */
+    uint8_t *cursor;        /* Free space for more code */
+    uint8_t **entries;      /* Native code of a slot, 0 when not compiled */
+    uint64_t code_size;
+    uint32_t code_version;  /* interp->code_version the buffer was compiled from */
+
+    jit_link *links;        /* Exits waiting for their destination to be compiled */
+    uint64_t link_count;
+    uint64_t link_capacity;
+
+    jit_block *blocks;      /* Every block compiled by jit_run_tiered, kept across recompilation */
+    uint64_t block_count;
+    uint64_t block_capacity;
+
+    jit_context context;
+} jit;
+
+
+int32_t jit_compile(jit *j, interpreter *interp);
+/*
+    Compiles every slot of the code region at j->cursor, with jumps linked to their
+    destinations and exits going to j->leave. The caller provides the buffer with
+    JIT_SLOT_SIZE bytes per slot and one more, and j->entries with a pointer per slot and one more.
+    The blocks keep the wide registers in host registers only as far as there is room
+    beyond that, twice as much is enough for most code.
+*/
+int32_t jit_compile_region(jit *j, interpreter *interp);
+int32_t jit_compile_block(jit *j, interpreter *interp, uint64_t slot);
+int32_t jit_run(jit *j, interpreter *interp);
+int32_t jit_run_tiered(jit *j, interpreter *interp, uint32_t hot_threshold);
+int32_t jit_run_traced(jit *j, interpreter *interp, uint32_t hot_threshold);
+void jit_print_stats(jit *j);
+void jit_release(jit *j);
+
+
+#endif /* PINAPL_JIT_H_ */
@@ -0,0 +1,285 @@
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static int32_t pool_error(char const *msg)
+{
+    printf("%s", msg);
+    return 1;
+}
+
+static int32_t pool_deque_init(pool_deque *d)
+{
+    d->jobs = calloc(POOL_DEQUE_CAPACITY, sizeof(pool_job *));
+    if (d->jobs == 0)
+    {
+        return pool_error("Error: could not allocate memory for the job deque\n");
+    }
+    d->capacity = POOL_DEQUE_CAPACITY;
+    d->head = 0;
+    d->count = 0;
+    pthread_mutex_init(&d->lock, 0);
+    return 0;
+}
+
+static void pool_deque_release(pool_deque *d)
+{
+    pthread_mutex_destroy(&d->lock);
+    free(d->jobs);
+    memset(d, 0, sizeof(*d));
+}
+
+static int32_t pool_deque_push_tail(pool_deque *d, pool_job *job)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->capacity)
+    {
+        /* Unroll the ring into twice the room */
+        pool_job **jobs = malloc(2 * d->capacity * sizeof(pool_job *));
+        uint64_t i;
+        if (jobs == 0)
+        {
+            pthread_mutex_unlock(&d->lock);
+            return pool_error("Error: could not allocate memory for the job deque\n");
+        }
+        for (i = 0; i < d->count; i++)
+            jobs[i] = d->jobs[(d->head + i) & (d->capacity - 1)];
+        free(d->jobs);
+        d->jobs = jobs;
+        d->capacity = 2 * d->capacity;
+        d->head = 0;
+    }
+    d->jobs[(d->head + d->count) & (d->capacity - 1)] = job;
+    d->count += 1;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+static pool_job *pool_deque_pop_head(pool_deque *d)
+{
+    pool_job *job = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0)
+    {
+        job = d->jobs[d->head];
+        d->head = (d->head + 1) & (d->capacity - 1);
+        d->count -= 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+static pool_job *pool_deque_pop_tail(pool_deque *d)
+{
+    pool_job *job = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0)
+    {
+        d->count -= 1;
+        job = d->jobs[(d->head + d->count) & (d->capacity - 1)];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+
+/* The job is in a deque already, counts it and wakes a sleeping worker to take it. */
+static void pool_announce(pool *p)
+{
+    __atomic_add_fetch(&p->runnable, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->sleepers, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_signal(&p->wake);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static pool_job *pool_find(pool_worker *w)
+{
+    pool *p = w->pool;
+    pool_job *job = pool_deque_pop_head(&w->deque);
+    uint32_t i;
+    if (job == 0)
+    {
+        /* xorshift, so the thieves do not all line up behind the same victim */
+        w->random ^= w->random << 13;
+        w->random ^= w->random >> 17;
+        w->random ^= w->random << 5;
+        for (i = 0; (i < p->worker_count) && (job == 0); i++)
+        {
+            pool_worker *victim = p->workers + (w->random + i) % p->worker_count;
+            if (victim != w)
+            {
+                job = pool_deque_pop_tail(&victim->deque);
+            }
+        }
+        if (job)
+        {
+            __atomic_add_fetch(&p->steals, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (job)
+    {
+        __atomic_sub_fetch(&p->runnable, 1, __ATOMIC_SEQ_CST);
+    }
+    return job;
+}
+
+static void *pool_work(void *argument)
+{
+    pool_worker *w = argument;
+    pool *p = w->pool;
+    for (;;)
+    {
+        pool_job *job = pool_find(w);
+        int32_t ec;
+        if (job == 0)
+        {
+            int32_t stopping;
+            pthread_mutex_lock(&p->lock);
+            __atomic_add_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+            while ((__atomic_load_n(&p->runnable, __ATOMIC_SEQ_CST) == 0) && !p->stopping)
+            {
+                pthread_cond_wait(&p->wake, &p->lock);
+            }
+            __atomic_sub_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+            stopping = p->stopping && (__atomic_load_n(&p->runnable, __ATOMIC_SEQ_CST) == 0);
+            pthread_mutex_unlock(&p->lock);
+            if (stopping)
+            {
+                return 0;
+            }
+            continue;
+        }
+
+        ec = interpreter_run(job->interp, p->budget);
+        job->slices += 1;
+        if (ec == INTERPRETER_BUDGET_EXHAUSTED)
+        {
+            /* Out of budget, behind everything else in the deque */
+            __atomic_add_fetch(&p->preemptions, 1, __ATOMIC_RELAXED);
+            if (pool_deque_push_tail(&w->deque, job) == 0)
+            {
+                pool_announce(p);
+                continue;
+            }
+            ec = 1;
+        }
+
+        job->status = ec;
+        interpreter_flush(job->interp);
+        pthread_mutex_lock(&p->lock);
+        p->completed += 1;
+        p->unfinished -= 1;
+        if (p->unfinished == 0)
+        {
+            pthread_cond_broadcast(&p->finished);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/* Stops the first started workers, and releases everything */
+static void pool_stop(pool *p, uint32_t started)
+{
+    uint32_t i;
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < started; i++)
+        pthread_join(p->workers[i].thread, 0);
+    for (i = 0; i < p->worker_count; i++)
+        pool_deque_release(&p->workers[i].deque);
+    pthread_cond_destroy(&p->finished);
+    pthread_cond_destroy(&p->wake);
+    pthread_mutex_destroy(&p->lock);
+    free(p->workers);
+    p->workers = 0;
+    p->worker_count = 0;
+}
+
+int32_t pool_create(pool *p, uint32_t worker_count, uint64_t budget)
+{
+    uint32_t i;
+    memset(p, 0, sizeof(*p));
+    if ((worker_count == 0) || (worker_count > POOL_MAX_WORKERS) || (budget == 0))
+    {
+        return pool_error("Error: a pool needs 1 to 256 workers and a budget\n");
+    }
+    p->workers = calloc(worker_count, sizeof(pool_worker));
+    if (p->workers == 0)
+    {
+        return pool_error("Error: could not allocate memory for the workers\n");
+    }
+    p->budget = budget;
+    pthread_mutex_init(&p->lock, 0);
+    pthread_cond_init(&p->wake, 0);
+    pthread_cond_init(&p->finished, 0);
+
+    /* Every deque exists before any worker looks for a victim */
+    for (; p->worker_count < worker_count; p->worker_count++)
+    {
+        pool_worker *w = p->workers + p->worker_count;
+        w->pool = p;
+        w->index = p->worker_count;
+        w->random = 2654435761u * (p->worker_count + 1);
+        if (pool_deque_init(&w->deque) != 0)
+        {
+            pool_stop(p, 0);
+            return 1;
+        }
+    }
+    for (i = 0; i < worker_count; i++)
+    {
+        if (pthread_create(&p->workers[i].thread, 0, pool_work, p->workers + i) != 0)
+        {
+            pool_stop(p, i);
+            return pool_error("Error: could not start a worker thread\n");
+        }
+    }
+    return 0;
+}
+
+int32_t pool_submit(pool *p, pool_job *job)
+{
+    uint32_t next;
+    job->status = 0;
+    job->slices = 0;
+
+    pthread_mutex_lock(&p->lock);
+    p->unfinished += 1;
+    next = p->next_worker;
+    p->next_worker = (next + 1) % p->worker_count;
+    pthread_mutex_unlock(&p->lock);
+
+    if (pool_deque_push_tail(&p->workers[next].deque, job) != 0)
+    {
+        pthread_mutex_lock(&p->lock);
+        p->unfinished -= 1;
+        pthread_mutex_unlock(&p->lock);
+        return 1;
+    }
+    pool_announce(p);
+    return 0;
+}
+
+void pool_wait(pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->unfinished > 0)
+    {
+        pthread_cond_wait(&p->finished, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy(pool *p)
+{
+    pool_wait(p);
+    pool_stop(p, p->worker_count);
+}
@@ -0,0 +1,96 @@
+#ifndef PINAPL_POOL_H_
+#define PINAPL_POOL_H_
+
+/*
+                                    Pool
+
+    Runs many independent interpreter instances on worker threads.
+
+    Every worker owns a deque of jobs. It takes the job at the head, runs it
+    for about budget instructions with interpreter_run, and puts it back at
+    the tail when it is not finished, so a long job only gets its turn between
+    the others in the deque and never holds a worker for longer than a budget.
+    A worker with an empty deque steals the job at the tail of another one,
+    and sleeps when there is nothing to steal anywhere.
+
+    A job is finished when interpreter_run returns anything but
+    INTERPRETER_BUDGET_EXHAUSTED: the exit syscall, an error, a fault. Its output is flushed right away.
+    Instances have to leave hot_threshold at 0, and must not be shared between jobs.
+*/
+
+#include <stdint.h>
+#include <pthread.h>
+#include "interpreter.h"
+
+
+enum
+{
+    POOL_MAX_WORKERS = 256,
+    POOL_DEQUE_CAPACITY = 64, /* Initial one, the deques grow */
+};
+
+typedef struct
+{
+    interpreter *interp;
+    int32_t status;     /* What interpreter_run returned at the end */
+    uint64_t slices;    /* Budgets the job ran, every one but the last is a preemption */
+} pool_job;
+
+/* Ring of jobs, the owner takes from the head and thieves from the tail */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pool_job **jobs;
+    uint64_t capacity;  /* A power of two */
+    uint64_t head;
+    uint64_t count;
+} pool_deque;
+
+struct pool;
+
+typedef struct
+{
+    struct pool *pool;
+    pthread_t thread;
+    pool_deque deque;
+    uint32_t index;
+    uint32_t random;    /* Where to start looking for a victim */
+} pool_worker;
+
+typedef struct pool
+{
+    pool_worker *workers;
+    uint32_t worker_count;
+    uint64_t budget;
+    uint32_t next_worker;   /* pool_submit deals the jobs out in turn */
+
+    /*
+        runnable counts the jobs sitting in the deques. Workers sleep on wake
+        when it is 0, and whoever queues a job wakes one when sleepers says
+        somebody sleeps. Both are atomic, the rest is under lock.
+    */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t finished;
+    uint64_t runnable;
+    uint32_t sleepers;
+    uint64_t unfinished;
+    int32_t stopping;
+
+    /* Totals since pool_create */
+    uint64_t completed;
+    uint64_t preemptions;
+    uint64_t steals;
+} pool;
+
+
+/* budget is the number of instructions a job runs before the next one gets the worker */
+int32_t pool_create(pool *p, uint32_t worker_count, uint64_t budget);
+int32_t pool_submit(pool *p, pool_job *job);
+/* Waits until every job submitted so far is finished */
+void pool_wait(pool *p);
+/* Waits for the jobs and stops the workers */
+void pool_destroy(pool *p);
+
+
+#endif /* PINAPL_POOL_H_ */
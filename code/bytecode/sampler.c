@@ -0,0 +1,278 @@
+#include "sampler.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+
+static volatile sig_atomic_t sampler_ticks;
+static struct sigaction sampler_previous_action;
+
+static int32_t sampler_error(char const *msg)
+{
+    printf("%s", msg);
+    return 1;
+}
+
+static void sampler_tick(int signal_number)
+{
+    (void) signal_number;
+    sampler_ticks += 1;
+}
+
+int32_t sampler_start(sampler *s, uint32_t frequency)
+{
+    struct sigaction action;
+    struct itimerval timer;
+
+    memset(s, 0, sizeof(*s));
+    if ((frequency == 0) || (frequency > 1000000))
+    {
+        return sampler_error("Error: sampling frequency has to be 1 to 1000000 per second\n");
+    }
+    s->frequency = frequency;
+    s->seen_ticks = (uint32_t) sampler_ticks;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sampler_tick;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &sampler_previous_action) != 0)
+    {
+        return sampler_error("Error: could not install the SIGPROF handler\n");
+    }
+
+    memset(&timer, 0, sizeof(timer));
+    /* tv_usec has to stay below a second, so 1 Hz is spelled as one whole second */
+    timer.it_interval.tv_sec = 1 / frequency;
+    timer.it_interval.tv_usec = (1000000 / frequency) % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, 0) != 0)
+    {
+        sigaction(SIGPROF, &sampler_previous_action, 0);
+        return sampler_error("Error: could not start the profiling timer\n");
+    }
+    return 0;
+}
+
+void sampler_stop(sampler *s)
+{
+    struct itimerval timer;
+    (void) s;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, 0);
+    sigaction(SIGPROF, &sampler_previous_action, 0);
+}
+
+void sampler_release(sampler *s)
+{
+    free(s->samples);
+    memset(s, 0, sizeof(*s));
+}
+
+static int32_t sampler_reserve(sampler *s, uint64_t count)
+{
+    if (s->size + count > s->capacity)
+    {
+        uint64_t capacity = s->capacity ? 2 * s->capacity : 0x1000;
+        uint64_t *samples;
+        while (capacity < s->size + count)
+            capacity = 2 * capacity;
+        samples = realloc(s->samples, capacity * sizeof(uint64_t));
+        if (samples == 0)
+        {
+            return 1;
+        }
+        s->samples = samples;
+        s->capacity = capacity;
+    }
+    return 0;
+}
+
+/*
+    The stack walks down the return stack ring from its top, over the calls still in
+    progress (the ring keeps the entries RET popped), until an unknown address.
+*/
+static void sampler_record(sampler *s, interpreter *interp, uint32_t ticks)
+{
+    uint64_t *sample;
+    uint32_t depth = 0;
+    uint32_t top = interp->return_top;
+
+    if (s->failed)
+    {
+        return;
+    }
+    if (sampler_reserve(s, 3 + INTERPRETER_RETURN_STACK_SIZE) != 0)
+    {
+        s->failed = 1;
+        sampler_error("Error: could not allocate memory for the samples\n");
+        return;
+    }
+    sample = s->samples + s->size;
+    sample[2] = interp->registers[BYTECODE_RIP];
+    for (; depth < interp->return_depth; depth++)
+    {
+        uint64_t address = interp->return_stack[top];
+        if (address == UINT64_MAX)
+            break;
+        sample[3 + depth] = address;
+        top = (top - 1) & (INTERPRETER_RETURN_STACK_SIZE - 1);
+    }
+    sample[0] = 1 + depth;
+    sample[1] = ticks;
+    s->size += 2 + sample[0];
+    s->sample_count += 1;
+    s->tick_count += ticks;
+}
+
+int32_t sampler_run(sampler *s, interpreter *interp)
+{
+    int32_t ec;
+    do
+    {
+        uint32_t ticks;
+        ec = interpreter_run(interp, SAMPLER_SLICE);
+        ticks = (uint32_t) sampler_ticks - s->seen_ticks;
+        if (ticks > 0)
+        {
+            s->seen_ticks += ticks;
+            sampler_record(s, interp, ticks);
+        }
+    }
+    while (ec == INTERPRETER_BUDGET_EXHAUSTED);
+    return ec;
+}
+
+
+typedef struct
+{
+    char *stack;
+    uint64_t ticks;
+} sampler_line;
+
+static int sampler_compare_labels(void const *a, void const *b)
+{
+    bytecode_image_label const *x = a;
+    bytecode_image_label const *y = b;
+    return (x->address > y->address) - (x->address < y->address);
+}
+
+static int sampler_compare_lines(void const *a, void const *b)
+{
+    return strcmp(((sampler_line const *) a)->stack, ((sampler_line const *) b)->stack);
+}
+
+/* Closest label at or below the address, labels sorted by address */
+static char const *sampler_name(bytecode_image_label const *labels, uint64_t label_count, uint64_t address, char *buffer)
+{
+    uint64_t low = 0;
+    uint64_t high = label_count;
+    while (low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+        if (labels[middle].address <= address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == 0)
+    {
+        sprintf(buffer, "0x%llx", (unsigned long long) address);
+        return buffer;
+    }
+    return labels[low - 1].name;
+}
+
+/* Frames of one sample outermost first, separated by ';' */
+static char *sampler_fold(uint64_t const *sample, bytecode_image_label const *labels, uint64_t label_count)
+{
+    char buffer[32];
+    uint64_t length = 0;
+    uint64_t frame;
+    char *stack;
+
+    for (frame = 0; frame < sample[0]; frame++)
+        length += strlen(sampler_name(labels, label_count, sample[2 + frame], buffer)) + 1;
+    stack = malloc(length + 1);
+    if (stack == 0)
+    {
+        return 0;
+    }
+    length = 0;
+    for (frame = sample[0]; frame > 0; frame--)
+    {
+        char const *name = sampler_name(labels, label_count, sample[2 + frame - 1], buffer);
+        uint64_t name_size = strlen(name);
+        memcpy(stack + length, name, name_size);
+        length += name_size;
+        stack[length++] = ';';
+    }
+    stack[length - 1] = 0;
+    return stack;
+}
+
+int32_t sampler_write_folded(sampler *s, char const *filename, bytecode_image_label const *labels, uint64_t label_count)
+{
+    bytecode_image_label *sorted = malloc((label_count + 1) * sizeof(bytecode_image_label));
+    sampler_line *lines = malloc((s->sample_count + 1) * sizeof(sampler_line));
+    uint64_t line_count = 0;
+    uint64_t offset = 0;
+    int32_t ec = 0;
+    uint64_t i;
+    FILE *file;
+
+    if ((sorted == 0) || (lines == 0))
+    {
+        free(sorted);
+        free(lines);
+        return sampler_error("Error: could not allocate memory for the folded stacks\n");
+    }
+    memcpy(sorted, labels, label_count * sizeof(bytecode_image_label));
+    qsort(sorted, label_count, sizeof(bytecode_image_label), sampler_compare_labels);
+
+    for (i = 0; i < s->sample_count; i++)
+    {
+        uint64_t const *sample = s->samples + offset;
+        lines[line_count].stack = sampler_fold(sample, sorted, label_count);
+        lines[line_count].ticks = sample[1];
+        if (lines[line_count].stack == 0)
+        {
+            ec = sampler_error("Error: could not allocate memory for the folded stacks\n");
+            break;
+        }
+        line_count += 1;
+        offset += 2 + sample[0];
+    }
+    qsort(lines, line_count, sizeof(sampler_line), sampler_compare_lines);
+
+    file = (ec == 0) ? fopen(filename, "w") : 0;
+    if ((ec == 0) && (file == 0))
+    {
+        ec = sampler_error("Error: could not open the folded stacks file\n");
+    }
+    if (file)
+    {
+        /* Equal stacks are next to each other now, one line for all of them */
+        for (i = 0; i < line_count; )
+        {
+            uint64_t ticks = 0;
+            uint64_t j = i;
+            for (; (j < line_count) && (strcmp(lines[j].stack, lines[i].stack) == 0); j++)
+                ticks += lines[j].ticks;
+            fprintf(file, "%s %llu\n", lines[i].stack, (unsigned long long) ticks);
+            i = j;
+        }
+        if (fclose(file) != 0)
+        {
+            ec = sampler_error("Error: could not write the folded stacks file\n");
+        }
+    }
+
+    for (i = 0; i < line_count; i++)
+        free(lines[i].stack);
+    free(lines);
+    free(sorted);
+    return ec;
+}
@@ -0,0 +1,65 @@
+#ifndef PINAPL_SAMPLER_H_
+#define PINAPL_SAMPLER_H_
+
+/*
+                                    Sampler
+
+    Statistical profile of the guest code, to see which labels the time goes to.
+
+    setitimer(ITIMER_PROF) sends SIGPROF frequency times per second of CPU time,
+    and the handler does nothing but count it. sampler_run runs the interpreter
+    in slices of SAMPLER_SLICE instructions, and after a slice in which the timer
+    went off records where the guest is: IP and the return addresses of the shadow
+    return stack, as deep as it remembers them (INTERPRETER_RETURN_STACK_SIZE).
+    So a sample lands up to one slice, some microseconds, after its tick, and the
+    run loop does not know it is being sampled.
+
+    sampler_write_folded names every address after the closest label at or below it,
+    and writes one line per different stack, outermost frame first, with its ticks:
+        main;fib;fib 12
+    which is the input of flamegraph.pl.
+
+    The timer and the signal are per process, so one sampler runs at a time.
+    The kernel rounds the interval up to its own tick, 250 Hz on some machines,
+    the ticks in the output are the ones that really happened.
+*/
+
+#include <stdint.h>
+#include "interpreter.h"
+#include "image.h"
+
+
+enum
+{
+    SAMPLER_SLICE = 10000,
+    SAMPLER_DEFAULT_FREQUENCY = 1000,
+};
+
+typedef struct
+{
+    /*
+        Every sample one after another: the number of frames, the ticks,
+        then IP and the return addresses, the innermost frame first.
+    */
+    uint64_t *samples;
+    uint64_t size;
+    uint64_t capacity;
+    uint64_t sample_count;
+    uint64_t tick_count;
+
+    uint32_t frequency;
+    uint32_t seen_ticks;
+    int32_t failed;         /* Out of memory, the samples after that are lost */
+} sampler;
+
+
+/* Starts the timer, frequency in samples per second of CPU time */
+int32_t sampler_start(sampler *s, uint32_t frequency);
+/* Runs the interpreter until it stops, returns what interpreter_run returned last */
+int32_t sampler_run(sampler *s, interpreter *interp);
+void sampler_stop(sampler *s);
+int32_t sampler_write_folded(sampler *s, char const *filename, bytecode_image_label const *labels, uint64_t label_count);
+void sampler_release(sampler *s);
+
+
+#endif /* PINAPL_SAMPLER_H_ */
@@ -0,0 +1,109 @@
+#define _DEFAULT_SOURCE /* clock_gettime, sigaction, MAP_ANONYMOUS */
+/*
+    Prints a trace file that interpreter_trace_write made, the oldest instruction first:
+
+               #   address  operation       value
+            4091  0x000020  ADD_RRR         r2 = 0x3d
+            4092  0x000024  MOV_RR_MOV_RR   r0 = 0x25
+            4093  0x00002c  CMP_RI_JL
+
+    With a count, only the last that many instructions.
+        gcc -std=c89 -Icode/ -o bin/trace_decode code/bytecode/trace_decode.c
+        bin/trace_decode ir0.trace 100
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interpreter.h"
+
+
+static int32_t trace_decode_error(char const *msg)
+{
+    printf("%s", msg);
+    return 1;
+}
+
+/* Operations that leave their result in r0 */
+static int32_t trace_decode_writes_register(uint8_t op)
+{
+    if ((op == BYTECODE_MOV_RI) || (op == BYTECODE_MOV_RR) || (op == BYTECODE_LDC_RI))
+        return 1;
+    if ((op >= BYTECODE_LDR8_RI) && (op <= BYTECODE_LDR64_RA))
+        return 1;
+    if ((op >= BYTECODE_ADD_RRI) && (op <= BYTECODE_SHL_RRR))
+        return 1;
+    if ((op == BYTECODE_SETE_R) || (op == BYTECODE_SETNE_R))
+        return 1;
+    /* The value is the one of the first instruction of the pair */
+    if ((op == INTERPRETER_OP_MOV_RR_MOV_RR) || (op == INTERPRETER_OP_ADD_RRI_CMP_RI))
+        return 1;
+    return 0;
+}
+
+static void trace_decode_print(uint64_t number, interpreter_trace_entry *entry)
+{
+    printf("%16llu  0x%06x  %-14s", (unsigned long long) number, entry->address, interpreter_op_name(entry->op));
+    if (trace_decode_writes_register(entry->op))
+    {
+        printf("  r%d = 0x%llx", entry->r0, (unsigned long long) entry->value);
+    }
+    else if ((entry->op >= BYTECODE_STR8_RI) && (entry->op <= BYTECODE_STR64_RA))
+    {
+        printf("  stored r%d = 0x%llx", entry->r0, (unsigned long long) entry->value);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    interpreter_trace_header header;
+    interpreter_trace_entry entry;
+    uint64_t last = UINT64_MAX;
+    uint64_t index;
+    FILE *file;
+
+    if ((argc != 2) && (argc != 3))
+    {
+        printf("Usage: %s TRACE [COUNT]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 3)
+    {
+        last = strtoull(argv[2], NULL, 10);
+    }
+
+    file = fopen(argv[1], "rb");
+    if (file == 0)
+    {
+        return trace_decode_error("Error: could not open the trace file\n");
+    }
+    if ((fread(&header, sizeof(header), 1, file) != 1) ||
+        (memcmp(header.magic, INTERPRETER_TRACE_MAGIC, sizeof(header.magic)) != 0) ||
+        (header.entry_size != sizeof(interpreter_trace_entry)))
+    {
+        fclose(file);
+        return trace_decode_error("Error: not a trace file of this interpreter\n");
+    }
+
+    printf("%16s  %8s  %-14s  %s\n", "#", "address", "operation", "value");
+    for (index = 0; index < header.count; index++)
+    {
+        if (fread(&entry, sizeof(entry), 1, file) != 1)
+        {
+            fclose(file);
+            return trace_decode_error("Error: the trace file is cut short\n");
+        }
+        if (header.count - index <= last)
+        {
+            trace_decode_print(header.first + index, &entry);
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+#include "bytecode.c"
+#include "x86_64.c"
+#include "interpreter.c"
@@ -0,0 +1,137 @@
+#include "x86_64.h"
+
+
+static uint8_t *x86_64_prefix(uint8_t *out, uint32_t prefix, uint8_t reg, uint8_t index, uint8_t base)
+{
+    uint8_t rex = 0x40;
+    if (prefix & X86_64_16)
+        *out++ = 0x66;
+    if (prefix & X86_64_W)
+        rex = rex | 0x8;
+    if ((reg != X86_64_NONE) && (reg & 0x8))
+        rex = rex | 0x4;
+    if ((index != X86_64_NONE) && (index & 0x8))
+        rex = rex | 0x2;
+    if ((base != X86_64_NONE) && (base & 0x8))
+        rex = rex | 0x1;
+    if ((rex != 0x40) || (prefix & X86_64_BYTE))
+        *out++ = rex;
+    return out;
+}
+
+static uint8_t *x86_64_opcode(uint8_t *out, uint32_t opcode)
+{
+    if (opcode > 0xff)
+        *out++ = (opcode >> 8) & 0xff;
+    *out++ = opcode & 0xff;
+    return out;
+}
+
+uint8_t *x86_64_rr(uint8_t *out, uint32_t prefix, uint32_t opcode, uint8_t reg, uint8_t rm)
+{
+    out = x86_64_prefix(out, prefix, reg, X86_64_NONE, rm);
+    out = x86_64_opcode(out, opcode);
+    *out++ = 0xc0 | ((reg & 0x7) << 3) | (rm & 0x7);
+    return out;
+}
+
+uint8_t *x86_64_rm(uint8_t *out, uint32_t prefix, uint32_t opcode, uint8_t reg, uint8_t base, uint8_t index, uint8_t scale, int32_t disp)
+{
+    /*
+        ModRM.rm = 100 always selects SIB.
+        SIB.index = 100 (without REX.X) means no index, so rsp could not be an index.
+        SIB.base = 101 with ModRM.mod = 00 means no base, only disp32.
+    */
+    uint8_t mod = (base == X86_64_NONE) ? 0x00 : 0x80;
+    uint8_t sib_index = (index == X86_64_NONE) ? 0x4 : (index & 0x7);
+    uint8_t sib_base = (base == X86_64_NONE) ? 0x5 : (base & 0x7);
+
+    out = x86_64_prefix(out, prefix, reg, index, base);
+    out = x86_64_opcode(out, opcode);
+    *out++ = mod | ((reg & 0x7) << 3) | 0x4;
+    *out++ = ((scale & 0x3) << 6) | (sib_index << 3) | sib_base;
+    return x86_64_imm32(out, disp);
+}
+
+uint8_t *x86_64_imm8(uint8_t *out, uint8_t imm)
+{
+    *out++ = imm;
+    return out;
+}
+
+uint8_t *x86_64_imm16(uint8_t *out, uint16_t imm)
+{
+    *out++ = imm & 0xff;
+    *out++ = (imm >> 8) & 0xff;
+    return out;
+}
+
+uint8_t *x86_64_imm32(uint8_t *out, int32_t imm)
+{
+    uint32_t value = (uint32_t) imm;
+    *out++ = value & 0xff;
+    *out++ = (value >> 8) & 0xff;
+    *out++ = (value >> 16) & 0xff;
+    *out++ = (value >> 24) & 0xff;
+    return out;
+}
+
+uint8_t *x86_64_imm64(uint8_t *out, uint64_t imm)
+{
+    out = x86_64_imm32(out, (int32_t) (imm & 0xffffffff));
+    return x86_64_imm32(out, (int32_t) (imm >> 32));
+}
+
+uint8_t *x86_64_mov_imm64(uint8_t *out, uint8_t reg, uint64_t imm)
+{
+    *out++ = (reg & 0x8) ? 0x49 : 0x48;
+    *out++ = 0xb8 | (reg & 0x7);
+    return x86_64_imm64(out, imm);
+}
+
+uint8_t *x86_64_push(uint8_t *out, uint8_t reg)
+{
+    if (reg & 0x8)
+        *out++ = 0x41;
+    *out++ = 0x50 | (reg & 0x7);
+    return out;
+}
+
+uint8_t *x86_64_pop(uint8_t *out, uint8_t reg)
+{
+    if (reg & 0x8)
+        *out++ = 0x41;
+    *out++ = 0x58 | (reg & 0x7);
+    return out;
+}
+
+uint8_t *x86_64_syscall(uint8_t *out)
+{
+    *out++ = 0x0f;
+    *out++ = 0x05;
+    return out;
+}
+
+uint8_t *x86_64_jmp(uint8_t *out)
+{
+    *out++ = 0xe9;
+    return x86_64_imm32(out, 0);
+}
+
+uint8_t *x86_64_call(uint8_t *out)
+{
+    *out++ = 0xe8;
+    return x86_64_imm32(out, 0);
+}
+
+uint8_t *x86_64_jcc(uint8_t *out, uint8_t cc)
+{
+    *out++ = 0x0f;
+    *out++ = 0x80 | cc;
+    return x86_64_imm32(out, 0);
+}
+
+void x86_64_patch_rel32(uint8_t *end, uint8_t *target)
+{
+    x86_64_imm32(end - 4, (int32_t) (target - end));
+}
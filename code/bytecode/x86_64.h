@@ -0,0 +1,86 @@
+#ifndef PINAPL_X86_64_H_
+#define PINAPL_X86_64_H_
+
+/*
+                                x86-64 encoding
+
+    Minimal set of helpers to put x86-64 instructions into a buffer.
+    Every helper takes the output cursor and returns it advanced past
+    the bytes it wrote, the caller makes sure there is enough space.
+
+    Registers are numbered the way the hardware encodes them, where
+    the 4th bit goes into the REX prefix.
+
+    Memory operands are always encoded with the SIB byte and a 32-bit
+    displacement, so there are no special cases for rsp/rbp/r12/r13.
+*/
+
+#include <stdint.h>
+
+
+enum
+{
+    X86_64_RAX = 0x0,
+    X86_64_RCX = 0x1,
+    X86_64_RDX = 0x2,
+    X86_64_RBX = 0x3,
+    X86_64_RSP = 0x4,
+    X86_64_RBP = 0x5,
+    X86_64_RSI = 0x6,
+    X86_64_RDI = 0x7,
+    X86_64_R8  = 0x8,
+    X86_64_R9  = 0x9,
+    X86_64_R10 = 0xa,
+    X86_64_R11 = 0xb,
+    X86_64_R12 = 0xc,
+    X86_64_R13 = 0xd,
+    X86_64_R14 = 0xe,
+    X86_64_R15 = 0xf,
+
+    X86_64_NONE = 0xff, /* No base or no index in the memory operand */
+};
+
+/* Condition codes, the low nibble of Jcc/SETcc opcodes */
+enum
+{
+    X86_64_CC_B  = 0x2,
+    X86_64_CC_AE = 0x3,
+    X86_64_CC_E  = 0x4,
+    X86_64_CC_NE = 0x5,
+    X86_64_CC_BE = 0x6,
+    X86_64_CC_A  = 0x7,
+    X86_64_CC_NS = 0x9,
+};
+
+/* Instruction prefixes */
+enum
+{
+    X86_64_W      = 0x1, /* REX.W, 64-bit operand */
+    X86_64_16     = 0x2, /* 0x66, 16-bit operand */
+    X86_64_BYTE   = 0x4, /* Always emit REX, so byte registers are sil/dil/..., not ah/bh/... */
+};
+
+/* Opcodes longer than one byte are written as 0x0fXX */
+uint8_t *x86_64_rr(uint8_t *out, uint32_t prefix, uint32_t opcode, uint8_t reg, uint8_t rm);
+uint8_t *x86_64_rm(uint8_t *out, uint32_t prefix, uint32_t opcode, uint8_t reg, uint8_t base, uint8_t index, uint8_t scale, int32_t disp);
+
+uint8_t *x86_64_imm8(uint8_t *out, uint8_t imm);
+uint8_t *x86_64_imm16(uint8_t *out, uint16_t imm);
+uint8_t *x86_64_imm32(uint8_t *out, int32_t imm);
+uint8_t *x86_64_imm64(uint8_t *out, uint64_t imm);
+
+/* mov reg, imm64 */
+uint8_t *x86_64_mov_imm64(uint8_t *out, uint8_t reg, uint64_t imm);
+
+uint8_t *x86_64_push(uint8_t *out, uint8_t reg);
+uint8_t *x86_64_pop(uint8_t *out, uint8_t reg);
+uint8_t *x86_64_syscall(uint8_t *out);
+
+/* Jumps and calls end with a zero rel32, point it somewhere with x86_64_patch_rel32 */
+uint8_t *x86_64_jmp(uint8_t *out);
+uint8_t *x86_64_call(uint8_t *out);
+uint8_t *x86_64_jcc(uint8_t *out, uint8_t cc);
+void x86_64_patch_rel32(uint8_t *end, uint8_t *target);
+
+
+#endif /* PINAPL_X86_64_H_ */
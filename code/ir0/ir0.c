@@ -1,7 +1,8 @@
 #include "ir0.h"
+#include <string.h>
 #include "../bytecode/bytecode.h"
 
-uint32_t ir0_to_bytecode_opcode[68] =
+uint32_t ir0_to_bytecode_opcode[IR0_OPCODE_COUNT] =
 {
     BYTECODE_INVALID,
     BYTECODE_INVALID,
@@ -76,7 +77,77 @@ uint32_t ir0_to_bytecode_opcode[68] =
     BYTECODE_SETE_R,
     BYTECODE_SETNE_R,
     BYTECODE_CALL_I,
-    BYTECODE_CALL_I,
     BYTECODE_RET,
     BYTECODE_SYSCALL,
+
+    BYTECODE_INVALID,
+    BYTECODE_INVALID,
+    BYTECODE_INVALID,
+    BYTECODE_INVALID,
+    BYTECODE_INVALID,
+    BYTECODE_INVALID,
+    BYTECODE_INVALID,
 };
+
+uint64_t ir0_code_size(ir0 instruction)
+{
+    bytecode bc;
+    memset(&bc, 0, sizeof(bc));
+    bc.opcode = ir0_to_bytecode_opcode[instruction.opcode];
+    bc.r0 = instruction.r0;
+    bc.r1 = instruction.r1;
+    bc.r2 = instruction.r2;
+    return bytecode_size(bc);
+}
+
+int ir0_is_data(ir0 instruction)
+{
+    return (instruction.opcode >= IR0_OPCODE_BYTE) && (instruction.opcode <= IR0_OPCODE_ZERO);
+}
+
+uint64_t ir0_data_size(ir0 instruction)
+{
+    switch (instruction.opcode)
+    {
+        case IR0_OPCODE_BYTE: return 1;
+        case IR0_OPCODE_WORD: return 2;
+        case IR0_OPCODE_DWORD: return 4;
+        case IR0_OPCODE_QWORD: return 8;
+        case IR0_OPCODE_BYTES: return instruction.size;
+        case IR0_OPCODE_STRING: return strlen(instruction.data) + 1;
+        case IR0_OPCODE_ZERO: return instruction.size;
+    }
+    return 0;
+}
+
+/* Writes ir0_data_size(instruction) bytes, little-endian like the bytecode */
+void ir0_emit_data(uint8_t *output, ir0 instruction)
+{
+    uint64_t size = ir0_data_size(instruction);
+    uint64_t i;
+    switch (instruction.opcode)
+    {
+        case IR0_OPCODE_BYTE:
+        case IR0_OPCODE_WORD:
+        case IR0_OPCODE_DWORD:
+        case IR0_OPCODE_QWORD:
+        {
+            for (i = 0; i < size; i++)
+                output[i] = ((uint64_t) instruction.imm >> (8 * i)) & 0xff;
+        }
+        break;
+
+        case IR0_OPCODE_BYTES:
+        case IR0_OPCODE_STRING:
+        {
+            memcpy(output, instruction.data, size);
+        }
+        break;
+
+        case IR0_OPCODE_ZERO:
+        {
+            memset(output, 0, size);
+        }
+        break;
+    }
+}
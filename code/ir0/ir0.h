@@ -81,6 +81,25 @@ enum
     IR0_OPCODE_CALL_L,
     IR0_OPCODE_RET,
     IR0_OPCODE_SYSCALL,
+
+    /*
+        Initialised data, placed in the data section after the code,
+        a label right before a directive names the data.
+    */
+    IR0_OPCODE_BYTE,    /* imm, 1 byte */
+    IR0_OPCODE_WORD,    /* imm, 2 bytes */
+    IR0_OPCODE_DWORD,   /* imm, 4 bytes */
+    IR0_OPCODE_QWORD,   /* imm, 8 bytes */
+    IR0_OPCODE_BYTES,   /* size bytes from data */
+    IR0_OPCODE_STRING,  /* data up to and including the terminating 0 */
+    IR0_OPCODE_ZERO,    /* size zero bytes */
+
+    IR0_OPCODE_COUNT,
+};
+
+enum
+{
+    IR0_REGISTER_COUNT = 32,
 };
 
 typedef struct
@@ -88,9 +107,11 @@ typedef struct
     uint8_t opcode;
     uint8_t r0, r1, r2;
     uint8_t cc, c, cr, a;
-    int32_t imm;
+    int64_t imm;
     char const *label;
     uint32_t address;
+    char const *data;
+    uint32_t size;
 } ir0;
 
 typedef struct
@@ -99,6 +120,16 @@ typedef struct
     uint32_t address;
 } ir0_label;
 
-extern uint32_t ir0_to_bytecode_opcode[68];
+/* Immediates the 4-byte encoding carries, wider MOV immediates go to the constant pool */
+#define IR0_FITS_IMM16(IMM) (((IMM) >= -0x8000) && ((IMM) <= 0x7fff))
+
+extern uint32_t ir0_to_bytecode_opcode[IR0_OPCODE_COUNT];
+
+/* Bytes the instruction takes in the code, 8 when a register above r15 needs the WIDE prefix */
+uint64_t ir0_code_size(ir0 instruction);
+
+int ir0_is_data(ir0 instruction);
+uint64_t ir0_data_size(ir0 instruction);
+void ir0_emit_data(uint8_t *output, ir0 instruction);
 
 #endif /* PINAPL_IR0_H_ */
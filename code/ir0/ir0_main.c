@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE /* sigaction, sigjmp_buf, pwrite, madvise, mincore, MAP_ANONYMOUS */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,42 +8,20 @@
 #include "ir0_parser.h"
 #include "../lexer.h"
 #include "../bytecode/interpreter.h"
+#include "../bytecode/jit.h"
+#include "../bytecode/aot.h"
+#include "../bytecode/image.h"
+#include "../bytecode/sampler.h"
+#include "../bytecode/counters.h"
 
 ir0_label labels[64] = {};
+int64_t constant_pool[256] = {};
 ir0 instruction_stream[] =
 {
     { .opcode = IR0_OPCODE_LABEL, .label = "main" },
 
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x48 },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x100 },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x65 },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x101 },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x6c },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x102 },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x6c },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x103 },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x6f },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x104 },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x2c },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x105 },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x20 },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x106 },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x57 },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x107 },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x6f },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x108 },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x72 },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x109 },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x6c },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x10a },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x64 },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x10b },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x21 },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x10c },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0xa },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x10d },
-    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 0, .imm = 0x0 },
-    { .opcode = IR0_OPCODE_STR8_RI, .r0 = 0, .imm = 0x10e },
+    { .opcode = IR0_OPCODE_LDR8_RL, .r0 = 3, .label = "hello" },
+    { .opcode = IR0_OPCODE_MOV_RI,  .r0 = 4, .imm = 0x0123456789abcdef },
 
     { .opcode = IR0_OPCODE_MOV_RI, .r0 = 0, .imm = 0 },
     { .opcode = IR0_OPCODE_MOV_RI, .r0 = 1, .imm = 1 },
@@ -55,6 +34,16 @@ ir0 instruction_stream[] =
 
     { .opcode = IR0_OPCODE_CMP_RI, .r0 = 0, .imm = 0x3dc },
     { .opcode = IR0_OPCODE_SETE_R, .r0 = 8 },
+
+    { .opcode = IR0_OPCODE_MOV_RI, .r0 = 0, .imm = 1 },
+    { .opcode = IR0_OPCODE_MOV_RI, .r0 = 1, .label = "hello" },
+    { .opcode = IR0_OPCODE_MOV_RI, .r0 = 2, .imm = 14 },
+    { .opcode = IR0_OPCODE_SYSCALL, .imm = BYTECODE_SYSCALL_WRITE },
+    { .opcode = IR0_OPCODE_MOV_RI, .r0 = 0, .imm = 0 },
+    { .opcode = IR0_OPCODE_SYSCALL, .imm = BYTECODE_SYSCALL_EXIT },
+
+    { .opcode = IR0_OPCODE_LABEL, .label = "hello" },
+    { .opcode = IR0_OPCODE_STRING, .data = "Hello, World!\n" },
 };
 
 static char const *input_filename = "code/ir0/fib.ir0";
@@ -65,7 +54,8 @@ static char const *input_filename = "code/ir0/fib.ir0";
 #include <errno.h>
 #include <sys/mman.h>
 
-int main()
+/* Parses the input and encodes the program into new interpreter memory, layout gets the sections */
+static int ir0_assemble(interpreter *interp, bytecode_image *layout, uint64_t *label_count_out)
 {
     int ec;
 
@@ -119,73 +109,644 @@ int main()
 
     /* Interpreter */
 
-    uint32_t interpreter_memory_size = 0x1000; /* 4k page */
+    /* Address space for the program to grow into, only the pages it touches get committed */
+    uint64_t interpreter_memory_size = 0x40000000;
 
-    interpreter interpreter = {};
-    interpreter.memory = malloc(interpreter_memory_size);
-    interpreter.memory_size = interpreter_memory_size;
+    if (interpreter_create_memory(interp, interpreter_memory_size) != 0)
+    {
+        return 1;
+    }
 
+    /*
+        Code goes from address 0, then the constant pool, then the data.
+        The first pass finds where the labels are, the second pass writes everything.
+    */
     uint64_t instruction_address = 0;
+    uint64_t data_size = 0;
+    uint64_t constant_count = 0;
     uint64_t instruction_index = 0;
     uint64_t label_count = 0;
     for (; instruction_index < ARRAY_COUNT(instruction_stream); instruction_index++)
+    {
+        ir0 instruction = instruction_stream[instruction_index];
+        if (ir0_is_data(instruction))
+        {
+            data_size += ir0_data_size(instruction);
+        }
+        else if (instruction.opcode != IR0_OPCODE_LABEL)
+        {
+            if ((instruction.opcode == IR0_OPCODE_MOV_RI) && !IR0_FITS_IMM16(instruction.imm))
+            {
+                /* Too wide for MOV, it becomes LDC from the pool. */
+                uint64_t constant_index = 0;
+                while ((constant_index < constant_count) && (constant_pool[constant_index] != instruction.imm))
+                    constant_index += 1;
+                if (constant_index == constant_count)
+                {
+                    if (constant_count == ARRAY_COUNT(constant_pool))
+                    {
+                        printf("Error: too many constants\n");
+                        return 1;
+                    }
+                    constant_pool[constant_count] = instruction.imm;
+                    constant_count += 1;
+                }
+            }
+            if ((instruction.r0 >= IR0_REGISTER_COUNT) || (instruction.r1 >= IR0_REGISTER_COUNT) || (instruction.r2 >= IR0_REGISTER_COUNT))
+            {
+                printf("Error: instruction %llu uses a register above r%d\n", (unsigned long long) instruction_index, IR0_REGISTER_COUNT - 1);
+                return 1;
+            }
+            instruction_address += ir0_code_size(instruction);
+        }
+    }
+    /* One zero instruction between the code and the pool, so falling off the end of the code still stops. */
+    uint64_t pool_address = (instruction_address + 4 + 0x7) & ~(uint64_t) 0x7;
+    uint64_t data_address = pool_address + 8 * constant_count;
+    if (data_address + data_size > interp->memory_size)
+    {
+        printf("Error: the program does not fit in the memory\n");
+        return 1;
+    }
+
+    uint64_t data_cursor = data_address;
+    instruction_address = 0;
+    for (instruction_index = 0; instruction_index < ARRAY_COUNT(instruction_stream); instruction_index++)
     {
         ir0 instruction = instruction_stream[instruction_index];
         if (instruction.opcode == IR0_OPCODE_LABEL)
         {
+            /* The label names whatever comes next, the code or the data. */
+            uint64_t next_index = instruction_index + 1;
+            while ((next_index < ARRAY_COUNT(instruction_stream)) && (instruction_stream[next_index].opcode == IR0_OPCODE_LABEL))
+                next_index += 1;
+            if (label_count == ARRAY_COUNT(labels))
+            {
+                printf("Error: too many labels\n");
+                return 1;
+            }
             labels[label_count].name = instruction.label;
             labels[label_count].address = instruction_address;
+            if ((next_index < ARRAY_COUNT(instruction_stream)) && ir0_is_data(instruction_stream[next_index]))
+                labels[label_count].address = data_cursor;
             label_count += 1;
         }
+        else if (ir0_is_data(instruction))
+        {
+            data_cursor += ir0_data_size(instruction);
+        }
         else
         {
-            /* instruction->address = instruction_address; */
-            if ((instruction.opcode == IR0_OPCODE_JMP_L) ||
-                (instruction.opcode == IR0_OPCODE_JL_L)  ||
-                (instruction.opcode == IR0_OPCODE_JLE_L) ||
-                (instruction.opcode == IR0_OPCODE_JG_L)  ||
-                (instruction.opcode == IR0_OPCODE_JGE_L))
+            instruction_address += ir0_code_size(instruction);
+        }
+    }
+
+    uint64_t constant_index = 0;
+    for (; constant_index < constant_count; constant_index++)
+    {
+        *(int64_t *) (interp->memory + pool_address + 8 * constant_index) = constant_pool[constant_index];
+    }
+
+    data_cursor = data_address;
+    instruction_address = 0;
+    for (instruction_index = 0; instruction_index < ARRAY_COUNT(instruction_stream); instruction_index++)
+    {
+        ir0 instruction = instruction_stream[instruction_index];
+        if (instruction.opcode == IR0_OPCODE_LABEL)
+        {
+            continue;
+        }
+        if (ir0_is_data(instruction))
+        {
+            ir0_emit_data(interp->memory + data_cursor, instruction);
+            data_cursor += ir0_data_size(instruction);
+            continue;
+        }
+
+        if (instruction.label)
+        {
+            uint64_t label_index = 0;
+            for (; label_index < label_count; label_index++)
             {
-                int label_index = 0;
-                for (; label_index < label_count; label_index++)
-                {
-                    if (strcmp(labels[label_index].name, instruction.label) == 0)
-                    {
-                        /*
-                            `-4` is because we also need to subtract the width of the current instruction,
-                            but the width of the current instruction will be computed only when we call
-                            bytecode_encode, so there's temporary `-4`, because bytecode width is always 4 bytes (for now?)
-                            and I need to figure out a better way to compute this relative addressing,
-                            or make the interpreter execute instruction first, and only then issue `rip += instruction_width`
-                        */
-                        instruction.imm = (int64_t) labels[label_index].address - (int64_t) instruction_address - 4;
-                        break;
-                    }
-                }
+                if (strcmp(labels[label_index].name, instruction.label) == 0)
+                    break;
+            }
+            if (label_index == label_count)
+            {
+                printf("Error: unknown label \"%s\"\n", instruction.label);
+                return 1;
+            }
+
+            if (((instruction.opcode >= IR0_OPCODE_JMP_L) && (instruction.opcode <= IR0_OPCODE_JGE_L)) ||
+                (instruction.opcode == IR0_OPCODE_CALL_L))
+            {
+                /* Relative to the next instruction, the interpreter moves rip past the current one first. */
+                instruction.imm = (int64_t) labels[label_index].address - (int64_t) instruction_address - (int64_t) ir0_code_size(instruction);
+            }
+            else
+            {
+                /* Loads and stores of a label address it directly */
+                instruction.imm = labels[label_index].address;
+            }
+        }
+
+        bytecode bc;
+        bc.opcode = ir0_to_bytecode_opcode[instruction.opcode];
+        if ((instruction.opcode == IR0_OPCODE_MOV_RI) && !IR0_FITS_IMM16(instruction.imm))
+        {
+            for (constant_index = 0; constant_pool[constant_index] != instruction.imm; constant_index++);
+            bc.opcode = BYTECODE_LDC_RI;
+            instruction.imm = ((int64_t) (pool_address + 8 * constant_index) - (int64_t) (instruction_address + ir0_code_size(instruction))) / 4;
+        }
+        if ((bc.opcode != BYTECODE_JMP_I) && ((bc.opcode < BYTECODE_JE_I) || (bc.opcode > BYTECODE_JGE_I)) &&
+            (bc.opcode != BYTECODE_CALL_I) && !IR0_FITS_IMM16(instruction.imm))
+        {
+            printf("Error: immediate 0x%llx of instruction %llu does not fit into 16 bits\n",
+                (unsigned long long) instruction.imm, (unsigned long long) instruction_index);
+            return 1;
+        }
+        bc.r0 = instruction.r0;
+        bc.r1 = instruction.r1;
+        bc.r2 = instruction.r2;
+        bc.imm = instruction.imm;
+        bc.cc = instruction.cc;
+        bc.cr = instruction.cr;
+        bc.c = instruction.c;
+        bc.a = instruction.a;
+        instruction_address += bytecode_encode(interp->memory + instruction_address, interp->memory_size - instruction_address, bc);
+    }
+
+    layout->code_size = instruction_address;
+    layout->data_address = data_address;
+    layout->data_size = data_size;
+    *label_count_out = label_count;
+    return 0;
+}
+
+/* Names for the addresses, from the source or from the symbols of the loaded image */
+static bytecode_image_label *ir0_symbols(bytecode_image *image, int loaded, uint64_t label_count, uint64_t *count)
+{
+    uint64_t symbol_count = loaded ? image->symbol_count : label_count;
+    bytecode_image_label *symbols = malloc((symbol_count + 1) * sizeof(bytecode_image_label));
+    uint64_t index = 0;
+    if (symbols == 0)
+    {
+        printf("Error: could not allocate memory for the symbols\n");
+        return 0;
+    }
+    for (; index < symbol_count; index++)
+    {
+        if (loaded)
+        {
+            symbols[index].name = image->strings + image->symbols[index].name;
+            symbols[index].address = image->symbols[index].address;
+        }
+        else
+        {
+            symbols[index].name = labels[index].name;
+            symbols[index].address = labels[index].address;
+        }
+    }
+    *count = symbol_count;
+    return symbols;
+}
+
+static int ir0_compare_symbols(void const *a, void const *b)
+{
+    bytecode_image_label const *x = a;
+    bytecode_image_label const *y = b;
+    return (x->address > y->address) - (x->address < y->address);
+}
+
+static void ir0_print_cache_row(interpreter_cache *cache, char const *name, uint64_t begin, uint64_t end, int always)
+{
+    interpreter_cache_stats stats;
+    interpreter_cache_sum(cache, begin, end, &stats);
+    if ((stats.accesses == 0) && !always)
+    {
+        return;
+    }
+    printf("  %-20s  %12llu  %7.2f%%  %7.2f%%\n", name, (unsigned long long) stats.accesses,
+        stats.accesses ? 100.0 * stats.l1_misses / stats.accesses : 0.0,
+        stats.l1_misses ? 100.0 * stats.l2_misses / stats.l1_misses : 0.0);
+}
+
+/* The code of a label goes up to the next label, L2 misses are out of the L1 misses */
+static void ir0_print_cache(interpreter_cache *cache, bytecode_image_label *symbols, uint64_t symbol_count, uint64_t code_size)
+{
+    uint64_t index = 0;
+    qsort(symbols, symbol_count, sizeof(bytecode_image_label), ir0_compare_symbols);
+    printf("  %-20s  %12s  %8s  %8s\n", "label", "accesses", "L1 miss", "L2 miss");
+    ir0_print_cache_row(cache, "(before the labels)", 0, symbol_count ? symbols[0].address : code_size, 0);
+    for (; (index < symbol_count) && (symbols[index].address < code_size); index++)
+    {
+        uint64_t end = code_size;
+        if (index + 1 < symbol_count)
+        {
+            if (symbols[index + 1].address == symbols[index].address)
+                continue;
+            if (symbols[index + 1].address < code_size)
+                end = symbols[index + 1].address;
+        }
+        ir0_print_cache_row(cache, symbols[index].name, symbols[index].address, end, 0);
+    }
+    ir0_print_cache_row(cache, "(past the code)", code_size, UINT64_MAX, 0);
+    ir0_print_cache_row(cache, "(total)", 0, UINT64_MAX, 1);
+}
+
+int main(int argc, char **argv)
+{
+    int ec;
+    int use_jit = 0;
+    int use_tiered = 0;
+    int use_traced = 0;
+    int print_stats = 0;
+    char const *aot_filename = NULL;
+    char const *image_filename = NULL;
+    char const *load_filename = NULL;
+    char const *trace_filename = NULL;
+    uint64_t trace_size = 0x10000;
+    char const *sample_filename = NULL;
+    uint32_t sample_frequency = SAMPLER_DEFAULT_FREQUENCY;
+    int use_counters = 0;
+    uint64_t counters_period = 0;
+    int use_cache = 0;
+    uint64_t cache_line_size = 64;
+    uint64_t cache_l1_kib = 32;
+    uint32_t cache_l1_ways = 8;
+    uint64_t cache_l2_kib = 512;
+    uint32_t cache_l2_ways = 8;
+    int use_profile = 0;
+    int use_checked = 0;
+    uint32_t hot_threshold = 1000;
+    uint32_t sandbox = INTERPRETER_SANDBOX_NONE;
+    int huge_pages = 0;
+    int arg_index = 1;
+    for (; arg_index < argc; arg_index++)
+    {
+        if (strcmp(argv[arg_index], "--jit") == 0)
+        {
+            use_jit = 1;
+        }
+        else if (strcmp(argv[arg_index], "--tiered") == 0)
+        {
+            use_tiered = 1;
+        }
+        else if (strcmp(argv[arg_index], "--traced") == 0)
+        {
+            use_traced = 1;
+        }
+        else if (strncmp(argv[arg_index], "--threshold=", 12) == 0)
+        {
+            hot_threshold = strtoul(argv[arg_index] + 12, NULL, 10);
+            if (hot_threshold == 0) hot_threshold = 1;
+        }
+        else if (strcmp(argv[arg_index], "--sandbox=guard") == 0)
+        {
+            sandbox = INTERPRETER_SANDBOX_GUARD;
+        }
+        else if (strcmp(argv[arg_index], "--sandbox=mask") == 0)
+        {
+            sandbox = INTERPRETER_SANDBOX_MASK;
+        }
+        else if (strcmp(argv[arg_index], "--huge-pages") == 0)
+        {
+            huge_pages = 1;
+        }
+        else if (strcmp(argv[arg_index], "--stats") == 0)
+        {
+            print_stats = 1;
+        }
+        else if (strncmp(argv[arg_index], "--aot=", 6) == 0)
+        {
+            aot_filename = argv[arg_index] + 6;
+        }
+        else if (strncmp(argv[arg_index], "--image=", 8) == 0)
+        {
+            image_filename = argv[arg_index] + 8;
+        }
+        else if (strncmp(argv[arg_index], "--load=", 7) == 0)
+        {
+            load_filename = argv[arg_index] + 7;
+        }
+        else if (strncmp(argv[arg_index], "--trace=", 8) == 0)
+        {
+            trace_filename = argv[arg_index] + 8;
+        }
+        else if (strncmp(argv[arg_index], "--trace-size=", 13) == 0)
+        {
+            trace_size = strtoull(argv[arg_index] + 13, NULL, 10);
+        }
+        else if (strncmp(argv[arg_index], "--sample=", 9) == 0)
+        {
+            sample_filename = argv[arg_index] + 9;
+        }
+        else if (strncmp(argv[arg_index], "--sample-rate=", 14) == 0)
+        {
+            sample_frequency = strtoul(argv[arg_index] + 14, NULL, 10);
+        }
+        else if (strcmp(argv[arg_index], "--counters") == 0)
+        {
+            use_counters = 1;
+        }
+        else if (strncmp(argv[arg_index], "--counters-period=", 18) == 0)
+        {
+            use_counters = 1;
+            counters_period = strtoull(argv[arg_index] + 18, NULL, 10);
+        }
+        else if (strcmp(argv[arg_index], "--profile") == 0)
+        {
+            use_profile = 1;
+        }
+        else if (strcmp(argv[arg_index], "--checked") == 0)
+        {
+            use_checked = 1;
+        }
+        else if (strcmp(argv[arg_index], "--cache") == 0)
+        {
+            use_cache = 1;
+        }
+        else if ((strncmp(argv[arg_index], "--cache-l1=", 11) == 0) || (strncmp(argv[arg_index], "--cache-l2=", 11) == 0))
+        {
+            /* KIB:WAYS, the ways stay as they are without them */
+            char *end;
+            uint64_t kib = strtoull(argv[arg_index] + 11, &end, 10);
+            uint32_t ways = (*end == ':') ? strtoul(end + 1, NULL, 10) : 0;
+            use_cache = 1;
+            if (argv[arg_index][9] == '1')
+            {
+                cache_l1_kib = kib;
+                if (ways) cache_l1_ways = ways;
+            }
+            else
+            {
+                cache_l2_kib = kib;
+                if (ways) cache_l2_ways = ways;
+            }
+        }
+        else if (strncmp(argv[arg_index], "--cache-line=", 13) == 0)
+        {
+            use_cache = 1;
+            cache_line_size = strtoull(argv[arg_index] + 13, NULL, 10);
+        }
+        else
+        {
+            printf("Usage: %s [--jit | --tiered | --traced] [--threshold=N] [--sandbox=guard | --sandbox=mask] [--huge-pages] [--stats] [--trace=FILE] [--trace-size=N] [--sample=FILE] [--sample-rate=HZ] [--counters] [--counters-period=N] [--cache] [--cache-l1=KIB:WAYS] [--cache-l2=KIB:WAYS] [--cache-line=BYTES] [--profile] [--checked] [--load=IMAGE] [--image=FILE | --aot=FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    interpreter interpreter = {};
+    bytecode_image image = {};
+    uint64_t label_count = 0;
+    interpreter.sandbox = sandbox;
+    interpreter.huge_pages = huge_pages;
+    if (load_filename)
+    {
+        /* The image brings the code, the data and the entry point, nothing to parse */
+        ec = bytecode_image_load(&image, load_filename);
+        if (ec != 0)
+        {
+            return 1;
+        }
+        interpreter.memory = image.memory;
+        interpreter.memory_size = image.memory_size;
+        interpreter.registers[BYTECODE_RIP] = image.entry;
+        if ((sandbox != INTERPRETER_SANDBOX_NONE) || huge_pages)
+        {
+            /* The image mapping has neither, copy what is initialised into memory that does */
+            ec = interpreter_create_memory(&interpreter, image.memory_size);
+            if (ec != 0)
+            {
+                return 1;
             }
+            memcpy(interpreter.memory, image.memory, image.data_address + image.data_size);
+        }
+    }
+    else
+    {
+        ec = ir0_assemble(&interpreter, &image, &label_count);
+        if (ec != 0)
+        {
+            return 1;
+        }
+    }
 
-            bytecode bc;
-            bc.opcode = ir0_to_bytecode_opcode[instruction.opcode];
-            bc.r0 = instruction.r0;
-            bc.r1 = instruction.r1;
-            bc.r2 = instruction.r2;
-            bc.imm = instruction.imm;
-            bc.cc = instruction.cc;
-            bc.cr = instruction.cr;
-            bc.c = instruction.c;
-            bc.a = instruction.a;
-            instruction_address += bytecode_encode(interpreter.memory + instruction_address, interpreter.memory_size - instruction_address, bc);
+    if (image_filename)
+    {
+        bytecode_image_label image_labels[ARRAY_COUNT(labels)];
+        uint64_t label_index = 0;
+        for (; label_index < label_count; label_index++)
+        {
+            image_labels[label_index].name = labels[label_index].name;
+            image_labels[label_index].address = labels[label_index].address;
         }
+        image.memory = interpreter.memory;
+        image.memory_size = interpreter.memory_size;
+        image.entry = 0;
+        for (label_index = 0; label_index < label_count; label_index++)
+        {
+            if (strcmp(labels[label_index].name, "main") == 0)
+                image.entry = labels[label_index].address;
+        }
+        return bytecode_image_write(image_filename, &image, image_labels, label_count);
     }
 
-    ec = 0;
-    do
+    ec = interpreter_predecode(&interpreter, image.code_size);
+    if (ec != 0)
     {
-        ec = interpreter_step(&interpreter);
+        return 1;
     }
-    while (ec == 0);
+    /* The stack grows down from the end of the memory */
+    interpreter.registers[BYTECODE_RSP] = interpreter.memory_size;
+    interpreter.registers[BYTECODE_RBP] = interpreter.memory_size;
+
+    if (aot_filename)
+    {
+        /* Write the executable instead of running the program */
+        return aot_write_elf(&interpreter, image.data_address + image.data_size, aot_filename);
+    }
+
+    /* The last trace_size instructions go to trace_filename when the program does not exit by itself */
+    interpreter_trace trace = {};
+    if (trace_filename)
+    {
+        ec = interpreter_trace_create(&trace, trace_size);
+        if (ec != 0)
+        {
+            return 1;
+        }
+        interpreter.trace = &trace;
+    }
+
+    /* Every LDR and STR goes through a model of the cache, with the hit rates per label at the end */
+    interpreter_cache cache = {};
+    if (use_cache)
+    {
+        if (use_jit || use_tiered || use_traced)
+        {
+            printf("Error: --cache works with the interpreter only\n");
+            return 1;
+        }
+        ec = interpreter_cache_create(&cache, image.code_size, cache_line_size,
+                                      cache_l1_kib * 1024, cache_l1_ways, cache_l2_kib * 1024, cache_l2_ways);
+        if (ec != 0)
+        {
+            return 1;
+        }
+        interpreter.cache = &cache;
+    }
+
+    /* One variant of the run loop has all the hooks the run needs, the others stay out of it */
+    uint32_t variant = INTERPRETER_VARIANT_FAST;
+    if ((trace_filename != 0) + use_cache + (use_profile || counters_period) + use_checked > 1)
+    {
+        printf("Error: --trace, --cache, --profile and --checked do not go together\n");
+        return 1;
+    }
+    if (use_checked && (use_jit || use_tiered || use_traced))
+    {
+        printf("Error: --checked works with the interpreter only\n");
+        return 1;
+    }
+    if (trace_filename)
+        variant = INTERPRETER_VARIANT_TRACE;
+    else if (use_cache)
+        variant = INTERPRETER_VARIANT_CACHE;
+    else if (use_profile || counters_period)
+        variant = INTERPRETER_VARIANT_PROFILE;
+    else if (use_checked)
+        variant = INTERPRETER_VARIANT_CHECKED;
+    ec = interpreter_select_variant(&interpreter, variant);
+    if (ec != 0)
+    {
+        return 1;
+    }
+
+    /* Folded stacks of the guest go to sample_filename, only the interpreter knows the guest stack */
+    sampler sampler = {};
+    if (sample_filename)
+    {
+        if (use_jit || use_tiered || use_traced)
+        {
+            printf("Error: --sample works with the interpreter only\n");
+            return 1;
+        }
+        ec = sampler_start(&sampler, sample_frequency);
+        if (ec != 0)
+        {
+            return 1;
+        }
+    }
+
+    /* Host counters per guest instruction, only the interpreter counts those */
+    counters counters = {};
+    if (use_counters)
+    {
+        if (use_jit || use_tiered || use_traced || sample_filename)
+        {
+            printf("Error: --counters works with the interpreter only, and not with --sample\n");
+            return 1;
+        }
+        ec = counters_open(&counters, counters_period);
+        if (ec != 0)
+        {
+            counters_close(&counters);
+            return 1;
+        }
+    }
+
+    jit jit = {};
+    if (use_traced)
+    {
+        ec = jit_run_traced(&jit, &interpreter, hot_threshold);
+    }
+    else if (use_tiered)
+    {
+        ec = jit_run_tiered(&jit, &interpreter, hot_threshold);
+    }
+    else if (use_jit)
+    {
+        ec = jit_run(&jit, &interpreter);
+    }
+    else if (use_counters)
+    {
+        ec = counters_run(&counters, &interpreter);
+    }
+    else if (sample_filename)
+    {
+        ec = sampler_run(&sampler, &interpreter);
+        sampler_stop(&sampler);
+    }
+    else
+    {
+        do
+        {
+            ec = interpreter_run(&interpreter, UINT64_MAX);
+        }
+        while (ec == INTERPRETER_BUDGET_EXHAUSTED);
+    }
+    interpreter_flush(&interpreter);
     interpreter_print_state(&interpreter);
+    interpreter_print_profile(&interpreter);
+    int32_t samples_missing = 0;
+    if (use_counters)
+    {
+        counters_print(&counters);
+        samples_missing = counters_check_samples(&counters);
+    }
+    if (print_stats)
+    {
+        jit_print_stats(&jit);
+        printf("Interpreter: %lu mispredicted return(s)\n", interpreter.return_mispredicts);
+        printf("Interpreter: %lu write syscall(s) in %lu host write(s)\n", interpreter.write_syscalls, interpreter.host_writes);
+        printf("Interpreter: %lu KiB of %lu KiB guest memory committed\n", interpreter_committed_size(&interpreter) / 1024, interpreter.memory_size / 1024);
+    }
+    if (trace_filename && (ec != INTERPRETER_EXITED))
+    {
+        uint64_t count;
+        if (interpreter_trace_write(&trace, trace_filename, &count) == 0)
+        {
+            printf("Interpreter: the last %lu instruction(s) are in %s\n", count, trace_filename);
+        }
+    }
+    if (sample_filename || use_cache)
+    {
+        uint64_t symbol_count;
+        bytecode_image_label *symbols = ir0_symbols(&image, load_filename != NULL, label_count, &symbol_count);
+        if (symbols && sample_filename)
+        {
+            if (sampler_write_folded(&sampler, sample_filename, symbols, symbol_count) == 0)
+            {
+                printf("Interpreter: %lu sample(s) in %s\n", sampler.sample_count, sample_filename);
+            }
+        }
+        if (symbols && use_cache)
+        {
+            printf("Cache: %lu KiB %u-way L1, %lu KiB %u-way L2, %lu-byte lines\n",
+                cache_l1_kib, cache_l1_ways, cache_l2_kib, cache_l2_ways, cache_line_size);
+            ir0_print_cache(&cache, symbols, symbol_count, image.code_size);
+        }
+        free(symbols);
+    }
+    sampler_release(&sampler);
+    if (use_counters)
+    {
+        counters_close(&counters);
+    }
+    interpreter_cache_release(&cache);
+    interpreter_trace_release(&trace);
+    jit_release(&jit);
+    bytecode_image_unload(&image);
 
+    if (samples_missing)
+    {
+        return 1;
+    }
+    if (ec == INTERPRETER_EXITED)
+    {
+        return (int) (interpreter.exit_status & 0xff);
+    }
     return 0;
 }
 
@@ -194,6 +755,12 @@ int main()
 #include "ir0_parser.c"
 #include "../bytecode/interpreter.c"
 #include "../bytecode/bytecode.c"
+#include "../bytecode/x86_64.c"
+#include "../bytecode/jit.c"
+#include "../bytecode/aot.c"
+#include "../bytecode/image.c"
+#include "../bytecode/sampler.c"
+#include "../bytecode/counters.c"
 #include "../lexer.c"
 #include "../ascii.c"
 #include "../string_view.c"
@@ -1,4 +1,5 @@
 #include "ir0_parser.h"
+#include "ir0.h"
 #include <string_view.h>
 #include <imparser.h>
 
@@ -39,6 +40,8 @@ enum
     TOKEN_KEYWORD_WORD,
     TOKEN_KEYWORD_DWORD,
     TOKEN_KEYWORD_QWORD,
+    TOKEN_KEYWORD_STRING,
+    TOKEN_KEYWORD_ZERO,
 
     TOKEN_KEYWORD_COUNT = (TOKEN_KEYWORD_SYSCALL - TOKEN_KEYWORD),
 };
@@ -76,6 +79,8 @@ char const *ir0_token_tag_to_cstring(int tag)
         case TOKEN_KEYWORD_WORD: return "TOKEN_KEYWORD_WORD";
         case TOKEN_KEYWORD_DWORD: return "TOKEN_KEYWORD_DWORD";
         case TOKEN_KEYWORD_QWORD: return "TOKEN_KEYWORD_QWORD";
+        case TOKEN_KEYWORD_STRING: return "TOKEN_KEYWORD_STRING";
+        case TOKEN_KEYWORD_ZERO: return "TOKEN_KEYWORD_ZERO";
     }
     return token_tag_to_cstring(tag);
 }
@@ -111,6 +116,8 @@ static string_view keyword_string_table[] =
     { .data = "word",    .size = 4 },
     { .data = "dword",   .size = 5 },
     { .data = "qword",   .size = 5 },
+    { .data = "string",  .size = 6 },
+    { .data = "zero",    .size = 4 },
 };
 
 static int keyword_value_table[] =
@@ -144,6 +151,8 @@ static int keyword_value_table[] =
     TOKEN_KEYWORD_WORD,
     TOKEN_KEYWORD_DWORD,
     TOKEN_KEYWORD_QWORD,
+    TOKEN_KEYWORD_STRING,
+    TOKEN_KEYWORD_ZERO,
 };
 
 uint32 ir0_get_keywords(string_view **kst, int **kvt)
@@ -158,7 +167,11 @@ int32 ir0_identifier_is_register(string_view s)
     if ((s.size == 2) && (s.data[0] == 'r') && ascii_is_digit(s.data[1]))
         return (s.data[1] - '0');
     if ((s.size == 3) && (s.data[0] == 'r') && ascii_is_digit(s.data[1]) && ascii_is_digit(s.data[2]))
-        return (s.data[1] - '0') * 10 + (s.data[2] - '0');
+    {
+        int32 number = (s.data[1] - '0') * 10 + (s.data[2] - '0');
+        if (number < IR0_REGISTER_COUNT)
+            return number;
+    }
     return -1;
 }
 
@@ -191,6 +204,76 @@ bool32 ir0_parse_instruction(lexer *l)
     /* Rollback */
     *l = saved;
 
+    /*
+        Try to parse data directive:
+            byte 72, 101, 108
+            word 0x1234
+            string "Hello"
+            zero 16
+    */
+    token directive = lexer_get_token(l);
+    if ((directive.tag == TOKEN_KEYWORD_BYTE) ||
+        (directive.tag == TOKEN_KEYWORD_WORD) ||
+        (directive.tag == TOKEN_KEYWORD_DWORD) ||
+        (directive.tag == TOKEN_KEYWORD_QWORD))
+    {
+        lexer_eat_token(l);
+        token value = lexer_get_token(l);
+        if (value.tag == TOKEN_LITERAL_INTEGER)
+        {
+            printf("DATA: "STRING_VIEW_FMT_UNQUOTED, STRING_VIEW_ARG(directive.span));
+            while (value.tag == TOKEN_LITERAL_INTEGER)
+            {
+                lexer_eat_token(l);
+                printf(" 0x%llx", value.integer_value);
+
+                token comma = lexer_get_token(l);
+                if (comma.tag != ',')
+                    break;
+                lexer_eat_token(l);
+                printf(",");
+                value = lexer_get_token(l);
+            }
+            printf("\n");
+            if (value.tag == TOKEN_LITERAL_INTEGER)
+                return true;
+        }
+        printf("Parser Error: Data directive at %d:%d should be followed by comma separated integers\n", directive.line, directive.column);
+        *l = saved;
+        return false;
+    }
+    else if (directive.tag == TOKEN_KEYWORD_STRING)
+    {
+        lexer_eat_token(l);
+        token value = lexer_get_token(l);
+        if (value.tag == TOKEN_LITERAL_STRING)
+        {
+            lexer_eat_token(l);
+            printf("DATA: string "STRING_VIEW_FMT"\n", STRING_VIEW_ARG(value.span));
+            return true;
+        }
+        printf("Parser Error: String directive at %d:%d should be followed by a string in quotes\n", directive.line, directive.column);
+        *l = saved;
+        return false;
+    }
+    else if (directive.tag == TOKEN_KEYWORD_ZERO)
+    {
+        lexer_eat_token(l);
+        token value = lexer_get_token(l);
+        if (value.tag == TOKEN_LITERAL_INTEGER)
+        {
+            lexer_eat_token(l);
+            printf("DATA: zero 0x%llx\n", value.integer_value);
+            return true;
+        }
+        printf("Parser Error: Zero directive at %d:%d should be followed by the size\n", directive.line, directive.column);
+        *l = saved;
+        return false;
+    }
+
+    /* Rollback */
+    *l = saved;
+
     /* Try to parse instruction */
     token instruction_keyword;
     token bracket_open, bracket_close;
@@ -246,6 +329,15 @@ bool32 ir0_parse_instruction(lexer *l)
                                 return true;
                             }
                         }
+                        else
+                        {
+                            /* Address of a label */
+                            printf("INSTRUCTION: "STRING_VIEW_FMT_UNQUOTED" "STRING_VIEW_FMT_UNQUOTED", "STRING_VIEW_FMT_UNQUOTED"\n",
+                                STRING_VIEW_ARG(instruction_keyword.span),
+                                STRING_VIEW_ARG(argument1.span),
+                                STRING_VIEW_ARG(argument2.span));
+                            return true;
+                        }
                     }
                     else if (argument2.tag == TOKEN_LITERAL_INTEGER)
                     {
@@ -278,6 +370,20 @@ bool32 ir0_parse_instruction(lexer *l)
                                     return true;
                                 }
                             }
+                            else if (address.tag == TOKEN_IDENTIFIER)
+                            {
+                                /* Address of a label */
+                                lexer_eat_token(l);
+                                if (imparser_bracket_close(&bracket_close))
+                                {
+                                    printf("INSTRUCTION: "STRING_VIEW_FMT_UNQUOTED" "STRING_VIEW_FMT_UNQUOTED", "STRING_VIEW_FMT_UNQUOTED" ["STRING_VIEW_FMT_UNQUOTED"]\n",
+                                        STRING_VIEW_ARG(instruction_keyword.span),
+                                        STRING_VIEW_ARG(argument1.span),
+                                        STRING_VIEW_ARG(argument2.span), /* qualifier */
+                                        STRING_VIEW_ARG(address.span));
+                                    return true;
+                                }
+                            }
                         }
                     }
                     else
@@ -302,6 +408,15 @@ bool32 ir0_parse_instruction(lexer *l)
                 return true;
             }
         }
+        else if (argument1.tag == TOKEN_LITERAL_INTEGER)
+        {
+            /* Call code of syscall */
+            lexer_eat_token(l);
+            printf("INSTRUCTION: "STRING_VIEW_FMT_UNQUOTED" 0x%llx\n",
+                STRING_VIEW_ARG(instruction_keyword.span),
+                argument1.integer_value);
+            return true;
+        }
         else
         {
             /* 0 arguments */
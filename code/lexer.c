@@ -162,6 +162,30 @@ token lexer_get_token(lexer *l)
         t.span.size = parsed_characters;
         l->cursor += parsed_characters;
     }
+    else if (c == '"')
+    {
+        /* The span is what is between the quotes, escape sequences are left as they are. */
+        lexer_eat_char(l);
+        t.tag = TOKEN_LITERAL_STRING;
+        t.span.data = (char const *) (l->data + l->cursor);
+        t.span.size = 0;
+        c = lexer_get_char(l);
+        while ((c != 0) && (c != '"') && (c != '\n'))
+        {
+            if ((c == '\\') && (l->cursor + 1 < l->size))
+            {
+                lexer_eat_char(l);
+                t.span.size += 1;
+            }
+            lexer_eat_char(l);
+            t.span.size += 1;
+            c = lexer_get_char(l);
+        }
+        if (c == '"')
+            lexer_eat_char(l);
+        else
+            t.tag = TOKEN_INVALID;
+    }
     else
     {
         t.tag = c;